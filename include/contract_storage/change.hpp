@@ -44,6 +44,16 @@ namespace contract
 
 			jsondiff::JsonObject to_json() const;
 			static ContractEventInfo from_json(const jsondiff::JsonObject& json_obj);
+
+			ADD_SERIALIZE_METHODS;
+
+			template <typename Stream, typename Operation>
+			inline void SerializationOp(Stream& s, Operation ser_action) {
+				READWRITE(transaction_id);
+				READWRITE(contract_id);
+				READWRITE(event_name);
+				READWRITE(event_arg);
+			}
 		};
 		struct ContractUpgradeInfo
 		{
@@ -14,6 +14,7 @@ namespace contract
 			ContractCommitId commit_id;
 			std::string contract_id; // when is contract info change
 			std::string change_type;
+			uint32_t block_height = 0; // height of the block the commit belongs to, the one after the current block height of the service
 		};
 
 		typedef std::shared_ptr<ContractCommitInfo> ContractCommitInfoP;
@@ -4,8 +4,11 @@
 #include <unordered_map>
 #include <memory>
 #include <cinttypes>
+#include <map>
+#include <algorithm>
 #include <jsondiff/jsondiff.h>
 #include <fcrypto/sha256.hpp>
+#include <serialize.h>
 
 namespace contract
 {
@@ -22,6 +25,14 @@ namespace contract
 
 			jsondiff::JsonObject to_json() const;
 			static std::shared_ptr<ContractBalance> from_json(const jsondiff::JsonValue& json_value);
+
+			ADD_SERIALIZE_METHODS;
+
+			template <typename Stream, typename Operation>
+			inline void SerializationOp(Stream& s, Operation ser_action) {
+				READWRITE(asset_id);
+				READWRITE(amount);
+			}
 		};
 
 		struct ContractInfo
@@ -44,6 +55,31 @@ namespace contract
 
 			jsondiff::JsonObject to_json() const;
 			static std::shared_ptr<ContractInfo> from_json(const jsondiff::JsonValue& json_value);
+
+			// binary form follows to_json: apis and storage types sorted, zero balances dropped
+			template <typename Stream>
+			void Serialize(Stream& s) const {
+				std::vector<std::string> ordered_apis(apis.begin(), apis.end());
+				std::sort(ordered_apis.begin(), ordered_apis.end());
+				std::vector<std::string> ordered_offline_apis(offline_apis.begin(), offline_apis.end());
+				std::sort(ordered_offline_apis.begin(), ordered_offline_apis.end());
+				std::map<std::string, uint32_t> ordered_storage_types(storage_types.begin(), storage_types.end());
+				std::vector<ContractBalance> nonzero_balances;
+				for (const auto& balance : balances) {
+					if (balance.amount != 0)
+						nonzero_balances.push_back(balance);
+				}
+				s << version << id << creator_address << name << description << txid << is_native << contract_template_key;
+				s << ordered_apis << ordered_offline_apis << ordered_storage_types << nonzero_balances << bytecode;
+			}
+
+			template <typename Stream>
+			void Unserialize(Stream& s) {
+				std::map<std::string, uint32_t> ordered_storage_types;
+				s >> version >> id >> creator_address >> name >> description >> txid >> is_native >> contract_template_key;
+				s >> apis >> offline_apis >> ordered_storage_types >> balances >> bytecode;
+				storage_types = std::unordered_map<std::string, uint32_t>(ordered_storage_types.begin(), ordered_storage_types.end());
+			}
 		};
 		typedef std::shared_ptr<ContractInfo> ContractInfoP;
 
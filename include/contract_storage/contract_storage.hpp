@@ -4,6 +4,7 @@
 #include <contract_storage/contract_info.hpp>
 #include <contract_storage/commit.hpp>
 #include <contract_storage/change.hpp>
+#include <contract_storage/state_merkle.hpp>
 #include <boost/exception/all.hpp>
 #include <fjson/array.hpp>
 #include <fcrypto/ripemd160.hpp>
@@ -14,21 +15,71 @@
 #include <exception>
 #include <memory>
 #include <leveldb/db.h>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <functional>
+#include <set>
 #include <sqlite3.h>
 
 namespace contract
 {
 	namespace storage
 	{
+		// records the keys read and written through any contract storage service on the current thread while it lives.
+		// recorders can be nested, each sees everything done in its lifetime
+		class ContractStorageAccessRecorder final
+		{
+		public:
+			ContractStorageAccessRecorder();
+			~ContractStorageAccessRecorder();
+			ContractStorageAccessRecorder(const ContractStorageAccessRecorder&) = delete;
+			ContractStorageAccessRecorder& operator=(const ContractStorageAccessRecorder&) = delete;
+
+			std::set<std::string> read_keys;
+			std::set<std::string> written_keys;
+			// key prefixes of range reads, any key with such a prefix may have been read
+			std::set<std::string> read_prefixes;
+
+			static void record_read(const std::string& key);
+			static void record_write(const std::string& key);
+			static void record_range_read(const std::string& prefix);
+
+			// not a storage key, read by executions which read the chain tip, its time, height or hash
+			static const std::string chain_tip_key;
+		private:
+			ContractStorageAccessRecorder* _outer;
+		};
+
 		class ContractStorageService final
 		{
 		private:
-			leveldb::DB *_db;
+			// leveldb changes staged in memory and written with a single batch.
+			// staged values are seen by the service's own reads until they are written
+			struct PendingWrites
+			{
+				std::map<std::string, std::pair<bool, std::string>> values; // key => (deleted, value)
+				// commit infos of the commits staged in block writes
+				std::vector<ContractCommitInfo> commit_infos;
+				uint64_t last_commit_info_id = 0;
+			};
+
+			std::shared_ptr<leveldb::DB> _db;
+			std::weak_ptr<leveldb::DB> _last_db;
+			std::shared_ptr<const leveldb::Snapshot> _snapshot;
 			sqlite3 *_sql_db;
 			uint32_t _current_block_height = 0;
 			uint32_t _magic_number;
 			std::string _storage_db_path;
 			std::string _storage_sql_db_path;
+			std::unique_ptr<PendingWrites> _pending_writes;
+			std::unique_ptr<PendingWrites> _block_writes;
+			// prepared sqlite statements by sql, finalized when the sql db is closed
+			mutable std::map<std::string, sqlite3_stmt*> _sql_statements;
+			// parsed contract storage values read while block writes are open, missing values are cached as null.
+			// contract txs of a block may be executed in parallel, so it's locked
+			mutable std::unordered_map<std::string, jsondiff::JsonValue> _storage_read_cache;
+			mutable std::mutex _storage_read_cache_mutex;
 		public:
 			// suggest use get_instance
 			ContractStorageService(uint32_t magic_number, const std::string& storage_db_path, const std::string& storage_sql_db_path, bool auto_open = true);
@@ -46,6 +97,10 @@ namespace contract
 			AddressType find_contract_id_by_name(const std::string& name) const;
 
 			jsondiff::JsonValue get_contract_storage(AddressType contract_id, const std::string& storage_name) const;
+			// storages of the contract whose names start with name_prefix, in name order and after start_after
+			// when it's not empty. null values are skipped. fast_map entries are the storages named "<map name>.<key>"
+			std::vector<std::pair<std::string, jsondiff::JsonValue>> list_contract_storage(const AddressType& contract_id, const std::string& name_prefix,
+				const std::string& start_after, size_t limit) const;
 			std::vector<ContractBalance> get_contract_balances(const AddressType& contract_id) const;
 			std::shared_ptr<std::vector<ContractEventInfo>> get_commit_events(const ContractCommitId& commit_id) const;
 			std::shared_ptr<std::vector<ContractEventInfo>> get_transaction_events(const std::string& transaction_id) const;
@@ -53,6 +108,20 @@ namespace contract
 			// you must ensure changes is right before commit now
 			ContractCommitId commit_contract_changes(ContractChangesP changes);
 			void rollback_contract_state(const ContractCommitId& dest_commit_id);
+			// roll back the commits made at block heights after block_height
+			void rollback_to_block_height(uint32_t block_height);
+
+			// keep the commits of a block in memory and write them together by flush_block_writes.
+			// commit ids and root state hashes are the same as when committing one by one
+			void begin_block_writes();
+			void flush_block_writes();
+			void drop_block_writes();
+			bool has_block_writes() const { return _block_writes ? true : false; }
+
+			// read-only view of the current state, backed by a leveldb snapshot. it can be used without holding
+			// the service, changes committed to it stay in its own overlay and are discarded with it
+			std::shared_ptr<ContractStorageService> create_snapshot() const;
+			bool is_snapshot() const { return _snapshot ? true : false; }
 
 			// don't call this in production usage
 			void clear_sql_db();
@@ -77,20 +146,83 @@ namespace contract
 			void set_current_block_height(uint32_t block_height) { this->_current_block_height = block_height; }
 
 			ContractCommitInfoP get_commit_info(const ContractCommitId& commit_id) const;
+
+			// keys of contract info and storage records in the state merkle tree
+			static std::string contract_info_state_key(const AddressType& contract_id);
+			static std::string contract_storage_state_key(const AddressType& contract_id, const std::string& storage_name);
+			// root of the state merkle tree over the written contract info and storage records,
+			// the proof of a key is for the same written state. record is set to the key's record when it exists,
+			// storages with null values don't exist in the tree
+			std::string state_merkle_root() const;
+			StateMerkleProof prove_state_key(const std::string& key, std::string* record) const;
+
+			// delete at most max_count commit infos and diffs older than commit_id, which becomes the oldest
+			// commit the state can be rolled back to. returns the number of commits deleted
+			size_t prune_commits_before(const ContractCommitId& commit_id, uint32_t block_height, size_t max_count);
+			// oldest commit kept by pruning and the block height of it, EMPTY_COMMIT_ID and 0 when never pruned
+			ContractCommitId pruned_root_state_hash() const;
+			uint32_t pruned_block_height() const;
+
+			// visit the contract info, name and storage records making up the state, in key order.
+			// null storages are skipped
+			void export_state(const std::function<void(const std::string& key, const std::string& value)>& visitor) const;
+			// replace an empty contract state by exported records. records are written as they come, the import is
+			// finished by finish_state_import, which makes root_state_hash the oldest commit at block_height.
+			// begin_state_import deletes the records left by an interrupted import
+			void begin_state_import();
+			void import_state_records(const std::vector<std::pair<std::string, std::string>>& records);
+			void finish_state_import(const ContractCommitId& root_state_hash, uint32_t block_height, const std::string& block_hash);
+			// block height and hash of the imported state until clear_snapshot_block, 0 and empty when none
+			uint32_t snapshot_block_height() const;
+			std::string snapshot_block_hash() const;
+			void clear_snapshot_block();
 		private:
 			// check db opened? if not, throw boost::exception
 			void check_db() const;
+			// check the state has no commits and nothing pending, so that it can be imported
+			void check_state_importable() const;
+			sqlite3_stmt* prepare_sql(const std::string& sql) const;
+			void exec_sql(sqlite3_stmt* stmt) const;
+			std::vector<ContractCommitInfo> query_commit_infos(sqlite3_stmt* stmt) const;
 			void begin_sql_transaction();
 			void commit_sql_transaction();
 			void rollback_sql_transaction();
-			void rollback_leveldb_transaction(const leveldb::Snapshot* snapshot_to_rollback, const std::vector<std::string>& changed_keys);
-			void rollback_to_root_state_hash_without_transactional(const ContractCommitId& dest_commit_id, std::vector<std::string>& changed_leveldb_keys);
+			void begin_pending_writes();
+			void write_pending_writes();
+			void drop_pending_writes();
+			void write_to_db(const PendingWrites& writes);
+			void erase_storage_read_cache(const std::string& key);
+			void invalidate_storage_read_cache(const PendingWrites& writes);
+			void clear_storage_read_cache();
+			// write pending writes of a commit whose commit info is already added
+			void write_commit(const ContractCommitId& commit_id);
+			// stage reverting of all commits after dest_commit_id to pending writes
+			void stage_rollback_to_root_state_hash(const ContractCommitId& dest_commit_id);
+			void rollback_to_root_state_hash(const ContractCommitId& dest_commit_id);
 			// init commits sql table
 			void init_commits_table();
+			// delete commit infos left by an interrupted commit or rollback
+			void delete_commit_infos_after_top();
+			void delete_commit_info(const ContractCommitId& commit_id);
+			void delete_commit_infos_after(const ContractCommitId& dest_commit_id);
+			void delete_commit_infos_after(uint64_t commit_info_id);
+			void delete_commit_infos_before(uint64_t commit_info_id);
+			// last commit info in sql db
+			ContractCommitInfoP last_commit_info() const;
+			// upgrade json records of old databases to the current binary schema
+			void migrate_records_to_binary();
+			void build_state_merkle_tree();
+			StateMerkleTree::NodeReader state_merkle_node_reader() const;
 			// add commit info to sql db
 			void add_commit_info(ContractCommitId commit_id, const std::string &change_type, const std::string &diff_str, const std::string &contract_id);
-			// get value from key-value db by key
-			std::string get_value_by_key_or_error(const std::string &key);
+			// get value from key-value db by key, pending writes first
+			bool get_value(const std::string& key, std::string* value) const;
+			// visit the keys with the prefix that come after start_after in key order, pending writes first.
+			// stops when visitor returns false
+			void scan_values(const std::string& prefix, const std::string& start_after,
+				const std::function<bool(const std::string& key, const std::string& value)>& visitor) const;
+			void put_value(const std::string& key, const std::string& value);
+			void delete_value(const std::string& key);
 			jsondiff::JsonValue get_json_value_by_key_or_null(const std::string &key);
 
 			ContractCommitId generate_next_root_hash(const std::string& old_root_state_hash, const fcrypto::sha256& diff_hash) const;
@@ -0,0 +1,64 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+
+namespace contract
+{
+	namespace storage
+	{
+		// inclusion proof of a key, or of its absence, in the state merkle tree
+		struct StateMerkleProof
+		{
+			// sibling hashes from the root down to the node the key's path ends at
+			std::vector<std::string> siblings;
+			// leaf the path ends at, both empty when it ends at an empty subtree
+			std::string leaf_key_hash;
+			std::string leaf_value_hash;
+		};
+
+		// sparse merkle tree over sha256(key) of contract info and storage records, leaves are
+		// sha256(0 || key hash || value hash) and inner nodes sha256(1 || left || right).
+		// a subtree holding a single leaf is stored as that leaf, so an update only reads and
+		// writes the nodes on the key's path, about log2(number of keys) of them
+		class StateMerkleTree
+		{
+		public:
+			// reads a stored node by its node key, returns false when it doesn't exist
+			typedef std::function<bool(const std::string& node_key, std::string* node)> NodeReader;
+
+			static const std::string node_key_prefix;
+			static const std::string empty_hash;
+
+			explicit StateMerkleTree(NodeReader reader);
+
+			void put(const std::string& key, const std::string& value);
+			void remove(const std::string& key);
+			std::string root() const;
+
+			// nodes changed by put and remove, by node key. an empty value means the node is deleted
+			const std::map<std::string, std::string>& changed_nodes() const { return _changed_nodes; }
+
+			StateMerkleProof prove(const std::string& key) const;
+			// checks the proof of key having value, or of key not existing when value is nullptr
+			static bool verify(const std::string& root, const std::string& key, const std::string* value, const StateMerkleProof& proof);
+
+		private:
+			struct Node
+			{
+				char type = 0;
+				std::string first; // key hash of a leaf, left hash of an inner node
+				std::string second; // value hash of a leaf, right hash of an inner node
+			};
+
+			NodeReader _reader;
+			std::map<std::string, std::string> _changed_nodes;
+
+			Node read_node(const std::string& node_key) const;
+			void write_node(const std::string& node_key, const Node& node);
+			std::string insert(const std::string& key_hash, const std::string& value_hash, size_t depth);
+			Node erase(const std::string& key_hash, size_t depth);
+		};
+	}
+}
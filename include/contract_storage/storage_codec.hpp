@@ -0,0 +1,37 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <contract_storage/contract_info.hpp>
+#include <contract_storage/change.hpp>
+
+namespace contract
+{
+	namespace storage
+	{
+		// kinds of records contract storage service keeps in leveldb
+		enum ContractStorageRecordType : uint8_t
+		{
+			RECORD_CONTRACT_INFO = 1,
+			RECORD_STORAGE_VALUE = 2,
+			RECORD_EVENTS = 3
+		};
+
+		// binary record layout: BINARY_RECORD_TAG, record type, record version, serialized payload.
+		// legacy records are json text, which never starts with a zero byte
+		static const char BINARY_RECORD_TAG = '\0';
+		static const uint8_t CONTRACT_STORAGE_RECORD_VERSION = 1;
+
+		bool is_binary_record(const std::string& value);
+
+		std::string encode_contract_info_record(const ContractInfo& contract_info);
+		// returns nullptr when the record is not a valid contract info
+		ContractInfoP decode_contract_info_record(const std::string& value);
+
+		// decode(encode(v)) gives the same value json_loads(json_dumps(v)) gives
+		std::string encode_storage_value_record(const jsondiff::JsonValue& value);
+		jsondiff::JsonValue decode_storage_value_record(const std::string& value);
+
+		std::string encode_events_record(const std::vector<ContractEventInfo>& events);
+		std::vector<ContractEventInfo> decode_events_record(const std::string& value);
+	}
+}
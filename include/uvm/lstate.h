@@ -20,6 +20,10 @@
 
 #define LUA_MALLOC_TOTAL_SIZE	(50*1024*1024)
 
+// lua_malloc size classes: 8 byte steps up to 128 bytes, then 4 classes per power of two
+#define LUA_MALLOC_SMALL_CLASSES 16
+#define LUA_MALLOC_SIZE_CLASSES (LUA_MALLOC_SMALL_CLASSES + 4 * 20)
+
 #define LUA_COMPILE_ERROR_MAX_LENGTH 4096
 
 #define LUA_API_INTERNAL_ERROR   -1
@@ -205,7 +209,8 @@ struct lua_State {
     lu_byte allowhook;
     void *malloc_buffer; // malloc enough memory for the whole lua_state scope beforehand, and malloc/free in the buffer
     ptrdiff_t malloc_pos; // used buffer size in malloc_buffer
-    std::list<std::pair<ptrdiff_t, ptrdiff_t>> *malloced_buffers;
+    ptrdiff_t malloc_free_lists[LUA_MALLOC_SIZE_CLASSES]; // offset of the first freed block of each size class, 0 if none
+    struct LuaMallocLayout *malloc_layout; // what the 50MB limit is charged by, see lstate.cpp
     char compile_error[LUA_COMPILE_ERROR_MAX_LENGTH];
 	char runerror[LUA_VM_EXCEPTION_STRNG_MAX_LENGTH];
     FILE *in;
@@ -213,6 +218,16 @@ struct lua_State {
     FILE *err;
     bool force_stopping;
 	int exit_code;
+	// hot state values, kept here instead of in the state value map
+	int insts_limit;
+	bool insts_counted; // instructions are counted after luaV_execute first runs
+	int insts_executed_count;
+	int stop_to_run;
+	int exception_code;
+	const char *exception_msg;
+	void *storage_changelist;
+	void *evaluator;
+	void *profile; // uvm::lua::lib::UvmProfile attached to the state, see uvm_profile.h
     UvmStatePreProcessorFunction *preprocessor;
 
 	StkId evalstack; //for calulate
@@ -226,6 +241,9 @@ void *lua_calloc(lua_State *L, size_t element_count, size_t element_size);
 
 void lua_free(lua_State *L, void *address);
 
+// forget all lua_malloc allocations of L at once
+void lua_reset_malloc(lua_State *L);
+
 
 #define G(L)	(L->l_G)
 
@@ -46,6 +46,7 @@ LUAI_FUNC void luaH_resize(lua_State *L, Table *t, unsigned int nasize,
 LUAI_FUNC void luaH_resizearray(lua_State *L, Table *t, unsigned int nasize);
 LUAI_FUNC void luaH_free(lua_State *L, Table *t);
 LUAI_FUNC int luaH_next(lua_State *L, Table *t, StkId key);
+LUAI_FUNC int luaH_sortedkeys(lua_State *L, Table *t, Table *keys, int *nnum);
 LUAI_FUNC int luaH_getn(Table *t);
 
 
@@ -352,6 +352,7 @@ LUA_API int (lua_gc)(lua_State *L, int what, int data);
 LUA_API int   (lua_error)(lua_State *L);
 
 LUA_API int   (lua_next)(lua_State *L, int idx);
+LUA_API int   (lua_sortedkeys)(lua_State *L, int idx, int *nnum);
 
 LUA_API void  (lua_concat)(lua_State *L, int n);
 LUA_API void  (lua_len)(lua_State *L, int idx);
@@ -223,6 +223,10 @@ public:
     int  contract_state;
     // storage
     std::map<std::string, uvm::blockchain::StorageValueTypes> contract_storage_properties;
+    // sha256 of buff when loaded from chain storage, empty otherwise
+    std::string bytecode_digest;
+    // buff already passed check_contract_proto
+    bool checked;
 
 	// APIAPI
 	std::map<std::string, std::vector<UvmTypeInfoEnum>> contract_api_arg_types;
@@ -252,6 +256,9 @@ public:
 
 // storage structs
 #define LUA_STORAGE_CHANGELIST_KEY "__lua_storage_changelist__"
+#define LUA_EXCEPTION_CODE_KEY "exception_code"
+#define LUA_EXCEPTION_MSG_KEY "exception_msg"
+#define LUA_EVALUATOR_KEY "evaluator"
 #define LUA_STORAGE_READ_TABLES_KEY "__lua_storage_read_tables__"
 
 #define GLUA_OUTSIDE_OBJECT_POOLS_KEY "__uvm_outside_object_pools__"
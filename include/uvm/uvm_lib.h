@@ -10,9 +10,13 @@
 #include <list>
 #include <vector>
 #include <stack>
+#include <map>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <set>
+#include <mutex>
+#include <atomic>
 
 #include <uvm/lua.h>
 #include <uvm/lhashmap.h>
@@ -40,6 +44,12 @@
 
 #define LUA_STATE_DEBUGGER_INFO	"lua_state_debugger_info"
 
+// how many warmed contract lua states are kept for reuse
+#define DEFAULT_UVM_STATE_POOL_SIZE 4
+// how many checked contract modules are cached, process wide and in each pooled lua state
+#define DEFAULT_UVM_MODULE_CACHE_SIZE 256
+#define UVM_STATE_MODULE_CACHE_SIZE 32
+
 
 /**
 * in lua_State scope, share some values, after close lua_State, you must release these shared values
@@ -213,6 +223,73 @@ namespace uvm
                 bool check_contract_bytecode_stream(UvmModuleByteStreamP stream);
             };
 
+            /************************************************************************/
+            /* keeps warmed contract lua states, reset to what create_lua_state     */
+            /* left after each use                                                  */
+            /************************************************************************/
+            class UvmStatePool
+            {
+            private:
+                std::mutex _mutex;
+                std::vector<lua_State*> _states;
+                size_t _max_size;
+                std::atomic<uint64_t> _hits;
+                std::atomic<uint64_t> _misses;
+            public:
+                UvmStatePool(size_t max_size = DEFAULT_UVM_STATE_POOL_SIZE);
+                ~UvmStatePool();
+
+                static UvmStatePool &instance();
+
+                // states over max_size are closed when given back
+                void set_max_size(size_t max_size);
+                size_t max_size();
+                size_t size();
+                inline uint64_t hits() const { return _hits; }
+                inline uint64_t misses() const { return _misses; }
+
+                lua_State *acquire();
+                void release(lua_State *L);
+                void clear();
+            };
+
+            /************************************************************************/
+            /* lru cache of checked contract modules loaded from chain storage,     */
+            /* keyed by contract id and bytecode digest. cached streams are shared, */
+            /* nothing may change them                                              */
+            /************************************************************************/
+            class UvmModuleCache
+            {
+            private:
+                typedef std::shared_ptr<UvmModuleByteStream> StreamP;
+                typedef std::list<StreamP> Entries;
+                std::mutex _mutex;
+                Entries _entries; // most recently used first
+                std::map<std::string, Entries::iterator> _index;
+                size_t _max_size;
+                std::atomic<uint64_t> _hits;
+                std::atomic<uint64_t> _misses;
+
+                void erase_entry(std::map<std::string, Entries::iterator>::iterator it);
+            public:
+                UvmModuleCache(size_t max_size = DEFAULT_UVM_MODULE_CACHE_SIZE);
+
+                static UvmModuleCache &instance();
+
+                void set_max_size(size_t max_size);
+                size_t max_size();
+                size_t size();
+                inline uint64_t hits() const { return _hits; }
+                inline uint64_t misses() const { return _misses; }
+
+                // the cached module of contract_id if its bytecode still has this digest
+                StreamP get(const std::string &contract_id, const std::string &bytecode_digest);
+                // caches a checked stream loaded from chain storage
+                void put(StreamP stream);
+                void erase(const std::string &contract_id);
+                void clear();
+            };
+
 			class UvmByteStream
 			{
 			private:
@@ -295,6 +372,15 @@ namespace uvm
 
             void close_lua_state(lua_State *L);
 
+            /**
+            * remember L's globals and registry as the state reset_lua_state goes back to
+            */
+            void save_lua_state_baseline(lua_State *L);
+            /**
+            * drop everything an execution left in L. returns false if L can't be reused
+            */
+            bool reset_lua_state(lua_State *L);
+
             /**
             * share some values in L
             */
@@ -431,6 +517,17 @@ namespace uvm
              */
             bool check_contract_proto(lua_State *L, Proto *proto, char *error = nullptr, std::list<Proto*> *parents = nullptr);
 
+            /**
+             * push a new closure of the contract main function L loaded before from stream,
+             * returns false if L has none cached. L's cache is kept when L is reset
+             */
+            bool push_cached_contract_closure(lua_State *L, UvmModuleByteStreamP stream);
+
+            /**
+             * remember the contract main function loaded from stream at the top of L's stack
+             */
+            void cache_contract_closure(lua_State *L, UvmModuleByteStreamP stream);
+
             std::string wrap_contract_name(const char *contract_name);
 
             std::string unwrap_any_contract_name(const char *contract_name);
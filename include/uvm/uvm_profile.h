@@ -0,0 +1,94 @@
+#ifndef uvm_profile_h
+#define uvm_profile_h
+
+#include <uvm/lua.h>
+#include <uvm/lstate.h>
+#include <uvm/lopcodes.h>
+
+#include <stdint.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+/**
+ * hookmask bit set while a profile is attached, the interpreter loop tests it together with the hook bits
+ * it tests anyway, so running without a profile costs nothing more
+ */
+#define UVM_MASKPROFILE (1 << 7)
+
+namespace uvm
+{
+	namespace lua
+	{
+		namespace lib
+		{
+			struct UvmProfileTime
+			{
+				uint64_t count = 0;
+				int64_t micros = 0;
+			};
+
+			/**
+			 * execution profile of the contracts run in the lua states it's attached to
+			 */
+			struct UvmProfile
+			{
+				uint64_t opcode_counts[UNUM_OPCODES] = {};
+				// instructions executed in each contract function, by "source:line defined"
+				std::map<std::string, uint64_t> function_instructions;
+				// C functions called by contracts, chain apis and libraries, by name
+				std::map<std::string, UvmProfileTime> native_calls;
+				// contract api calls executed, with the chain's work around them
+				UvmProfileTime executions;
+				UvmProfileTime storage_reads;
+				UvmProfileTime storage_writes;
+				UvmProfileTime json_conversions;
+
+				uint64_t instructions() const;
+				// the counters of function_instructions by function prototype
+				std::unordered_map<const Proto*, uint64_t*> function_counters;
+			};
+
+			// attach a profile to L, or detach it when profile is nullptr
+			void attach_profile(lua_State *L, UvmProfile *profile);
+
+			inline UvmProfile *get_profile(lua_State *L)
+			{
+				return static_cast<UvmProfile*>(L->profile);
+			}
+
+			// only called while a profile is attached
+			void profile_instruction(lua_State *L, const Proto *p, int opcode);
+			UvmProfileTime *profile_native_call(lua_State *L, CallInfo *ci);
+
+			/**
+			 * adds the time of its scope to a profile entry, does nothing when entry is nullptr
+			 */
+			class UvmProfileTimer
+			{
+			public:
+				explicit UvmProfileTimer(UvmProfileTime *entry)
+					: _entry(entry)
+				{
+					if (_entry)
+						_start = std::chrono::steady_clock::now();
+				}
+				~UvmProfileTimer()
+				{
+					if (!_entry)
+						return;
+					_entry->count++;
+					_entry->micros += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _start).count();
+				}
+				UvmProfileTimer(const UvmProfileTimer&) = delete;
+				UvmProfileTimer& operator=(const UvmProfileTimer&) = delete;
+			private:
+				UvmProfileTime *_entry;
+				std::chrono::steady_clock::time_point _start;
+			};
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,68 @@
+#include <bench/bench.h>
+
+#include <base58.h>
+#include <chainparams.h>
+#include <pubkey.h>
+#include <validation.h>
+#include <contract_engine/contract_helper.hpp>
+
+#include <stdexcept>
+
+// a block of tx_count txs, each calling a contract
+static CBlock MakeContractCallBlock(size_t tx_count)
+{
+    const std::string caller_address = EncodeDestination(CKeyID(uint160()));
+    std::string contract_address;
+    {
+        CMutableTransaction create_tx;
+        create_tx.vout.resize(1);
+        contract_address = ContractHelper::generate_contract_address(caller_address, CTransaction(create_tx), 0);
+    }
+    valtype version;
+    version.push_back(0x01);
+    uint64_t gas_limit = 10000;
+    uint64_t gas_price = 10;
+    CBlock block;
+    for (size_t i = 0; i < tx_count; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.n = i;
+        tx.vout.push_back(CTxOut(0, CScript() << version << ToByteVector(std::string("arg")) << ToByteVector(std::string("transfer"))
+            << ToByteVector(contract_address) << ToByteVector(caller_address) << gas_limit << gas_price << OP_CALL));
+        block.vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+    return block;
+}
+
+// the per tx work ConnectBlock does before executing contract txs, converting each one and setting up its execution.
+// the cost per block grows linearly with the number of contract txs in it
+static void ContractBlockPrepare(benchmark::State& state, size_t tx_count)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    const CBlock& block = MakeContractCallBlock(tx_count);
+    while (state.KeepRunning()) {
+        for (const auto& ptx : block.vtx) {
+            ContractTxConverter converter(*ptx, nullptr, &block.vtx, true);
+            ExtractContractTX extracted;
+            std::string error_ret;
+            if (!converter.extractionContractTransactions(extracted, error_ret))
+                throw std::runtime_error(error_ret);
+            ContractExec exec(nullptr, block, extracted.txs, UINT64_MAX, 0);
+            if (exec.txs.size() != 1)
+                throw std::runtime_error("unexpected contract txs");
+        }
+    }
+}
+
+static void ContractBlockPrepare100(benchmark::State& state)
+{
+    ContractBlockPrepare(state, 100);
+}
+
+static void ContractBlockPrepare1000(benchmark::State& state)
+{
+    ContractBlockPrepare(state, 1000);
+}
+
+BENCHMARK(ContractBlockPrepare100, 200);
+BENCHMARK(ContractBlockPrepare1000, 20);
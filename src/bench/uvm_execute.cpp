@@ -0,0 +1,67 @@
+#include <bench/bench.h>
+
+#include <btc_uvm_api.h>
+#include <uvm/uvm_lib.h>
+#include <uvm/lauxlib.h>
+
+#include <stdexcept>
+
+// runs code compiled once in a contract VM state, with the gas limit of a contract call
+static void ExecuteContractCode(benchmark::State& state, const char* code)
+{
+    if (!uvm::lua::api::global_uvm_chain_api)
+        uvm::lua::api::global_uvm_chain_api = new uvm::lua::api::BtcUvmChainApi();
+    uvm::lua::lib::UvmStatePool pool(1);
+    lua_State *L = pool.acquire();
+    if (luaL_loadstring(L, code) != LUA_OK)
+        throw std::runtime_error(lua_tostring(L, -1));
+    while (state.KeepRunning()) {
+        L->insts_counted = false;
+        uvm::lua::lib::set_lua_state_instructions_limit(L, 100000000);
+        lua_pushvalue(L, -1);
+        if (lua_pcall(L, 0, 0, 0) != LUA_OK)
+            throw std::runtime_error(lua_tostring(L, -1));
+    }
+    pool.release(L);
+}
+
+// arithmetic and local variables in a numeric for loop
+static void UvmExecuteArith(benchmark::State& state)
+{
+    ExecuteContractCode(state, "local s = 0 for i = 1, 10000 do s = s + i * 2 - i // 3 end");
+}
+
+// lua function calls and returns
+static void UvmExecuteCalls(benchmark::State& state)
+{
+    ExecuteContractCode(state, "local function fib(n) if n < 2 then return n end return fib(n - 1) + fib(n - 2) end fib(18)");
+}
+
+// the table reads and writes of a token contract keeping balances
+static void UvmExecuteTables(benchmark::State& state)
+{
+    ExecuteContractCode(state,
+        "local balances = {} "
+        "for i = 1, 1000 do balances['addr' .. tostring(i % 100)] = (balances['addr' .. tostring(i % 100)] or 0) + i end "
+        "local total = 0 for i = 0, 99 do total = total + balances['addr' .. tostring(i)] end");
+}
+
+// ordered iteration of a table with numeric and string keys
+static void UvmExecutePairs(benchmark::State& state)
+{
+    ExecuteContractCode(state,
+        "local t = {} for i = 1, 200 do t[i * 3] = i t['k' .. i] = i end "
+        "local total = 0 for n = 1, 10 do for k, v in pairs(t) do total = total + v end end");
+}
+
+// while loops with string concatenation and comparisons
+static void UvmExecuteStrings(benchmark::State& state)
+{
+    ExecuteContractCode(state, "local s = '' local i = 0 while i < 500 do if i % 2 == 0 then s = s .. 'a' else s = s .. 'b' end i = i + 1 end");
+}
+
+BENCHMARK(UvmExecuteArith, 200);
+BENCHMARK(UvmExecuteCalls, 50);
+BENCHMARK(UvmExecuteTables, 200);
+BENCHMARK(UvmExecuteStrings, 200);
+BENCHMARK(UvmExecutePairs, 50);
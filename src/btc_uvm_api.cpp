@@ -17,6 +17,7 @@
 #include <uvm/uvm_lutil.h>
 #include <uvm/lobject.h>
 #include <uvm/lstate.h>
+#include <uvm/uvm_profile.h>
 #include <amount.h>
 #include <base58.h>
 #include <chainparams.h>
@@ -38,7 +39,8 @@ namespace uvm {
     namespace lua {
         namespace api {
 
-            static int has_error = 0;
+            // contracts of a block may run on several threads, each runs one lua state at a time
+            static thread_local int has_error = 0;
 
             /**
             * whether exception happen in L
@@ -81,25 +83,19 @@ namespace uvm {
                 }
                 lua_set_compile_error(L, msg);
 
-                int last_code = uvm::lua::lib::get_lua_state_value(L, "exception_code").int_value;
+                int last_code = L->exception_code;
                 if (last_code != code && last_code != 0)
                 {
                     return;
                 }
 
-                UvmStateValue val_code;
-                val_code.int_value = code;
-
-                UvmStateValue val_msg;
-                val_msg.string_value = msg;
-
-                uvm::lua::lib::set_lua_state_value(L, "exception_code", val_code, UvmStateValueType::LUA_STATE_VALUE_INT);
-                uvm::lua::lib::set_lua_state_value(L, "exception_msg", val_msg, UvmStateValueType::LUA_STATE_VALUE_STRING);
+                L->exception_code = code;
+                L->exception_msg = msg;
             }
 
             static ::blockchain::contract::PendingState* get_evaluator(lua_State *L)
             {
-                return (::blockchain::contract::PendingState*) uvm::lua::lib::get_lua_state_value(L, "evaluator").pointer_value;
+                return (::blockchain::contract::PendingState*) L->evaluator;
             }
 
 			static ::contract::storage::ContractStorageService* get_contract_storage_service(lua_State *L)
@@ -107,6 +103,34 @@ namespace uvm {
 				return (::contract::storage::ContractStorageService*) uvm::lua::lib::get_lua_state_value(L, "storage_service").pointer_value;
 			}
 
+			// the tip taken for executions running without cs_main, nullptr when they read chainActive
+			static const ContractChainTip* get_given_chain_tip(lua_State *L)
+			{
+				return (const ContractChainTip*) uvm::lua::lib::get_lua_state_value(L, "chain_tip").pointer_value;
+			}
+
+			// results of executions reading the tip only hold on that tip
+			static ContractChainTip get_chain_tip(lua_State *L)
+			{
+				::contract::storage::ContractStorageAccessRecorder::record_read(::contract::storage::ContractStorageAccessRecorder::chain_tip_key);
+				auto given_tip = get_given_chain_tip(L);
+				return given_tip ? *given_tip : ContractChainTip(chainActive.Tip());
+			}
+
+			// executions without cs_main take the hash from the index, as reading the block needs its position on disk
+			static bool get_block_hash(lua_State *L, const CBlockIndex* bindex, uint256& hash)
+			{
+				if (get_given_chain_tip(L)) {
+					hash = bindex->GetBlockHash();
+					return true;
+				}
+				CBlock block;
+				if (!ReadBlockFromDisk(block, bindex, Params().GetConsensus()))
+					return false;
+				hash = block.GetHash();
+				return true;
+			}
+
             /**
             * check whether the contract apis limit over, in this lua_State
             * @param L the lua stack
@@ -283,8 +307,14 @@ namespace uvm {
                     return true;
             }
 
+            static std::string bytecode_digest(const std::vector<unsigned char>& bytecode)
+            {
+                return fcrypto::sha256::hash((const char*) bytecode.data(), (uint32_t) bytecode.size()).str();
+            }
+
             /**
-            * load contract lua byte stream from uvm api
+            * load contract lua byte stream from uvm api.
+            * streams loaded from storage come from UvmModuleCache while the contract keeps its bytecode
             */
             std::shared_ptr<UvmModuleByteStream> BtcUvmChainApi::open_contract(lua_State *L, const char *name)
             {
@@ -318,6 +348,14 @@ namespace uvm {
 				auto contract = service->get_contract_info(addr);
 				if (contract)
 				{
+					const auto& digest = bytecode_digest(contract->bytecode);
+					auto cached = uvm::lua::lib::UvmModuleCache::instance().get(addr, digest);
+					if (cached)
+					{
+						auto stream = std::make_shared<UvmModuleByteStream>(*cached);
+						stream->contract_name = name;
+						return stream;
+					}
 					auto stream = std::make_shared<UvmModuleByteStream>();
 					if (nullptr == stream)
 						return nullptr;
@@ -326,6 +364,7 @@ namespace uvm {
 					stream->is_bytes = true;
 					stream->contract_name = name;
 					stream->contract_id = addr;
+					stream->bytecode_digest = digest;
 					for (const auto& api : contract->apis)
 						stream->contract_apis.push_back(api);
 					for (const auto& offline_api : contract->offline_apis)
@@ -334,6 +373,7 @@ namespace uvm {
 						stream->contract_storage_properties[p.first] = (uvm::blockchain::StorageValueTypes) p.second;
 					return stream;
 				}
+				uvm::lua::lib::UvmModuleCache::instance().erase(addr);
                 return nullptr;
             }
 
@@ -366,6 +406,10 @@ namespace uvm {
 				auto contract = service->get_contract_info(std::string(address));
 				if (contract)
 				{
+					const auto& digest = bytecode_digest(contract->bytecode);
+					auto cached = uvm::lua::lib::UvmModuleCache::instance().get(std::string(address), digest);
+					if (cached)
+						return cached;
 					auto stream = std::make_shared<UvmModuleByteStream>();
 					if (nullptr == stream)
 						return nullptr;
@@ -374,6 +418,7 @@ namespace uvm {
 					stream->is_bytes = true;
 					stream->contract_name = "";
 					stream->contract_id = std::string(address);
+					stream->bytecode_digest = digest;
 					for (const auto& api : contract->apis)
 						stream->contract_apis.push_back(api);
 					for (const auto& offline_api : contract->offline_apis)
@@ -382,6 +427,7 @@ namespace uvm {
 					 	stream->contract_storage_properties[p.first] = (uvm::blockchain::StorageValueTypes) p.second;
 					return stream;
 				}
+				uvm::lua::lib::UvmModuleCache::instance().erase(std::string(address));
 				return nullptr;
             }
 
@@ -403,7 +449,13 @@ namespace uvm {
                 if(is_flat_map) {
                     storage_key = name + "." + flat_map_key;
                 }
-				auto json_value = storage_service->get_contract_storage(std::string(contract_address), storage_key);
+				auto profile = uvm::lua::lib::get_profile(L);
+				jsondiff::JsonValue json_value;
+				{
+					uvm::lua::lib::UvmProfileTimer timer(profile ? &profile->storage_reads : nullptr);
+					json_value = storage_service->get_contract_storage(std::string(contract_address), storage_key);
+				}
+				uvm::lua::lib::UvmProfileTimer timer(profile ? &profile->json_conversions : nullptr);
 				UvmStorageValue value = json_to_uvm_storage_value(L, json_value);
                 return value;
             }
@@ -463,6 +515,8 @@ namespace uvm {
 				auto evaluator = get_evaluator(L);
 				if (!evaluator)
 					return true;
+				auto profile = uvm::lua::lib::get_profile(L);
+				uvm::lua::lib::UvmProfileTimer timer(profile ? &profile->storage_writes : nullptr);
 				jsondiff::JsonDiff differ;
 			    int64_t storage_gas = 0;
 
@@ -661,19 +715,16 @@ namespace uvm {
             uint32_t BtcUvmChainApi::get_chain_now(lua_State *L)
             {
                 uvm::lua::lib::increment_lvm_instructions_executed_count(L, CHAIN_GLUA_API_EACH_INSTRUCTIONS_COUNT - 1);
-                auto bindex = chainActive.Tip();
-                return bindex->nTime;
+                return get_chain_tip(L).header.nTime;
             }
 
             uint32_t BtcUvmChainApi::get_chain_random(lua_State *L)
             {
                 uvm::lua::lib::increment_lvm_instructions_executed_count(L, CHAIN_GLUA_API_EACH_INSTRUCTIONS_COUNT - 1);
-                auto bindex = chainActive.Tip();
-                CBlock block;
-                auto res = ReadBlockFromDisk(block, bindex, Params().GetConsensus());
-                if(!res)
+                auto tip = get_chain_tip(L);
+                uint256 hash;
+                if (!tip.pindex || !get_block_hash(L, tip.pindex, hash))
                     return 0;
-				auto hash = block.GetHash();
 				return uint32_t(hash.GetUint64(2)) % ((1 << 31) - 1);
             }
 
@@ -688,15 +739,13 @@ namespace uvm {
             uint32_t BtcUvmChainApi::get_header_block_num(lua_State *L)
             {
                 uvm::lua::lib::increment_lvm_instructions_executed_count(L, CHAIN_GLUA_API_EACH_INSTRUCTIONS_COUNT - 1);
-				auto bindex = chainActive.Tip();
-				return bindex->nHeight;
+				return get_chain_tip(L).nHeight;
             }
 
             uint32_t BtcUvmChainApi::wait_for_future_random(lua_State *L, int next)
             {
                 uvm::lua::lib::increment_lvm_instructions_executed_count(L, CHAIN_GLUA_API_EACH_INSTRUCTIONS_COUNT - 1);
-				auto bindex = chainActive.Tip();
-				auto target = bindex->nHeight + next;
+				auto target = get_chain_tip(L).nHeight + next;
 				if (target < next)
 					return 0;
 				else
@@ -706,10 +755,10 @@ namespace uvm {
             int32_t BtcUvmChainApi::get_waited(lua_State *L, uint32_t num)
             {
                 uvm::lua::lib::increment_lvm_instructions_executed_count(L, CHAIN_GLUA_API_EACH_INSTRUCTIONS_COUNT - 1);
-				auto bindex = chainActive.Tip();
-				if (bindex->nHeight < num || num < 1)
+				auto tip = get_chain_tip(L);
+				if (tip.nHeight < num || num < 1)
 					return 0;
-				CBlockIndex* cur_index = bindex;
+				const CBlockIndex* cur_index = tip.pindex;
 				while (true) {
 					if (!cur_index)
 						return 0;
@@ -717,11 +766,9 @@ namespace uvm {
 						break;
 					cur_index = cur_index->pprev;
 				}
-				CBlock block;
-				auto res = ReadBlockFromDisk(block, cur_index, Params().GetConsensus());
-				if (!res)
+				uint256 hash;
+				if (!get_block_hash(L, cur_index, hash))
 					return 0;
-				auto hash = block.GetHash();
 				return int32_t(hash.GetUint64(2)) % ((1 << 31) - 1);
             }
 
@@ -4,6 +4,7 @@
 #include <memory>
 #include <uvm/uvm_api.h>
 #include <uvm/uvm_lib.h>
+#include <uvm/uvm_profile.h>
 
 namespace blockchain
 {
@@ -39,6 +40,9 @@ namespace blockchain
 
 			virtual void clear_exceptions() = 0;
 
+			// profile the executions into profile, or stop profiling when profile is nullptr
+			virtual void set_profile(uvm::lua::lib::UvmProfile *profile) = 0;
+
 			// @throws exception
 			virtual void execute_contract_api_by_address(std::string contract_id, std::string method, std::string argument, std::string *result_json_string) = 0;
 
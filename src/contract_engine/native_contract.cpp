@@ -78,6 +78,42 @@ namespace blockchain {
             return storage_changes[storage_name].after;
         }
 
+		std::vector<std::pair<std::string, JsonValue>> abstract_native_contract::list_contract_storage(const std::string& contract_address, const std::string& name_prefix,
+			const std::string& start_after, size_t limit)
+		{
+			auto storage_service = _pending_state->storage_service;
+			auto changes_it = _contract_storage_changes.find(contract_address);
+			if (changes_it == _contract_storage_changes.end() || changes_it->second.empty() || limit == 0)
+				return storage_service->list_contract_storage(contract_address, name_prefix, start_after, limit);
+			const auto& storage_changes = changes_it->second;
+			std::map<std::string, JsonValue> merged;
+			for (auto it = storage_changes.lower_bound(name_prefix); it != storage_changes.end() && it->first.compare(0, name_prefix.size(), name_prefix) == 0; it++)
+			{
+				if (it->first > start_after && !it->second.after.is_null())
+					merged[it->first] = it->second.after;
+			}
+			// stored pages are read until the first limit entries are known, changed storages shadow the stored ones
+			std::string stored_after = start_after;
+			while (true)
+			{
+				const auto& stored = storage_service->list_contract_storage(contract_address, name_prefix, stored_after, limit);
+				for (const auto& item : stored)
+				{
+					if (storage_changes.find(item.first) == storage_changes.end())
+						merged.insert(item);
+				}
+				if (stored.size() < limit)
+					break;
+				stored_after = stored.back().first;
+				if (merged.size() >= limit && std::next(merged.begin(), limit - 1)->first <= stored_after)
+					break;
+			}
+			std::vector<std::pair<std::string, JsonValue>> result;
+			for (auto it = merged.begin(); it != merged.end() && result.size() < limit; it++)
+				result.push_back(*it);
+			return result;
+		}
+
         void abstract_native_contract::emit_event(const std::string& contract_address, const std::string& event_name, const std::string& event_arg)
         {
             FJSON_ASSERT(!event_name.empty());
@@ -58,6 +58,10 @@ namespace blockchain {
 
             void set_contract_storage(const std::string& contract_address, const std::string& storage_name, const JsonValue& value);
 			JsonValue get_contract_storage(const std::string& contract_address, const std::string& storage_name);
+			// page through the storages (and fast_map entries "<map name>.<key>") starting with name_prefix,
+			// including the ones changed by this call
+			std::vector<std::pair<std::string, JsonValue>> list_contract_storage(const std::string& contract_address, const std::string& name_prefix,
+				const std::string& start_after, size_t limit);
             void emit_event(const std::string& contract_address, const std::string& event_name, const std::string& event_arg);
 		protected:
 			void merge_storage_changes_to_exec_result();
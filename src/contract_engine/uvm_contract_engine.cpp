@@ -39,10 +39,9 @@ namespace uvm
 	}
 	void UvmContractEngine::set_gas_used(int64_t gas_used)
 	{
-		int *insts_executed_count = lua::lib::get_lua_state_value(_scope->L(), INSTRUCTIONS_EXECUTED_COUNT_LUA_STATE_MAP_KEY).int_pointer_value;
-		if (insts_executed_count)
+		if (_scope->L()->insts_counted)
 		{
-			*insts_executed_count = gas_used;
+			_scope->L()->insts_executed_count = gas_used;
 		}
 		else
 		{
@@ -90,14 +89,19 @@ namespace uvm
 		lua::api::global_uvm_chain_api->clear_exceptions(_scope->L());
 	}
 
+	void UvmContractEngine::set_profile(lua::lib::UvmProfile *profile)
+	{
+		lua::lib::attach_profile(_scope->L(), profile);
+	}
+
 	void UvmContractEngine::execute_contract_api_by_address(std::string contract_id, std::string method, std::string argument, std::string *result_json_string)
 	{
 		clear_exceptions();
 		lua::lib::execute_contract_api_by_address(_scope->L(), contract_id.c_str(), method.c_str(), argument.c_str(), result_json_string);
 		if (_scope->L()->force_stopping == true && _scope->L()->exit_code == LUA_API_INTERNAL_ERROR)
 			throw uvm::core::UvmException("execute contract internal error");
-		int exception_code = lua::lib::get_lua_state_value(_scope->L(), "exception_code").int_value;
-		char* exception_msg = (char*)lua::lib::get_lua_state_value(_scope->L(), "exception_msg").string_value;
+		int exception_code = _scope->L()->exception_code;
+		char* exception_msg = (char*)_scope->L()->exception_msg;
 		if (exception_code > 0)
 		{
 			if (exception_code == UVM_API_LVM_LIMIT_OVER_ERROR)
@@ -115,8 +119,8 @@ namespace uvm
 		lua::lib::execute_contract_init_by_address(_scope->L(), contract_id.c_str(), argument.c_str(), result_json_string);
 		if (_scope->L()->force_stopping == true && _scope->L()->exit_code == LUA_API_INTERNAL_ERROR)
 			throw uvm::core::UvmException("execute contract internal error");
-		int exception_code = lua::lib::get_lua_state_value(_scope->L(), "exception_code").int_value;
-		char* exception_msg = (char*)lua::lib::get_lua_state_value(_scope->L(), "exception_msg").string_value;
+		int exception_code = _scope->L()->exception_code;
+		char* exception_msg = (char*)_scope->L()->exception_msg;
 		if (exception_code > 0)
 		{
 			if (exception_code == UVM_API_LVM_LIMIT_OVER_ERROR)
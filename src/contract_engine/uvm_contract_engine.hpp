@@ -34,6 +34,8 @@ namespace uvm
 
 		virtual void clear_exceptions();
 
+		virtual void set_profile(lua::lib::UvmProfile *profile);
+
 		virtual void execute_contract_api_by_address(std::string contract_id, std::string method, std::string argument, std::string *result_json_string);
 
 		virtual void execute_contract_init_by_address(std::string contract_id, std::string argument, std::string *result_json_string);
@@ -1,12 +1,14 @@
 #include <contract_storage/contract_storage.hpp>
 #include <contract_storage/config.hpp>
 #include <contract_storage/exceptions.hpp>
+#include <contract_storage/storage_codec.hpp>
 #include <fjson/io/json.hpp>
 #include <fjson/string.hpp>
 #include <fjson/crypto/base64.hpp>
 #include <boost/scope_exit.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/predicate.hpp>
+#include <leveldb/write_batch.h>
 #include <set>
 #include <vector>
 #include <map>
@@ -22,34 +24,113 @@ namespace contract
 
 		static const std::string root_state_hash_key = "ROOT_STATE_HASH";
 		static const std::string top_root_state_hash_key = "TOP_ROOT_STATE_HASH";
+		static const std::string schema_version_key = "CONTRACT_STORAGE_SCHEMA_VERSION";
+		static const std::string pruned_root_state_hash_key = "PRUNED_ROOT_STATE_HASH";
+		static const std::string pruned_block_height_key = "PRUNED_BLOCK_HEIGHT";
+		static const std::string snapshot_block_height_key = "SNAPSHOT_BLOCK_HEIGHT";
+		static const std::string snapshot_block_hash_key = "SNAPSHOT_BLOCK_HASH";
+		static const std::string state_merkle_version_key = "STATE_MERKLE_VERSION";
+		static const uint32_t STATE_MERKLE_VERSION = 1;
+
+		// records written since this schema version are binary (see storage_codec.hpp)
+		static const uint32_t CONTRACT_STORAGE_SCHEMA_VERSION = 1;
+		static const size_t MIGRATION_BATCH_SIZE = 1000;
+
+		static const std::string contract_info_key_prefix = "contract_info_key_";
+		static const std::string contract_storage_key_prefix = "contract_storage_key_";
+		static const std::string contract_name_id_mapping_key_prefix = "contract_name_id_mapping_";
+		static const std::string commit_events_key_prefix = "commit_events$";
+		static const std::string transaction_events_key_prefix = "transaction_events$";
 
 		static std::recursive_mutex storage_mutex;
 
+		static thread_local ContractStorageAccessRecorder* current_access_recorder = nullptr;
+
+		const std::string ContractStorageAccessRecorder::chain_tip_key = "$chain_tip";
+
+		ContractStorageAccessRecorder::ContractStorageAccessRecorder()
+			: _outer(current_access_recorder)
+		{
+			current_access_recorder = this;
+		}
+
+		ContractStorageAccessRecorder::~ContractStorageAccessRecorder()
+		{
+			current_access_recorder = _outer;
+		}
+
+		void ContractStorageAccessRecorder::record_read(const std::string& key)
+		{
+			for (auto recorder = current_access_recorder; recorder; recorder = recorder->_outer)
+				recorder->read_keys.insert(key);
+		}
+
+		void ContractStorageAccessRecorder::record_write(const std::string& key)
+		{
+			for (auto recorder = current_access_recorder; recorder; recorder = recorder->_outer)
+				recorder->written_keys.insert(key);
+		}
+
+		void ContractStorageAccessRecorder::record_range_read(const std::string& prefix)
+		{
+			for (auto recorder = current_access_recorder; recorder; recorder = recorder->_outer)
+				recorder->read_prefixes.insert(prefix);
+		}
+
 		static std::string make_contract_info_key(const std::string& contract_id)
 		{
-			return std::string("contract_info_key_") + contract_id;
+			return contract_info_key_prefix + contract_id;
 		}
 
 		static std::string make_contract_storage_key(const std::string& contract_id, const std::string &storage_name)
 		{
-			return std::string("contract_storage_key_") + contract_id + "_" + storage_name;
+			return contract_storage_key_prefix + contract_id + "_" + storage_name;
+		}
+
+		static bool is_state_merkle_key(const std::string& key)
+		{
+			return boost::starts_with(key, contract_info_key_prefix) || boost::starts_with(key, contract_storage_key_prefix);
+		}
+
+		// storages rolled back to null keep a null record, they're left out of the tree like missing ones
+		static bool is_state_merkle_leaf(const std::string& key, const std::string& value)
+		{
+			static const std::string null_storage_record = encode_storage_value_record(jsondiff::JsonValue());
+			return !(value == null_storage_record && boost::starts_with(key, contract_storage_key_prefix));
 		}
 
 		static std::string make_commit_events_key(const ContractCommitId& commit_id) {
-			return std::string("commit_events$") + commit_id;
+			return commit_events_key_prefix + commit_id;
 		}
 
 		static std::string make_transaction_events_key(const std::string& transaction_id) {
-			return std::string("transaction_events$") + transaction_id;
+			return transaction_events_key_prefix + transaction_id;
 		}
 
 		static std::string make_contract_name_id_mapping_key(const std::string& contract_name)
 		{
-			return std::string("contract_name_id_mapping_") + contract_name;
+			return contract_name_id_mapping_key_prefix + contract_name;
+		}
+
+		// records making up the contract state, the rest of the db is commit history and events
+		static const std::vector<std::string>& state_record_key_prefixes()
+		{
+			static const std::vector<std::string> prefixes = { contract_info_key_prefix, contract_name_id_mapping_key_prefix, contract_storage_key_prefix };
+			return prefixes;
+		}
+
+		static bool is_state_record_key(const std::string& key)
+		{
+			for (const auto& prefix : state_record_key_prefixes())
+			{
+				if (boost::starts_with(key, prefix))
+					return true;
+			}
+			return false;
 		}
 
 		ContractStorageService::ContractStorageService(uint32_t magic_number, const std::string& storage_db_path, const std::string& storage_sql_db_path, bool auto_open)
-			: _db(nullptr), _sql_db(nullptr), _magic_number(magic_number), _storage_db_path(storage_db_path), _storage_sql_db_path(storage_sql_db_path)
+			: _sql_db(nullptr), _magic_number(magic_number), _storage_db_path(storage_db_path), _storage_sql_db_path(storage_sql_db_path)
 		{
 			if(auto_open)
 				open();
@@ -72,31 +153,52 @@ namespace contract
 
 		void ContractStorageService::open()
 		{
+			if (!_db)
+			{
+				// snapshots taken before close may still hold the db
+				_db = _last_db.lock();
+			}
 			if (!_db)
 			{
 				leveldb::Options options;
 				options.create_if_missing = true;
-				auto status = leveldb::DB::Open(options, _storage_db_path, &_db);
+				leveldb::DB* db = nullptr;
+				auto status = leveldb::DB::Open(options, _storage_db_path, &db);
 				assert(status.ok());
+				_db.reset(db);
+				_last_db = _db;
+				migrate_records_to_binary();
+				build_state_merkle_tree();
 			}
 			if (!_sql_db)
 			{
 				auto status = sqlite3_open(_storage_sql_db_path.c_str(), &_sql_db);
 				assert(status == SQLITE_OK);
+				// commit infos are written on every block, WAL keeps them to one sequential write without a rollback journal
+				char *err_msg;
+				if (sqlite3_exec(_sql_db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL; PRAGMA temp_store=MEMORY",
+					nullptr, nullptr, &err_msg) != SQLITE_OK)
+				{
+					std::string err_msg_str(err_msg);
+					sqlite3_free(err_msg);
+					BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
+				}
 				// init tables
 				this->init_commits_table();
+				this->delete_commit_infos_after_top();
 			}
 		}
 
 		void ContractStorageService::close()
 		{
-			if (_db)
-			{
-				delete _db;
-				_db = nullptr;
-			}
+			clear_storage_read_cache();
+			_snapshot.reset();
+			_db.reset();
 			if (_sql_db)
 			{
+				for (const auto& p : _sql_statements)
+					sqlite3_finalize(p.second);
+				_sql_statements.clear();
 				sqlite3_close(_sql_db);
 				_sql_db = nullptr;
 			}
@@ -107,69 +209,280 @@ namespace contract
 			return _db ? true : false;
 		}
 
-		static int empty_sql_callback(void *notUsed, int argc, char **argv, char **colNames)
+		// rewrite json records of older databases in the binary record format, in place
+		void ContractStorageService::migrate_records_to_binary()
+		{
+			leveldb::ReadOptions read_options;
+			leveldb::WriteOptions write_options;
+			std::string schema_version_str;
+			if (_db->Get(read_options, schema_version_key, &schema_version_str).ok()
+				&& std::stoul(schema_version_str) >= CONTRACT_STORAGE_SCHEMA_VERSION)
+				return;
+			leveldb::WriteBatch batch;
+			size_t batch_count = 0;
+			std::unique_ptr<leveldb::Iterator> it(_db->NewIterator(read_options));
+			for (it->SeekToFirst(); it->Valid(); it->Next())
+			{
+				const auto& key = it->key().ToString();
+				const auto& value = it->value().ToString();
+				if (is_binary_record(value))
+					continue;
+				std::string new_value;
+				if (boost::starts_with(key, contract_info_key_prefix))
+				{
+					auto contract_info = decode_contract_info_record(value);
+					if (!contract_info)
+						BOOST_THROW_EXCEPTION(ContractStorageException(std::string("contract info db data error of key ") + key));
+					new_value = encode_contract_info_record(*contract_info);
+				}
+				else if (boost::starts_with(key, contract_storage_key_prefix))
+					new_value = encode_storage_value_record(decode_storage_value_record(value));
+				else if (boost::starts_with(key, commit_events_key_prefix) || boost::starts_with(key, transaction_events_key_prefix))
+					new_value = encode_events_record(decode_events_record(value));
+				else
+					continue;
+				batch.Put(key, new_value);
+				if (++batch_count >= MIGRATION_BATCH_SIZE)
+				{
+					if (!_db->Write(write_options, &batch).ok())
+						BOOST_THROW_EXCEPTION(ContractStorageException("migrate contract storage records error"));
+					batch.Clear();
+					batch_count = 0;
+				}
+			}
+			if (!it->status().ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("migrate contract storage records error"));
+			// the version is written last, so an interrupted migration is resumed on next open
+			batch.Put(schema_version_key, std::to_string(CONTRACT_STORAGE_SCHEMA_VERSION));
+			if (!_db->Write(write_options, &batch).ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("migrate contract storage records error"));
+		}
+
+		// state merkle trees of databases written before it existed are built once from all records
+		void ContractStorageService::build_state_merkle_tree()
+		{
+			leveldb::ReadOptions read_options;
+			leveldb::WriteOptions write_options;
+			std::string version_str;
+			if (_db->Get(read_options, state_merkle_version_key, &version_str).ok()
+				&& std::stoul(version_str) >= STATE_MERKLE_VERSION)
+				return;
+			std::unique_ptr<StateMerkleTree> tree(new StateMerkleTree(state_merkle_node_reader()));
+			size_t batch_count = 0;
+			auto write_nodes = [&]() {
+				leveldb::WriteBatch batch;
+				for (const auto& p : tree->changed_nodes())
+				{
+					if (p.second.empty())
+						batch.Delete(p.first);
+					else
+						batch.Put(p.first, p.second);
+				}
+				if (!_db->Write(write_options, &batch).ok())
+					BOOST_THROW_EXCEPTION(ContractStorageException("build state merkle tree error"));
+				tree.reset(new StateMerkleTree(state_merkle_node_reader()));
+				batch_count = 0;
+			};
+			read_options.fill_cache = false;
+			for (const auto& prefix : { contract_info_key_prefix, contract_storage_key_prefix })
+			{
+				std::unique_ptr<leveldb::Iterator> it(_db->NewIterator(read_options));
+				for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next())
+				{
+					const auto& key = it->key().ToString();
+					const auto& value = it->value().ToString();
+					if (!is_state_merkle_leaf(key, value))
+						continue;
+					tree->put(key, value);
+					if (++batch_count >= MIGRATION_BATCH_SIZE)
+						write_nodes();
+				}
+				if (!it->status().ok())
+					BOOST_THROW_EXCEPTION(ContractStorageException(std::string("build state merkle tree error ") + it->status().ToString()));
+			}
+			write_nodes();
+			if (!_db->Put(write_options, state_merkle_version_key, std::to_string(STATE_MERKLE_VERSION)).ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("build state merkle tree error"));
+		}
+
+		// nodes are read from the written state, staged writes only reach the tree when they're written
+		StateMerkleTree::NodeReader ContractStorageService::state_merkle_node_reader() const
+		{
+			auto db = _db;
+			auto snapshot = _snapshot;
+			return [db, snapshot](const std::string& node_key, std::string* node) {
+				leveldb::ReadOptions read_options;
+				read_options.snapshot = snapshot.get();
+				return db->Get(read_options, node_key, node).ok();
+			};
+		}
+
+		std::string ContractStorageService::contract_info_state_key(const AddressType& contract_id)
+		{
+			return make_contract_info_key(contract_id);
+		}
+
+		std::string ContractStorageService::contract_storage_state_key(const AddressType& contract_id, const std::string& storage_name)
+		{
+			return make_contract_storage_key(contract_id, storage_name);
+		}
+
+		std::string ContractStorageService::state_merkle_root() const
+		{
+			check_db();
+			return StateMerkleTree(state_merkle_node_reader()).root();
+		}
+
+		StateMerkleProof ContractStorageService::prove_state_key(const std::string& key, std::string* record) const
+		{
+			check_db();
+			if (!is_state_merkle_key(key))
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("not a state merkle key ") + key));
+			leveldb::ReadOptions read_options;
+			read_options.snapshot = _snapshot.get();
+			if (!_db->Get(read_options, key, record).ok() || !is_state_merkle_leaf(key, *record))
+				record->clear();
+			return StateMerkleTree(state_merkle_node_reader()).prove(key);
+		}
+
+		static void throw_sql_error(sqlite3* sql_db)
+		{
+			BOOST_THROW_EXCEPTION(ContractStorageException(std::string(sqlite3_errmsg(sql_db))));
+		}
+
+		// the commit_info queries select these columns in this order for read_commit_info
+		#define COMMIT_INFO_COLUMNS "id, commit_id, change_type, contract_id, block_height"
+
+		static std::string read_text_column(sqlite3_stmt* stmt, int column)
+		{
+			auto text = sqlite3_column_text(stmt, column);
+			if (!text)
+				return std::string();
+			return std::string(reinterpret_cast<const char*>(text), sqlite3_column_bytes(stmt, column));
+		}
+
+		static ContractCommitInfo read_commit_info(sqlite3_stmt* stmt)
+		{
+			ContractCommitInfo commit_info;
+			commit_info.id = static_cast<uint64_t>(sqlite3_column_int64(stmt, 0));
+			commit_info.commit_id = read_text_column(stmt, 1);
+			commit_info.change_type = read_text_column(stmt, 2);
+			commit_info.contract_id = read_text_column(stmt, 3);
+			commit_info.block_height = static_cast<uint32_t>(sqlite3_column_int64(stmt, 4));
+			return commit_info;
+		}
+
+		sqlite3_stmt* ContractStorageService::prepare_sql(const std::string& sql) const
+		{
+			auto it = _sql_statements.find(sql);
+			if (it != _sql_statements.end())
+				return it->second;
+			sqlite3_stmt* stmt = nullptr;
+			if (sqlite3_prepare_v2(_sql_db, sql.c_str(), static_cast<int>(sql.size() + 1), &stmt, nullptr) != SQLITE_OK)
+				throw_sql_error(_sql_db);
+			_sql_statements[sql] = stmt;
+			return stmt;
+		}
+
+		// run a statement returning no rows. statements are reset after use so they don't keep a read transaction open
+		void ContractStorageService::exec_sql(sqlite3_stmt* stmt) const
+		{
+			BOOST_SCOPE_EXIT_ALL(stmt) {
+				sqlite3_reset(stmt);
+				sqlite3_clear_bindings(stmt);
+			};
+			if (sqlite3_step(stmt) != SQLITE_DONE)
+				throw_sql_error(_sql_db);
+		}
+
+		std::vector<ContractCommitInfo> ContractStorageService::query_commit_infos(sqlite3_stmt* stmt) const
 		{
-			return 0;
+			BOOST_SCOPE_EXIT_ALL(stmt) {
+				sqlite3_reset(stmt);
+				sqlite3_clear_bindings(stmt);
+			};
+			std::vector<ContractCommitInfo> commit_infos;
+			int status;
+			while ((status = sqlite3_step(stmt)) == SQLITE_ROW)
+				commit_infos.push_back(read_commit_info(stmt));
+			if (status != SQLITE_DONE)
+				throw_sql_error(_sql_db);
+			return commit_infos;
 		}
 
 		void ContractStorageService::init_commits_table()
 		{
 			char *errMsg;
-			auto status = sqlite3_exec(_sql_db, "CREATE TABLE IF NOT EXISTS commit_info (id INTEGER PRIMARY KEY, commit_id varchar(255) not null, change_type varchar(50) not null, contract_id varchar(255))",
-				&empty_sql_callback, nullptr, &errMsg);
+			auto status = sqlite3_exec(_sql_db, "CREATE TABLE IF NOT EXISTS commit_info (id INTEGER PRIMARY KEY, commit_id varchar(255) not null, change_type varchar(50) not null, contract_id varchar(255), block_height INTEGER not null default 0)",
+				nullptr, nullptr, &errMsg);
 			if (status != SQLITE_OK)
 			{
+				std::string err_msg_str(errMsg);
 				sqlite3_free(errMsg);
-				BOOST_THROW_EXCEPTION(ContractStorageException(errMsg));
+				BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
 			}
-			status = sqlite3_exec(_sql_db, "CREATE INDEX IF NOT EXISTS commit_id_key ON commit_info (commit_id)",
-				&empty_sql_callback, nullptr, &errMsg);
-			if (status != SQLITE_OK)
+			// tables of older versions have no block_height column, their rows get block height 0
+			bool has_block_height = false;
+			auto table_info = prepare_sql("PRAGMA table_info(commit_info)");
 			{
-				sqlite3_free(errMsg);
-				BOOST_THROW_EXCEPTION(ContractStorageException(errMsg));
+				BOOST_SCOPE_EXIT_ALL(table_info) {
+					sqlite3_reset(table_info);
+				};
+				while (sqlite3_step(table_info) == SQLITE_ROW)
+				{
+					if (read_text_column(table_info, 1) == "block_height")
+						has_block_height = true;
+				}
 			}
+			if (!has_block_height)
+				exec_sql(prepare_sql("ALTER TABLE commit_info ADD COLUMN block_height INTEGER not null default 0"));
+			exec_sql(prepare_sql("CREATE INDEX IF NOT EXISTS commit_id_key ON commit_info (commit_id)"));
+			exec_sql(prepare_sql("CREATE INDEX IF NOT EXISTS commit_block_height_key ON commit_info (block_height)"));
 		}
 
-		static int query_records_sql_callback(void *json_array_ptr, int argc, char **argv, char **colNames)
+		// commit_info rows are written before the leveldb batch of a commit and deleted after the leveldb batch of a rollback,
+		// so rows newer than the top root state hash in leveldb are leftovers of an interrupted commit or rollback
+		void ContractStorageService::delete_commit_infos_after_top()
 		{
-			auto json_array = (jsondiff::JsonArray*) json_array_ptr;
-			jsondiff::JsonObject record;
-			int i;
-			for (i = 0; i < argc; i++) {
-				auto colName = colNames[i];
-				if (argv[i])
-					record[colName] = argv[i];
-				else
-					record[colName] = jsondiff::JsonValue();
-			}
-			json_array->push_back(record);
-			return 0;
+			std::string top_commit_id;
+			if (!get_value(top_root_state_hash_key, &top_commit_id) && !get_value(root_state_hash_key, &top_commit_id))
+				top_commit_id = EMPTY_COMMIT_ID;
+			if (top_commit_id != EMPTY_COMMIT_ID && !get_commit_info(top_commit_id))
+				return;
+			delete_commit_infos_after(top_commit_id);
 		}
 
 		ContractCommitInfoP ContractStorageService::get_commit_info(const ContractCommitId& commit_id) const
 		{
 			check_db();
-			char *errMsg;
-			jsondiff::JsonArray records;
-			auto query_sql = std::string("select id, commit_id, change_type, contract_id from commit_info where commit_id='") + commit_id + "'";
-			auto status = sqlite3_exec(_sql_db, query_sql.c_str(),
-				&query_records_sql_callback, &records, &errMsg);
-			if (status != SQLITE_OK)
+			if (_block_writes)
 			{
-				std::string err_msg_str(errMsg);
-				sqlite3_free(errMsg);
-				BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
+				for (const auto& commit_info : _block_writes->commit_infos)
+				{
+					if (commit_info.commit_id == commit_id)
+						return std::make_shared<ContractCommitInfo>(commit_info);
+				}
 			}
-			if (records.empty())
+			if (!_sql_db)
 				return nullptr;
-			jsondiff::JsonObject found_record = records[0].as<jsondiff::JsonObject>();
-			auto commit_info = std::make_shared<ContractCommitInfo>();
-			commit_info->id = found_record["id"].as_uint64();
-			commit_info->commit_id = found_record["commit_id"].as_string();
-			commit_info->contract_id = found_record["contract_id"].as_string();
-			commit_info->change_type = found_record["change_type"].as_string();
-			return commit_info;
+			auto stmt = prepare_sql("select " COMMIT_INFO_COLUMNS " from commit_info where commit_id=? limit 1");
+			sqlite3_bind_text(stmt, 1, commit_id.data(), static_cast<int>(commit_id.size()), SQLITE_STATIC);
+			auto commit_infos = query_commit_infos(stmt);
+			if (commit_infos.empty())
+				return nullptr;
+			return std::make_shared<ContractCommitInfo>(commit_infos[0]);
+		}
+
+		static void bind_commit_info(sqlite3_stmt* stmt, const ContractCommitInfo& commit_info, bool with_id)
+		{
+			if (with_id)
+				sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(commit_info.id));
+			else
+				sqlite3_bind_null(stmt, 1);
+			sqlite3_bind_text(stmt, 2, commit_info.commit_id.data(), static_cast<int>(commit_info.commit_id.size()), SQLITE_STATIC);
+			sqlite3_bind_text(stmt, 3, commit_info.change_type.data(), static_cast<int>(commit_info.change_type.size()), SQLITE_STATIC);
+			sqlite3_bind_text(stmt, 4, commit_info.contract_id.data(), static_cast<int>(commit_info.contract_id.size()), SQLITE_STATIC);
+			sqlite3_bind_int64(stmt, 5, commit_info.block_height);
 		}
 
 		void ContractStorageService::add_commit_info(ContractCommitId commit_id, const std::string &change_type, const std::string &diff_str, const std::string &contract_id)
@@ -180,139 +493,328 @@ namespace contract
 			{
 				BOOST_THROW_EXCEPTION(ContractStorageException("same commitId existed before"));
 			}
-			char *insert_err;
-			auto insert_sql = std::string("insert into commit_info (commit_id, change_type, contract_id) values ('") + commit_id + "','" + change_type + "', '" + contract_id + "')";
-			auto insert_status = sqlite3_exec(_sql_db,
-				insert_sql.c_str(), &empty_sql_callback, nullptr, &insert_err);
-			if (insert_status != SQLITE_OK)
+			put_value(commit_id, diff_str);
+			ContractCommitInfo commit_info;
+			commit_info.commit_id = commit_id;
+			commit_info.change_type = change_type;
+			commit_info.contract_id = contract_id;
+			// commits are made by the block connected on top of the current block height
+			commit_info.block_height = _current_block_height + 1;
+			if (_block_writes)
+			{
+				// inserted with the same ids when block writes are flushed
+				commit_info.id = _block_writes->last_commit_info_id + _block_writes->commit_infos.size() + 1;
+				_block_writes->commit_infos.push_back(commit_info);
+				return;
+			}
+			auto stmt = prepare_sql("insert into commit_info (" COMMIT_INFO_COLUMNS ") values (?, ?, ?, ?, ?)");
+			bind_commit_info(stmt, commit_info, false);
+			try
+			{
+				exec_sql(stmt);
+			}
+			catch (const ContractStorageException&)
 			{
-				sqlite3_free(insert_err);
 				BOOST_THROW_EXCEPTION(ContractStorageException("insert contract change commit to db error"));
 			}
-			leveldb::WriteOptions write_options;
-			auto save_diff_status = _db->Put(write_options, commit_id, diff_str);
-			if (!save_diff_status.ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("save contract info diff to db error"));
 		}
 
-		std::string ContractStorageService::get_value_by_key_or_error(const std::string &key)
+		void ContractStorageService::delete_commit_info(const ContractCommitId& commit_id)
 		{
-			check_db();
-			leveldb::ReadOptions read_options;
-			std::string value;
-			auto status = _db->Get(read_options, key, &value);
-			if (!status.ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("Can't find value by key ") + key));
-			return value;
+			auto stmt = prepare_sql("delete from commit_info where commit_id=?");
+			sqlite3_bind_text(stmt, 1, commit_id.data(), static_cast<int>(commit_id.size()), SQLITE_STATIC);
+			exec_sql(stmt);
 		}
 
-		jsondiff::JsonValue ContractStorageService::get_json_value_by_key_or_null(const std::string &key)
+		void ContractStorageService::delete_commit_infos_after(const ContractCommitId& dest_commit_id)
 		{
-			check_db();
-			leveldb::ReadOptions read_options;
-			std::string value;
-			auto status = _db->Get(read_options, key, &value);
-			if (!status.ok())
-				return jsondiff::JsonValue();
-			return jsondiff::json_loads(value);
+			if (dest_commit_id == EMPTY_COMMIT_ID)
+			{
+				delete_commit_infos_after(0);
+				return;
+			}
+			auto commit_info = get_commit_info(dest_commit_id);
+			if (!commit_info)
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("Can't find commit ") + dest_commit_id));
+			delete_commit_infos_after(commit_info->id);
 		}
 
-		fcrypto::sha256 ContractStorageService::hash_new_contract_info_commit(ContractInfoP contract_info) const
+		void ContractStorageService::delete_commit_infos_after(uint64_t commit_info_id)
 		{
-			return ordered_json_digest(contract_info->to_json());
+			auto stmt = prepare_sql("delete from commit_info where id>?");
+			sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(commit_info_id));
+			exec_sql(stmt);
 		}
 
-		fcrypto::sha256 ContractStorageService::hash_contract_changes(ContractChangesP changes) const
+		void ContractStorageService::delete_commit_infos_before(uint64_t commit_info_id)
 		{
-			return ordered_json_digest(changes->to_json());
+			auto stmt = prepare_sql("delete from commit_info where id<?");
+			sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(commit_info_id));
+			exec_sql(stmt);
 		}
 
-		void ContractStorageService::check_db() const
+		void ContractStorageService::begin_sql_transaction()
 		{
-			if (!_db)
-				BOOST_THROW_EXCEPTION(ContractStorageException("contract storage db not opened"));
-			if (!_sql_db)
-				BOOST_THROW_EXCEPTION(ContractStorageException("contract storage sql db not opened"));
+			check_db();
+			exec_sql(prepare_sql("BEGIN"));
+		}
+		void ContractStorageService::commit_sql_transaction()
+		{
+			check_db();
+			exec_sql(prepare_sql("COMMIT"));
+		}
+		void ContractStorageService::rollback_sql_transaction()
+		{
+			check_db();
+			exec_sql(prepare_sql("ROLLBACK"));
 		}
 
-		void ContractStorageService::begin_sql_transaction()
+		void ContractStorageService::begin_pending_writes()
 		{
 			check_db();
-			char *err;
-			if (sqlite3_exec(_sql_db, "BEGIN", nullptr, nullptr, &err) != SQLITE_OK)
+			if (_pending_writes)
+				BOOST_THROW_EXCEPTION(ContractStorageException("contract storage writes already pending"));
+			_pending_writes.reset(new PendingWrites());
+		}
+
+		void ContractStorageService::write_pending_writes()
+		{
+			if (!_pending_writes)
+				BOOST_THROW_EXCEPTION(ContractStorageException("no pending contract storage writes"));
+			std::unique_ptr<PendingWrites> pending_writes(std::move(_pending_writes));
+			if (_block_writes)
 			{
-				std::string err_str = std::string("contract sql transaction begin error ") + err;
-				sqlite3_free(err);
-				BOOST_THROW_EXCEPTION(ContractStorageException(err_str));
+				for (auto& p : pending_writes->values)
+					_block_writes->values[p.first] = std::move(p.second);
+				return;
 			}
+			write_to_db(*pending_writes);
 		}
-		void ContractStorageService::commit_sql_transaction()
+
+		void ContractStorageService::write_to_db(const PendingWrites& writes)
 		{
-			check_db();
-			char *err;
-			if (sqlite3_exec(_sql_db, "COMMIT", nullptr, nullptr, &err) != SQLITE_OK)
+			if (_snapshot)
+				BOOST_THROW_EXCEPTION(ContractStorageException("contract storage snapshot is read-only"));
+			leveldb::WriteBatch batch;
+			// the state merkle tree is updated in the same batch, for the touched records only
+			StateMerkleTree state_merkle_tree(state_merkle_node_reader());
+			for (const auto& p : writes.values)
 			{
-				std::string err_str = std::string("contract sql transaction commit error ") + err;
-				sqlite3_free(err);
-				BOOST_THROW_EXCEPTION(ContractStorageException(err_str));
+				if (p.second.first)
+					batch.Delete(p.first);
+				else
+					batch.Put(p.first, p.second.second);
+				if (!is_state_merkle_key(p.first))
+					continue;
+				if (p.second.first || !is_state_merkle_leaf(p.first, p.second.second))
+					state_merkle_tree.remove(p.first);
+				else
+					state_merkle_tree.put(p.first, p.second.second);
 			}
+			for (const auto& p : state_merkle_tree.changed_nodes())
+			{
+				if (p.second.empty())
+					batch.Delete(p.first);
+				else
+					batch.Put(p.first, p.second);
+			}
+			leveldb::WriteOptions write_options;
+			auto status = _db->Write(write_options, &batch);
+			if (!status.ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("write contract storage batch error ") + status.ToString()));
 		}
-		void ContractStorageService::rollback_sql_transaction()
+
+		void ContractStorageService::drop_pending_writes()
 		{
-			check_db();
-			char *err;
-			if (sqlite3_exec(_sql_db, "ROLLBACK", nullptr, nullptr, &err) != SQLITE_OK)
+			if (_pending_writes)
+				invalidate_storage_read_cache(*_pending_writes);
+			_pending_writes.reset();
+		}
+
+		void ContractStorageService::invalidate_storage_read_cache(const PendingWrites& writes)
+		{
+			std::lock_guard<std::mutex> lock(_storage_read_cache_mutex);
+			if (_storage_read_cache.empty())
+				return;
+			for (const auto& p : writes.values)
+				_storage_read_cache.erase(p.first);
+		}
+
+		void ContractStorageService::clear_storage_read_cache()
+		{
+			std::lock_guard<std::mutex> lock(_storage_read_cache_mutex);
+			_storage_read_cache.clear();
+		}
+
+		bool ContractStorageService::get_value(const std::string& key, std::string* value) const
+		{
+			if (current_access_recorder)
+				ContractStorageAccessRecorder::record_read(key);
+			if (_pending_writes)
 			{
-				std::string err_str = std::string("contract sql transaction rollback error ") + err;
-				sqlite3_free(err);
-				BOOST_THROW_EXCEPTION(ContractStorageException(err_str));
+				auto it = _pending_writes->values.find(key);
+				if (it != _pending_writes->values.end())
+				{
+					if (it->second.first)
+						return false;
+					*value = it->second.second;
+					return true;
+				}
+			}
+			if (_block_writes)
+			{
+				auto it = _block_writes->values.find(key);
+				if (it != _block_writes->values.end())
+				{
+					if (it->second.first)
+						return false;
+					*value = it->second.second;
+					return true;
+				}
 			}
+			leveldb::ReadOptions read_options;
+			read_options.snapshot = _snapshot.get();
+			return _db->Get(read_options, key, value).ok();
 		}
 
-		void ContractStorageService::rollback_leveldb_transaction(const leveldb::Snapshot* snapshot_to_rollback, const std::vector<std::string>& changed_keys)
+		void ContractStorageService::scan_values(const std::string& prefix, const std::string& start_after,
+			const std::function<bool(const std::string& key, const std::string& value)>& visitor) const
 		{
-			// leveldb rollback using snapshot
-			leveldb::WriteOptions write_options;
-			leveldb::ReadOptions read_options_for_snapshot;
-			read_options_for_snapshot.snapshot = snapshot_to_rollback;
-			for (const auto& key : changed_keys) {
-				std::string old_value;
-				auto status = _db->Get(read_options_for_snapshot, key, &old_value);
-				if (status.ok())
+			if (current_access_recorder)
+				ContractStorageAccessRecorder::record_range_read(prefix);
+			// staged writes shadow the db, the pending ones shadow the block ones
+			const std::map<std::string, std::pair<bool, std::string>>* overlays[] = {
+				_pending_writes ? &_pending_writes->values : nullptr,
+				_block_writes ? &_block_writes->values : nullptr
+			};
+			leveldb::ReadOptions read_options;
+			read_options.snapshot = _snapshot.get();
+			read_options.fill_cache = false;
+			std::unique_ptr<leveldb::Iterator> db_it(_db->NewIterator(read_options));
+			std::string last_key = start_after < prefix ? prefix : start_after;
+			bool include_last = start_after < prefix;
+			db_it->Seek(last_key);
+			while (true)
+			{
+				while (db_it->Valid() && !include_last && db_it->key().compare(last_key) <= 0)
+					db_it->Next();
+				bool found = false;
+				std::string key;
+				if (db_it->Valid() && db_it->key().starts_with(prefix))
 				{
-					_db->Put(write_options, key, old_value);
+					key = db_it->key().ToString();
+					found = true;
 				}
-				else if (status.IsNotFound())
+				for (auto overlay : overlays)
 				{
-					_db->Delete(write_options, key);
+					if (!overlay)
+						continue;
+					auto it = include_last ? overlay->lower_bound(last_key) : overlay->upper_bound(last_key);
+					if (it != overlay->end() && boost::starts_with(it->first, prefix) && (!found || it->first < key))
+					{
+						key = it->first;
+						found = true;
+					}
 				}
+				if (!found)
+					break;
+				last_key = key;
+				include_last = false;
+
+				const std::pair<bool, std::string>* staged = nullptr;
+				for (auto overlay : overlays)
+				{
+					if (!overlay)
+						continue;
+					auto it = overlay->find(key);
+					if (it != overlay->end())
+					{
+						staged = &it->second;
+						break;
+					}
+				}
+				if (staged)
+				{
+					if (staged->first)
+						continue;
+					if (!visitor(key, staged->second))
+						break;
+				}
+				else if (!visitor(key, db_it->value().ToString()))
+					break;
 			}
+			if (!db_it->status().ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("scan contract storage error ") + db_it->status().ToString()));
+		}
+
+		void ContractStorageService::put_value(const std::string& key, const std::string& value)
+		{
+			if (!_pending_writes)
+				BOOST_THROW_EXCEPTION(ContractStorageException("contract storage write outside of pending writes"));
+			if (current_access_recorder)
+				ContractStorageAccessRecorder::record_write(key);
+			_pending_writes->values[key] = std::make_pair(false, value);
+			erase_storage_read_cache(key);
+		}
+
+		void ContractStorageService::delete_value(const std::string& key)
+		{
+			if (!_pending_writes)
+				BOOST_THROW_EXCEPTION(ContractStorageException("contract storage write outside of pending writes"));
+			if (current_access_recorder)
+				ContractStorageAccessRecorder::record_write(key);
+			_pending_writes->values[key] = std::make_pair(true, std::string());
+			erase_storage_read_cache(key);
+		}
+
+		void ContractStorageService::erase_storage_read_cache(const std::string& key)
+		{
+			std::lock_guard<std::mutex> lock(_storage_read_cache_mutex);
+			_storage_read_cache.erase(key);
+		}
+
+		jsondiff::JsonValue ContractStorageService::get_json_value_by_key_or_null(const std::string &key)
+		{
+			check_db();
+			std::string value;
+			if (!get_value(key, &value))
+				return jsondiff::JsonValue();
+			return jsondiff::json_loads(value);
+		}
+
+		fcrypto::sha256 ContractStorageService::hash_new_contract_info_commit(ContractInfoP contract_info) const
+		{
+			return ordered_json_digest(contract_info->to_json());
+		}
+
+		fcrypto::sha256 ContractStorageService::hash_contract_changes(ContractChangesP changes) const
+		{
+			return ordered_json_digest(changes->to_json());
+		}
+
+		void ContractStorageService::check_db() const
+		{
+			if (!_db)
+				BOOST_THROW_EXCEPTION(ContractStorageException("contract storage db not opened"));
+			if (!_sql_db && !_snapshot)
+				BOOST_THROW_EXCEPTION(ContractStorageException("contract storage sql db not opened"));
 		}
 
 		ContractInfoP ContractStorageService::get_contract_info(const AddressType& contract_id) const
 		{
 			check_db();
-			leveldb::ReadOptions options;
 			std::string value;
-			auto status = _db->Get(options, make_contract_info_key(contract_id), &value);
-			if (!status.ok()) {
+			if (!get_value(make_contract_info_key(contract_id), &value)) {
 				return nullptr;
 			}
-			auto json_value = jsondiff::json_loads(value);
-			if (!json_value.is_object())
-				BOOST_THROW_EXCEPTION(ContractStorageException("contract info db data error"));
-			auto json_obj = json_value.as<jsondiff::JsonObject>();
-			auto contract_info = ContractInfo::from_json(json_obj);
-			return contract_info;
+			return decode_contract_info_record(value);
 		}
 
 		AddressType ContractStorageService::find_contract_id_by_name(const std::string& name) const
 		{
 			check_db();
-			leveldb::ReadOptions options;
 			std::string contract_id;
-			auto status = _db->Get(options, make_contract_name_id_mapping_key(name), &contract_id);
-			if (!status.ok())
+			if (!get_value(make_contract_name_id_mapping_key(name), &contract_id))
 			{
 				return "";
 			}
@@ -326,9 +828,8 @@ namespace contract
 		ContractCommitId ContractStorageService::current_root_state_hash() const
 		{
 			check_db();
-			leveldb::ReadOptions read_options;
 			std::string state_hash;
-			if (!_db->Get(read_options, root_state_hash_key, &state_hash).ok())
+			if (!get_value(root_state_hash_key, &state_hash))
 				state_hash = EMPTY_COMMIT_ID;
 			return state_hash;
 		}
@@ -357,58 +858,58 @@ namespace contract
 		ContractCommitId ContractStorageService::top_root_state_hash() const
 		{
 			check_db();
-			leveldb::ReadOptions read_options;
 			std::string state_hash;
-			if (!_db->Get(read_options, top_root_state_hash_key, &state_hash).ok())
+			if (!get_value(top_root_state_hash_key, &state_hash))
 				state_hash = EMPTY_COMMIT_ID;
 			return state_hash;
 		}
 
+		// leveldb changes of a commit are staged and written with one batch after its commit_info row is inserted,
+		// the row is removed again when the batch write fails
+		void ContractStorageService::write_commit(const ContractCommitId& commit_id)
+		{
+			if (_block_writes)
+			{
+				write_pending_writes();
+				return;
+			}
+			try
+			{
+				write_pending_writes();
+			}
+			catch (...)
+			{
+				delete_commit_info(commit_id);
+				throw;
+			}
+		}
+
 		ContractCommitId ContractStorageService::save_contract_info(ContractInfoP contract_info)
 		{
 			check_db();
-			bool success = false;
-			leveldb::WriteOptions write_options;
-			// snapshot leveldb for rollback
-			const auto snapshot = _db->GetSnapshot();
-			BOOST_SCOPE_EXIT_ALL(&) {
-				_db->ReleaseSnapshot(snapshot);
-			};
-			std::vector<std::string> changed_leveldb_keys;
-			begin_sql_transaction();
-			BOOST_SCOPE_EXIT_ALL(&) {
-				if (success)
-				{
-					commit_sql_transaction();
-				}
-				else
-				{
-					rollback_sql_transaction();
-					rollback_leveldb_transaction(snapshot, changed_leveldb_keys);
-				}
-			};
 			const auto& old_root_state_hash = current_root_state_hash();
 			const auto& top_commit_id = top_root_state_hash();
 			if (old_root_state_hash != top_commit_id) {
-				rollback_to_root_state_hash_without_transactional(old_root_state_hash, changed_leveldb_keys);
+				rollback_to_root_state_hash(old_root_state_hash);
 				assert(current_root_state_hash() == old_root_state_hash);
 			}
 
+			begin_pending_writes();
+			BOOST_SCOPE_EXIT_ALL(&) {
+				drop_pending_writes();
+			};
 			auto key = make_contract_info_key(contract_info->id);
-			leveldb::ReadOptions read_options;
 			std::string old_value;
 			jsondiff::JsonObject old_json_value;
-			auto read_status = _db->Get(read_options, key, &old_value);
-			if (read_status.ok())
+			if (get_value(key, &old_value))
 			{
-				old_json_value = jsondiff::json_loads(old_value).as<jsondiff::JsonObject>();
+				auto old_contract_info = decode_contract_info_record(old_value);
+				if (old_contract_info)
+					old_json_value = old_contract_info->to_json();
 			}
 
 			auto json_obj = contract_info->to_json();
-			auto status = _db->Put(write_options, key, jsondiff::json_dumps(json_obj));
-			if (!status.ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("save contract info to db error"));
-			changed_leveldb_keys.push_back(key);
+			put_value(key, encode_contract_info_record(*contract_info));
 			jsondiff::JsonDiff differ;
 			auto contract_info_diff = differ.diff(old_json_value, json_obj);
 			std::string contract_info_diff_str = contract_info_diff->str();
@@ -419,24 +920,18 @@ namespace contract
 				// check name unique(exist contract with this name's id must be same or empty)
 				const auto& contract_name_id_mapping_key = make_contract_name_id_mapping_key(contract_info->name);
 				std::string exist_name_id;
-				if (_db->Get(read_options, contract_name_id_mapping_key, &exist_name_id).ok() && exist_name_id != contract_info->id)
+				if (get_value(contract_name_id_mapping_key, &exist_name_id) && exist_name_id != contract_info->id)
 					BOOST_THROW_EXCEPTION(ContractStorageException(std::string("contract name ") + contract_info->name + " existed before"));
-				if (!_db->Put(write_options, contract_name_id_mapping_key, contract_info->id).ok())
-					BOOST_THROW_EXCEPTION(ContractStorageException("save contract name => contract id mapping to db error"));
-				changed_leveldb_keys.push_back(contract_name_id_mapping_key);
+				put_value(contract_name_id_mapping_key, contract_info->id);
 			}
 
 			// update root-state-hash
 			const auto& root_state_hash = generate_next_root_hash(old_root_state_hash, hash_new_contract_info_commit(contract_info));
 			ContractCommitId commitId = root_state_hash;
+			put_value(root_state_hash_key, root_state_hash);
+			put_value(top_root_state_hash_key, root_state_hash);
 			add_commit_info(commitId, CONTRACT_INFO_CHANGE_TYPE, contract_info_diff_str, contract_info->id);
-			if (!_db->Put(write_options, root_state_hash_key, root_state_hash).ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("update root state hash error"));
-			changed_leveldb_keys.push_back(root_state_hash_key);
-			if (!_db->Put(write_options, top_root_state_hash_key, root_state_hash).ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("update top root state hash error"));
-			changed_leveldb_keys.push_back(top_root_state_hash_key);
-			success = true;
+			write_commit(commitId);
 			return commitId;
 		}
 
@@ -451,91 +946,80 @@ namespace contract
 		jsondiff::JsonValue ContractStorageService::get_contract_storage(AddressType contract_id, const std::string& storage_name) const
 		{
 			check_db();
-			auto key = make_contract_storage_key(contract_id, storage_name);
-			auto snapshot = _db->GetSnapshot();
-			BOOST_SCOPE_EXIT_ALL(&) {
-				_db->ReleaseSnapshot(snapshot);
-			};
-			leveldb::ReadOptions options;
-			options.snapshot = snapshot;
+			const auto& key = make_contract_storage_key(contract_id, storage_name);
+			// the cache only lives as long as the block writes, the writes outside of a block don't invalidate it
+			if (_block_writes)
+			{
+				std::lock_guard<std::mutex> lock(_storage_read_cache_mutex);
+				auto found = _storage_read_cache.find(key);
+				if (found != _storage_read_cache.end())
+				{
+					if (current_access_recorder)
+						ContractStorageAccessRecorder::record_read(key);
+					return found->second;
+				}
+			}
 			std::string value;
-			auto status = _db->Get(options, key, &value);
-			if (!status.ok())
-				return jsondiff::JsonValue();
-			return jsondiff::json_loads(value);
+			jsondiff::JsonValue storage_value;
+			if (get_value(key, &value))
+				storage_value = decode_storage_value_record(value);
+			if (_block_writes)
+			{
+				std::lock_guard<std::mutex> lock(_storage_read_cache_mutex);
+				_storage_read_cache[key] = storage_value;
+			}
+			return storage_value;
 		}
+		std::vector<std::pair<std::string, jsondiff::JsonValue>> ContractStorageService::list_contract_storage(const AddressType& contract_id, const std::string& name_prefix,
+			const std::string& start_after, size_t limit) const
+		{
+			check_db();
+			std::vector<std::pair<std::string, jsondiff::JsonValue>> result;
+			if (limit == 0)
+				return result;
+			const auto& key_prefix = make_contract_storage_key(contract_id, "");
+			const auto& start_key = start_after.empty() ? std::string() : key_prefix + start_after;
+			scan_values(key_prefix + name_prefix, start_key, [&](const std::string& key, const std::string& value) {
+				auto storage_value = decode_storage_value_record(value);
+				if (!storage_value.is_null())
+					result.push_back(std::make_pair(key.substr(key_prefix.size()), std::move(storage_value)));
+				return result.size() < limit;
+			});
+			return result;
+		}
+
 		std::vector<ContractBalance> ContractStorageService::get_contract_balances(const AddressType& contract_id) const
 		{
 			check_db();
-			auto snapshot = _db->GetSnapshot();
-			BOOST_SCOPE_EXIT_ALL(&) {
-				_db->ReleaseSnapshot(snapshot);
-			};
-			leveldb::ReadOptions options;
-			options.snapshot = snapshot;
 			std::string value;
 			std::vector<ContractBalance> result;
-			auto status = _db->Get(options, make_contract_info_key(contract_id), &value);
-			if (!status.ok()) {
+			if (!get_value(make_contract_info_key(contract_id), &value)) {
 				return result;
 			}
-			auto json_value = jsondiff::json_loads(value);
-			if (!json_value.is_object())
+			auto contract_info = decode_contract_info_record(value);
+			if (!contract_info)
 				BOOST_THROW_EXCEPTION(ContractStorageException("contract info db data error"));
-			auto contract_info = std::make_shared<ContractInfo>();
-			auto json_obj = json_value.as<jsondiff::JsonObject>();
-			auto balances_json_array = json_obj["balances"].as<jsondiff::JsonArray>();
-			for (size_t i = 0; i < balances_json_array.size(); i++)
-			{
-				auto balance_item_json = balances_json_array[i].as<jsondiff::JsonObject>();
-				ContractBalance balance;
-				balance.asset_id = (uint32_t) balance_item_json["asset_id"].as_uint64();
-				balance.amount = balance_item_json["amount"].as_uint64();
-				result.push_back(balance);
-			}
-			return result;
+			return contract_info->balances;
 		}
 
 		std::shared_ptr<std::vector<ContractEventInfo>> ContractStorageService::get_commit_events(const ContractCommitId& commit_id) const
 		{
 			check_db();
 			auto events = std::make_shared<std::vector<ContractEventInfo>>();
-			auto snapshot = _db->GetSnapshot();
-			BOOST_SCOPE_EXIT_ALL(&) {
-				_db->ReleaseSnapshot(snapshot);
-			};
-			leveldb::ReadOptions read_options;
-			read_options.snapshot = snapshot;
-			const auto& commit_events_key = make_commit_events_key(commit_id);
-
 			std::string events_str_value;
-			if (_db->Get(read_options, commit_events_key, &events_str_value).ok()) {
-				const auto& json_obj = jsondiff::json_loads(events_str_value);
-				if (json_obj.is_array()) {
-					*events = ContractChanges::events_from_json(json_obj.as<jsondiff::JsonArray>());
-				}
+			if (get_value(make_commit_events_key(commit_id), &events_str_value)) {
+				*events = decode_events_record(events_str_value);
 			}
-			return events; 
+			return events;
 		}
 
 		std::shared_ptr<std::vector<ContractEventInfo>> ContractStorageService::get_transaction_events(const std::string& transaction_id) const
 		{
 			check_db();
 			auto events = std::make_shared<std::vector<ContractEventInfo>>();
-			auto snapshot = _db->GetSnapshot();
-			BOOST_SCOPE_EXIT_ALL(&) {
-				_db->ReleaseSnapshot(snapshot);
-			};
-			leveldb::ReadOptions read_options;
-			read_options.snapshot = snapshot;
-
-			const auto& tx_events_key = make_transaction_events_key(transaction_id);
 			std::string value;
-			if (_db->Get(read_options, tx_events_key, &value).ok()) {
-				const auto& events_json = jsondiff::json_loads(value);
-				if (events_json.is_array()) {
-					*events = ContractChanges::events_from_json(events_json.as<jsondiff::JsonArray>());
-				}
+			if (get_value(make_transaction_events_key(transaction_id), &value)) {
+				*events = decode_events_record(value);
 			}
 			return events;
 		}
@@ -543,32 +1027,17 @@ namespace contract
 		void ContractStorageService::clear_sql_db()
 		{
 			check_db();
-			char *err_msg;
-			auto drop_status = sqlite3_exec(_sql_db, "delete from commit_info", &empty_sql_callback, nullptr, &err_msg);
-			if (drop_status != SQLITE_OK)
-			{
-				std::string err_msg_str(err_msg);
-				sqlite3_free(err_msg);
-				BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
-			}
+			exec_sql(prepare_sql("delete from commit_info"));
 		}
 
 		// save commit history with all diffs
 		ContractCommitId ContractStorageService::commit_contract_changes(ContractChangesP changes)
 		{
 			check_db();
-			leveldb::ReadOptions read_options;
-			leveldb::WriteOptions write_options;
-			// snapshot leveldb for rollback
-			const auto snapshot = _db->GetSnapshot();
-			BOOST_SCOPE_EXIT_ALL(&) {
-				_db->ReleaseSnapshot(snapshot);
-			};
-			std::vector<std::string> changed_leveldb_keys;
 			const auto& old_root_state_hash = current_root_state_hash();
 			const auto& top_commit_id = top_root_state_hash();
 			if (old_root_state_hash != top_commit_id) {
-				rollback_to_root_state_hash_without_transactional(old_root_state_hash, changed_leveldb_keys);
+				rollback_to_root_state_hash(old_root_state_hash);
 				assert(current_root_state_hash() == old_root_state_hash);
 			}
 			if (changes->empty()) {
@@ -579,18 +1048,9 @@ namespace contract
 			// check commitId not conflict
 			if(get_commit_info(commitId))
 				BOOST_THROW_EXCEPTION(ContractStorageException("same commitId existed before"));
-			bool success = false;
-			begin_sql_transaction();
+			begin_pending_writes();
 			BOOST_SCOPE_EXIT_ALL(&) {
-				if (success)
-				{
-					commit_sql_transaction();
-				}
-				else
-				{
-					rollback_sql_transaction();
-					rollback_leveldb_transaction(snapshot, changed_leveldb_keys);
-				}
+				drop_pending_writes();
 			};
 			// merge change to leveldb
 			for (const auto &balance_change : changes->balance_changes)
@@ -620,25 +1080,14 @@ namespace contract
 				}
 				std::string value;
 				auto contract_info_key = make_contract_info_key(balance_change.address);
-				auto status = _db->Get(read_options, contract_info_key, &value);
-				if (!status.ok()) {
+				if (!get_value(contract_info_key, &value)) {
 					BOOST_THROW_EXCEPTION(ContractStorageException("contract info not found to transfer balance"));
 				}
-				auto json_value = jsondiff::json_loads(value);
-				if (!json_value.is_object())
+				auto contract_info = decode_contract_info_record(value);
+				if (!contract_info)
 					BOOST_THROW_EXCEPTION(ContractStorageException("contract info db data error"));
-				auto json_obj = json_value.as<jsondiff::JsonObject>();
-				jsondiff::JsonArray balances_json_array;
-				for (const auto &balance : balances)
-				{
-					balances_json_array.push_back(balance.to_json());
-				}
-				json_obj["balances"] = balances_json_array;
-				const auto& new_contract_info_value = jsondiff::json_dumps(json_obj);
-				auto write_status = _db->Put(write_options, contract_info_key, new_contract_info_value);
-				if(!write_status.ok())
-					BOOST_THROW_EXCEPTION(ContractStorageException("contract info write to db error"));
-				changed_leveldb_keys.push_back(contract_info_key);
+				contract_info->balances = balances;
+				put_value(contract_info_key, encode_contract_info_record(*contract_info));
 			}
 			jsondiff::JsonDiff differ;
 			for (const auto &storage_change : changes->storage_changes)
@@ -648,11 +1097,7 @@ namespace contract
 				{
 					const auto& storage_old_value = get_contract_storage(contract_id, storage_change_item.name);
 					const auto& storage_value = differ.patch(storage_old_value, storage_change_item.diff);
-					const auto& key = make_contract_storage_key(contract_id, storage_change_item.name);
-					auto status = _db->Put(write_options, key, jsondiff::json_dumps(storage_value));
-					if (!status.ok())
-						BOOST_THROW_EXCEPTION(ContractStorageException("contract storage write to db error"));
-					changed_leveldb_keys.push_back(key);
+					put_value(make_contract_storage_key(contract_id, storage_change_item.name), encode_storage_value_record(storage_value));
 				}
 			}
 
@@ -669,22 +1114,10 @@ namespace contract
 			}
 
 			// commitId=>events
-			{
-				const auto& commit_events_key = make_commit_events_key(commitId);
-				const auto& events_json = ContractChanges::events_to_json(changes->events);
-				if (!_db->Put(write_options, commit_events_key, jsondiff::json_dumps(events_json)).ok()) {
-					BOOST_THROW_EXCEPTION(ContractStorageException("commit events save error"));
-				}
-				changed_leveldb_keys.push_back(commit_events_key);
-			}
+			put_value(make_commit_events_key(commitId), encode_events_record(changes->events));
 			// transactionId=>events
 			for (const auto& p : *transaction_events) {
-				const auto& tx_events_key = make_transaction_events_key(p.first);
-				const auto& tx_events_json = ContractChanges::events_to_json(p.second);
-				if (!_db->Put(write_options, tx_events_key, jsondiff::json_dumps(tx_events_json)).ok()) {
-					BOOST_THROW_EXCEPTION(ContractStorageException("commit events save error"));
-				}
-				changed_leveldb_keys.push_back(tx_events_key);
+				put_value(make_transaction_events_key(p.first), encode_events_record(p.second));
 			}
 
 			// upgrade infos
@@ -693,14 +1126,12 @@ namespace contract
 				const auto& contract_id = upgrade_info.contract_id;
 				std::string value;
 				auto contract_info_key = make_contract_info_key(contract_id);
-				auto status = _db->Get(read_options, contract_info_key, &value);
-				if (!status.ok()) {
+				if (!get_value(contract_info_key, &value)) {
 					BOOST_THROW_EXCEPTION(ContractStorageException("contract info not found to upgrade"));
 				}
-				auto json_value = jsondiff::json_loads(value);
-				if (!json_value.is_object())
+				auto contract_info = decode_contract_info_record(value);
+				if (!contract_info)
 					BOOST_THROW_EXCEPTION(ContractStorageException("contract info db data error"));
-				auto contract_info = ContractInfo::from_json(json_value);
 				auto old_contract_name(contract_info->name);
 				if(!old_contract_name.empty())
 					BOOST_THROW_EXCEPTION(ContractStorageException(std::string("contract ") + contract_id + " with name can't upgrade again"));
@@ -708,57 +1139,45 @@ namespace contract
 					contract_info->name = differ.patch(contract_info->name, upgrade_info.name_diff).as_string();
 				if(upgrade_info.description_diff)
 					contract_info->description = differ.patch(contract_info->description, upgrade_info.description_diff).as_string();
-				const auto& new_contract_info_value = jsondiff::json_dumps(contract_info->to_json());
-				auto write_status = _db->Put(write_options, contract_info_key, new_contract_info_value);
-				if (!write_status.ok())
-					BOOST_THROW_EXCEPTION(ContractStorageException("contract info write to db error"));
-				changed_leveldb_keys.push_back(contract_info_key);
+				put_value(contract_info_key, encode_contract_info_record(*contract_info));
 
 				if (!old_contract_name.empty()) {
-					const auto& contract_name_id_mapping_key = make_contract_name_id_mapping_key(old_contract_name);
-					auto delete_status = _db->Delete(write_options, contract_name_id_mapping_key);
-					if (!delete_status.ok() && !delete_status.IsNotFound())
-						BOOST_THROW_EXCEPTION(ContractStorageException("contract info write to db error"));
-					changed_leveldb_keys.push_back(contract_name_id_mapping_key);
+					delete_value(make_contract_name_id_mapping_key(old_contract_name));
 				}
 				if (!contract_info->name.empty()) {
-					const auto& contract_name_id_mapping_key = make_contract_name_id_mapping_key(contract_info->name);
-					if (!_db->Put(write_options, contract_name_id_mapping_key, contract_info->id).ok())
-						BOOST_THROW_EXCEPTION(ContractStorageException("contract info write to db error"));
-					changed_leveldb_keys.push_back(contract_name_id_mapping_key);
+					put_value(make_contract_name_id_mapping_key(contract_info->name), contract_info->id);
 				}
 			}
 
 			// save commit info
 			const auto& diff_json = changes->to_json();
 			const auto& diff_str = jsondiff::json_dumps(diff_json);
+			put_value(root_state_hash_key, root_state_hash);
+			put_value(top_root_state_hash_key, root_state_hash);
 			add_commit_info(commitId, CONTRACT_STORAGE_CHANGE_TYPE, diff_str, "");
-			if (!_db->Put(write_options, root_state_hash_key, root_state_hash).ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("update root state hash error"));
-			changed_leveldb_keys.push_back(root_state_hash_key);
-			if (!_db->Put(write_options, top_root_state_hash_key, root_state_hash).ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("update top root state hash error"));
-			changed_leveldb_keys.push_back(top_root_state_hash_key);
-			success = true;
+			write_commit(commitId);
 			return commitId;
 		}
 
+		ContractCommitInfoP ContractStorageService::last_commit_info() const
+		{
+			check_db();
+			if (!_sql_db)
+				return nullptr;
+			auto commit_infos = query_commit_infos(prepare_sql("select " COMMIT_INFO_COLUMNS " from commit_info order by id desc limit 1"));
+			if (commit_infos.empty())
+				return nullptr;
+			return std::make_shared<ContractCommitInfo>(commit_infos[0]);
+		}
+
 		ContractCommitId ContractStorageService::top_commit_id() const
 		{
 			check_db();
-			char *errMsg;
-			jsondiff::JsonArray records;
-			auto query_sql = "select id, commit_id, change_type, contract_id from commit_info order by id desc limit 1";
-			auto status = sqlite3_exec(_sql_db, query_sql,
-				&query_records_sql_callback, &records, &errMsg);
-			if (status != SQLITE_OK)
-			{
-				std::string err_msg_str(errMsg);
-				sqlite3_free(errMsg);
-				BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
-			}
-			if (records.size() > 0)
-				return records[0]["commit_id"].as_string();
+			if (_block_writes && !_block_writes->commit_infos.empty())
+				return _block_writes->commit_infos.back().commit_id;
+			auto commit_info = last_commit_info();
+			if (commit_info)
+				return commit_info->commit_id;
 			return EMPTY_COMMIT_ID;
 		}
 
@@ -773,47 +1192,25 @@ namespace contract
 			auto commit_info = get_commit_info(dest_commit_id);
 			if (!commit_info && dest_commit_id != EMPTY_COMMIT_ID)
 				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("Can't find commit ") + dest_commit_id));
+			if (_snapshot)
+				BOOST_THROW_EXCEPTION(ContractStorageException("contract storage snapshot is read-only"));
 			leveldb::WriteOptions write_options;
 			if (!_db->Put(write_options, root_state_hash_key, dest_commit_id).ok())
 				BOOST_THROW_EXCEPTION(ContractStorageException("update root state hash error"));
 		}
 
-		void ContractStorageService::rollback_to_root_state_hash_without_transactional(const ContractCommitId& dest_commit_id, std::vector<std::string>& changed_leveldb_keys)
+		void ContractStorageService::stage_rollback_to_root_state_hash(const ContractCommitId& dest_commit_id)
 		{
 			check_db();
-			leveldb::WriteOptions write_options;
-			leveldb::ReadOptions read_options;
 			// find all commits after this commit
 			auto commit_info = get_commit_info(dest_commit_id);
 			if (!commit_info && dest_commit_id != EMPTY_COMMIT_ID)
 				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("Can't find commit ") + dest_commit_id));
-			char *errMsg;
-			jsondiff::JsonArray records;
-			std::string query_sql;
-			if (dest_commit_id == EMPTY_COMMIT_ID)
-				query_sql = "select id, commit_id, change_type, contract_id from commit_info order by id desc";
-			else
-				query_sql = std::string("select id, commit_id, change_type, contract_id from commit_info where id>") + std::to_string(commit_info->id) + " order by id desc";
-
-			auto status = sqlite3_exec(_sql_db, query_sql.c_str(),
-				&query_records_sql_callback, &records, &errMsg);
-			if (status != SQLITE_OK)
-			{
-				std::string err_msg_str(errMsg);
-				sqlite3_free(errMsg);
-				BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
-			}
-			std::vector<ContractCommitInfo> newerCommitInfos;
-			for (const auto &item_json : records)
-			{
-				jsondiff::JsonObject found_record = item_json.as<jsondiff::JsonObject>();
-				ContractCommitInfo commit_info;
-				commit_info.id = found_record["id"].as_uint64();
-				commit_info.commit_id = found_record["commit_id"].as_string();
-				commit_info.change_type = found_record["change_type"].as_string();
-				commit_info.contract_id = found_record["contract_id"].as_string();
-				newerCommitInfos.push_back(commit_info);
-			}
+			if (dest_commit_id == EMPTY_COMMIT_ID && pruned_root_state_hash() != EMPTY_COMMIT_ID)
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("contract state before commit ") + pruned_root_state_hash() + " is pruned"));
+			auto stmt = prepare_sql("select " COMMIT_INFO_COLUMNS " from commit_info where id>? order by id desc");
+			sqlite3_bind_int64(stmt, 1, commit_info ? static_cast<sqlite3_int64>(commit_info->id) : 0);
+			const auto& newerCommitInfos = query_commit_infos(stmt);
 
 			jsondiff::JsonDiff differ;
 
@@ -831,20 +1228,12 @@ namespace contract
 					if (!rollbakced_contract_info)
 					{
 						// delete this contract in db
-						const auto& delete_key = make_contract_info_key(i->contract_id);
-						auto delete_contract_status = _db->Delete(write_options, delete_key);
-						if (!delete_contract_status.ok())
-							BOOST_THROW_EXCEPTION(ContractStorageException("delete contract info from db error"));
-						changed_leveldb_keys.push_back(delete_key);
+						delete_value(make_contract_info_key(i->contract_id));
 					}
 					else
 					{
 						// set older data
-						const auto& set_key = make_contract_info_key(i->contract_id);
-						auto update_status = _db->Put(write_options, set_key, jsondiff::json_dumps(rollbakced_contract_info->to_json()));
-						if (!update_status.ok())
-							BOOST_THROW_EXCEPTION(ContractStorageException("rollback contract info to db error"));
-						changed_leveldb_keys.push_back(set_key);
+						put_value(make_contract_info_key(i->contract_id), encode_contract_info_record(*rollbakced_contract_info));
 					}
 					if (contract_info && contract_info->name.size() > 0)
 					{
@@ -852,10 +1241,7 @@ namespace contract
 						if (!rollbakced_contract_info || rollbakced_contract_info->name.empty())
 						{
 							// when not have name before, delete name => id mapping
-							const auto& contract_name_id_mapping_key = make_contract_name_id_mapping_key(contract_info->name);
-							if (!_db->Delete(write_options, contract_name_id_mapping_key).ok())
-								BOOST_THROW_EXCEPTION(ContractStorageException("rollback contract info(delete contract name=>id mapping) to db error"));
-							changed_leveldb_keys.push_back(contract_name_id_mapping_key);
+							delete_value(make_contract_name_id_mapping_key(contract_info->name));
 						}
 					}
 				}
@@ -871,14 +1257,12 @@ namespace contract
 							continue;
 						std::string value;
 						auto contract_info_key = make_contract_info_key(balance_change.address);
-						auto status = _db->Get(read_options, contract_info_key, &value);
-						if (!status.ok()) {
+						if (!get_value(contract_info_key, &value)) {
 							BOOST_THROW_EXCEPTION(ContractStorageException("contract info not found to transfer balance"));
 						}
-						auto json_value = jsondiff::json_loads(value);
-						if (!json_value.is_object())
+						auto contract_info = decode_contract_info_record(value);
+						if (!contract_info)
 							BOOST_THROW_EXCEPTION(ContractStorageException("contract info db data error"));
-						auto contract_info = ContractInfo::from_json(json_value);
 						auto balances = contract_info->balances;
 						auto found_balance = false;
 						for (auto &balance : balances)
@@ -898,11 +1282,7 @@ namespace contract
 							balances.push_back(balance);
 						}
 						contract_info->balances = balances;
-						auto new_contract_info_value = jsondiff::json_dumps(contract_info->to_json());
-						auto write_status = _db->Put(write_options, contract_info_key, new_contract_info_value);
-						if (!write_status.ok())
-							BOOST_THROW_EXCEPTION(ContractStorageException("contract info write to db error"));
-						changed_leveldb_keys.push_back(contract_info_key);
+						put_value(contract_info_key, encode_contract_info_record(*contract_info));
 					}
 					for (const auto &storage_change : changes.storage_changes)
 					{
@@ -912,11 +1292,7 @@ namespace contract
 						{
 							auto storage_new_value = get_contract_storage(contract_id, storage_change_item.name);
 							auto storage_value = differ.rollback(storage_new_value, storage_change_item.diff);
-							auto key = make_contract_storage_key(contract_id, storage_change_item.name);
-							auto status = _db->Put(write_options, key, jsondiff::json_dumps(storage_value));
-							if (!status.ok())
-								BOOST_THROW_EXCEPTION(ContractStorageException("contract storage write to db error"));
-							changed_leveldb_keys.push_back(key);
+							put_value(make_contract_storage_key(contract_id, storage_change_item.name), encode_storage_value_record(storage_value));
 						}
 					}
 					for (const auto& upgrade_info : changes.upgrade_infos)
@@ -924,14 +1300,12 @@ namespace contract
 						const auto& contract_id = upgrade_info.contract_id;
 						std::string value;
 						auto contract_info_key = make_contract_info_key(contract_id);
-						auto status = _db->Get(read_options, contract_info_key, &value);
-						if (!status.ok()) {
+						if (!get_value(contract_info_key, &value)) {
 							BOOST_THROW_EXCEPTION(ContractStorageException("contract info not found to rollback upgrade"));
 						}
-						auto json_value = jsondiff::json_loads(value);
-						if (!json_value.is_object())
+						auto contract_info = decode_contract_info_record(value);
+						if (!contract_info)
 							BOOST_THROW_EXCEPTION(ContractStorageException("contract info db data error"));
-						auto contract_info = ContractInfo::from_json(json_value);
 						auto now_contract_name(contract_info->name);
 						jsondiff::JsonValue old_contract_name;
 						if (upgrade_info.name_diff)
@@ -945,23 +1319,13 @@ namespace contract
 						else
 							old_contract_desc = contract_info->description;
 						contract_info->description = old_contract_desc.is_string() ? old_contract_desc.as_string() : "";
-						status = _db->Put(write_options, contract_info_key, jsondiff::json_dumps(contract_info->to_json()));
-						if (!status.ok())
-							BOOST_THROW_EXCEPTION(ContractStorageException("contract upgrade info rollback failed"));
-						changed_leveldb_keys.push_back(contract_info_key);
+						put_value(contract_info_key, encode_contract_info_record(*contract_info));
 						// mapping name=>id
 						if (!now_contract_name.empty()) {
-							const auto& contract_name_id_mapping_key = make_contract_name_id_mapping_key(now_contract_name);
-							auto delete_status = _db->Delete(write_options, contract_name_id_mapping_key);
-							if (!delete_status.ok() && !delete_status.IsNotFound())
-								BOOST_THROW_EXCEPTION(ContractStorageException("contract upgrade info rollback failed"));
-							changed_leveldb_keys.push_back(contract_name_id_mapping_key);
+							delete_value(make_contract_name_id_mapping_key(now_contract_name));
 						}
 						if (!contract_info->name.empty()) {
-							const auto& contract_name_id_mapping_key = make_contract_name_id_mapping_key(contract_info->name);
-							if (!_db->Put(write_options, contract_name_id_mapping_key, contract_info->id).ok())
-								BOOST_THROW_EXCEPTION(ContractStorageException("contract upgrade info rollback failed"));
-							changed_leveldb_keys.push_back(contract_name_id_mapping_key);
+							put_value(make_contract_name_id_mapping_key(contract_info->name), contract_info->id);
 						}
 					}
 					std::set<std::string> transaction_ids;
@@ -970,86 +1334,309 @@ namespace contract
 							transaction_ids.insert(event_info.transaction_id);
 						}
 					}
-					{
-						// transactionId=>events delete
-						for (const auto& txid : transaction_ids) {
-							const auto& tx_events_key = make_transaction_events_key(txid);
-							auto status = _db->Delete(write_options, tx_events_key);
-							if (!status.ok() && !status.IsNotFound()) {
-								BOOST_THROW_EXCEPTION(ContractStorageException("rollback commit events failed"));
-							}
-							if (status.ok())
-								changed_leveldb_keys.push_back(tx_events_key);
-						}
-					}
-					{
-						// events key delete
-						const auto& commit_events_key = make_commit_events_key(i->commit_id);
-						auto delete_commit_events_key_status = _db->Delete(write_options, commit_events_key);
-						if (!delete_commit_events_key_status.ok() && !delete_commit_events_key_status.IsNotFound()) {
-							BOOST_THROW_EXCEPTION(ContractStorageException("rollback commit events failed"));
-						}
-						if (delete_commit_events_key_status.ok())
-							changed_leveldb_keys.push_back(commit_events_key);
+					// transactionId=>events delete
+					for (const auto& txid : transaction_ids) {
+						delete_value(make_transaction_events_key(txid));
 					}
+					// events key delete
+					delete_value(make_commit_events_key(i->commit_id));
 				}
 				else
 				{
 					BOOST_THROW_EXCEPTION(ContractStorageException(std::string("not supported change type ") + i->change_type));
 				}
 
-				// delete the rollbacked commit_info
-				char *delete_commit_info_err_msg;
-				std::string delete_commit_info_sql = std::string("delete from commit_info where commit_id='") + i->commit_id + "'";
-				auto delete_commit_info_status = sqlite3_exec(_sql_db, delete_commit_info_sql.c_str(), &empty_sql_callback, nullptr, &delete_commit_info_err_msg);
-				if (delete_commit_info_status != SQLITE_OK)
-				{
-					std::string err_msg_str(delete_commit_info_err_msg);
-					sqlite3_free(delete_commit_info_err_msg);
-					BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
-				}
-
-				// delete the rollbackedCommitId => value in db
-				auto deleteCommitIdValueStatus = _db->Delete(write_options, i->commit_id);
-				if (!deleteCommitIdValueStatus.ok())
-					BOOST_THROW_EXCEPTION(ContractStorageException(std::string("delete commit ") + i->commit_id + " error"));
+				// delete the rollbackedCommitId => value in db, the commit_info row is deleted after the batch is written
+				delete_value(i->commit_id);
 			}
 
 			const auto& root_state_hash = dest_commit_id;
-			if (!_db->Put(write_options, root_state_hash_key, root_state_hash).ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("update root state hash error"));
-			changed_leveldb_keys.push_back(root_state_hash_key);
-			if (!_db->Put(write_options, top_root_state_hash_key, root_state_hash).ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("update top root state hash error"));
-			changed_leveldb_keys.push_back(top_root_state_hash_key);
+			put_value(root_state_hash_key, root_state_hash);
+			put_value(top_root_state_hash_key, root_state_hash);
+		}
+
+		// leveldb batch of the rollback is written first, then the rolled back commit_info rows are deleted
+		void ContractStorageService::rollback_to_root_state_hash(const ContractCommitId& dest_commit_id)
+		{
+			// staged commits of a block can only be dropped as a whole
+			if (_block_writes && !_block_writes->commit_infos.empty())
+				BOOST_THROW_EXCEPTION(ContractStorageException("can't rollback contract state with block writes pending"));
+			std::unique_ptr<PendingWrites> block_writes(std::move(_block_writes));
+			BOOST_SCOPE_EXIT_ALL(&) {
+				_block_writes = std::move(block_writes);
+			};
+			begin_pending_writes();
+			BOOST_SCOPE_EXIT_ALL(&) {
+				drop_pending_writes();
+			};
+			stage_rollback_to_root_state_hash(dest_commit_id);
+			write_pending_writes();
+			delete_commit_infos_after(dest_commit_id);
 		}
 
 		void ContractStorageService::rollback_contract_state(const ContractCommitId& dest_commit_id)
 		{
 			check_db();
-			
-			bool success = false;
-			leveldb::WriteOptions write_options;
-			leveldb::ReadOptions read_options;
-			auto snapshot = _db->GetSnapshot();
-			std::vector<std::string> changed_leveldb_keys;
-			begin_sql_transaction();
-			BOOST_SCOPE_EXIT_ALL(&) {
-				if (success)
+			auto commit_info = get_commit_info(dest_commit_id);
+			if (!commit_info && dest_commit_id != EMPTY_COMMIT_ID)
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("Can't find commit ") + dest_commit_id));
+			rollback_to_root_state_hash(dest_commit_id);
+		}
+
+		void ContractStorageService::rollback_to_block_height(uint32_t block_height)
+		{
+			check_db();
+			// the commits after block_height are the newest ones, so both lookups only touch a few index entries
+			auto stmt = prepare_sql("select " COMMIT_INFO_COLUMNS " from commit_info where block_height>? order by block_height, id limit 1");
+			sqlite3_bind_int64(stmt, 1, block_height);
+			const auto& first_commit_infos = query_commit_infos(stmt);
+			if (first_commit_infos.empty())
+				return;
+			stmt = prepare_sql("select " COMMIT_INFO_COLUMNS " from commit_info where id<? order by id desc limit 1");
+			sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(first_commit_infos[0].id));
+			const auto& dest_commit_infos = query_commit_infos(stmt);
+			rollback_to_root_state_hash(dest_commit_infos.empty() ? EMPTY_COMMIT_ID : dest_commit_infos[0].commit_id);
+		}
+
+		// the checkpoint is written before anything is deleted, so an interrupted prune only leaves rows
+		// that the next prune deletes. the state itself is always complete in leveldb, only the diffs
+		// to roll it back further than the checkpoint are dropped
+		size_t ContractStorageService::prune_commits_before(const ContractCommitId& commit_id, uint32_t block_height, size_t max_count)
+		{
+			check_db();
+			if (_snapshot)
+				BOOST_THROW_EXCEPTION(ContractStorageException("contract storage snapshot is read-only"));
+			if (_pending_writes || _block_writes)
+				BOOST_THROW_EXCEPTION(ContractStorageException("can't prune contract commits with writes pending"));
+			auto commit_info = get_commit_info(commit_id);
+			if (!commit_info)
+				return 0;
+			if (pruned_root_state_hash() != commit_id)
+			{
+				PendingWrites checkpoint;
+				checkpoint.values[pruned_root_state_hash_key] = std::make_pair(false, commit_id);
+				checkpoint.values[pruned_block_height_key] = std::make_pair(false, std::to_string(block_height));
+				write_to_db(checkpoint);
+			}
+
+			auto stmt = prepare_sql("select " COMMIT_INFO_COLUMNS " from commit_info where id<? order by id limit ?");
+			sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(commit_info->id));
+			sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(max_count));
+			const auto& commit_infos = query_commit_infos(stmt);
+			if (commit_infos.empty())
+				return 0;
+			PendingWrites diffs;
+			for (const auto& pruned_commit_info : commit_infos)
+				diffs.values[pruned_commit_info.commit_id] = std::make_pair(true, std::string());
+			write_to_db(diffs);
+			delete_commit_infos_before(commit_infos.back().id + 1);
+			return commit_infos.size();
+		}
+
+		ContractCommitId ContractStorageService::pruned_root_state_hash() const
+		{
+			check_db();
+			std::string commit_id;
+			if (!get_value(pruned_root_state_hash_key, &commit_id))
+				commit_id = EMPTY_COMMIT_ID;
+			return commit_id;
+		}
+
+		uint32_t ContractStorageService::pruned_block_height() const
+		{
+			check_db();
+			std::string block_height;
+			if (!get_value(pruned_block_height_key, &block_height))
+				return 0;
+			return static_cast<uint32_t>(std::stoul(block_height));
+		}
+
+		void ContractStorageService::export_state(const std::function<void(const std::string& key, const std::string& value)>& visitor) const
+		{
+			check_db();
+			for (const auto& prefix : state_record_key_prefixes())
+			{
+				scan_values(prefix, "", [&](const std::string& key, const std::string& value) {
+					if (is_state_merkle_leaf(key, value))
+						visitor(key, value);
+					return true;
+				});
+			}
+		}
+
+		void ContractStorageService::check_state_importable() const
+		{
+			check_db();
+			if (_snapshot)
+				BOOST_THROW_EXCEPTION(ContractStorageException("contract storage snapshot is read-only"));
+			if (_pending_writes || _block_writes)
+				BOOST_THROW_EXCEPTION(ContractStorageException("can't import contract state with writes pending"));
+			if (last_commit_info() || current_root_state_hash() != EMPTY_COMMIT_ID)
+				BOOST_THROW_EXCEPTION(ContractStorageException("can't import contract state over existing commits"));
+		}
+
+		// a state without commits can only hold records of an interrupted import
+		void ContractStorageService::begin_state_import()
+		{
+			check_state_importable();
+			for (const auto& prefix : state_record_key_prefixes())
+			{
+				while (true)
 				{
-					commit_sql_transaction();
+					PendingWrites leftovers;
+					scan_values(prefix, "", [&](const std::string& key, const std::string& value) {
+						leftovers.values[key] = std::make_pair(true, std::string());
+						return leftovers.values.size() < MIGRATION_BATCH_SIZE;
+					});
+					if (leftovers.values.empty())
+						break;
+					write_to_db(leftovers);
 				}
-				else
+			}
+		}
+
+		void ContractStorageService::import_state_records(const std::vector<std::pair<std::string, std::string>>& records)
+		{
+			check_state_importable();
+			PendingWrites writes;
+			for (const auto& p : records)
+			{
+				if (!is_state_record_key(p.first))
+					BOOST_THROW_EXCEPTION(ContractStorageException(std::string("not a contract state record ") + p.first));
+				writes.values[p.first] = std::make_pair(false, p.second);
+			}
+			write_to_db(writes);
+		}
+
+		// same ordering as a commit: the commit info is inserted before the root state hash is written
+		void ContractStorageService::finish_state_import(const ContractCommitId& root_state_hash, uint32_t block_height, const std::string& block_hash)
+		{
+			check_state_importable();
+			if (root_state_hash == EMPTY_COMMIT_ID)
+				BOOST_THROW_EXCEPTION(ContractStorageException("can't import contract state without root state hash"));
+			ContractCommitInfo commit_info;
+			commit_info.commit_id = root_state_hash;
+			commit_info.change_type = "snapshot";
+			commit_info.block_height = block_height;
+			auto stmt = prepare_sql("insert into commit_info (" COMMIT_INFO_COLUMNS ") values (?, ?, ?, ?, ?)");
+			bind_commit_info(stmt, commit_info, false);
+			exec_sql(stmt);
+
+			PendingWrites state;
+			state.values[root_state_hash_key] = std::make_pair(false, root_state_hash);
+			state.values[top_root_state_hash_key] = std::make_pair(false, root_state_hash);
+			state.values[pruned_root_state_hash_key] = std::make_pair(false, root_state_hash);
+			state.values[pruned_block_height_key] = std::make_pair(false, std::to_string(block_height));
+			state.values[snapshot_block_height_key] = std::make_pair(false, std::to_string(block_height));
+			state.values[snapshot_block_hash_key] = std::make_pair(false, block_hash);
+			write_to_db(state);
+		}
+
+		uint32_t ContractStorageService::snapshot_block_height() const
+		{
+			check_db();
+			std::string block_height;
+			if (!get_value(snapshot_block_height_key, &block_height))
+				return 0;
+			return static_cast<uint32_t>(std::stoul(block_height));
+		}
+
+		std::string ContractStorageService::snapshot_block_hash() const
+		{
+			check_db();
+			std::string block_hash;
+			if (!get_value(snapshot_block_hash_key, &block_hash))
+				return std::string();
+			return block_hash;
+		}
+
+		void ContractStorageService::clear_snapshot_block()
+		{
+			check_db();
+			if (_snapshot)
+				BOOST_THROW_EXCEPTION(ContractStorageException("contract storage snapshot is read-only"));
+			PendingWrites writes;
+			writes.values[snapshot_block_height_key] = std::make_pair(true, std::string());
+			writes.values[snapshot_block_hash_key] = std::make_pair(true, std::string());
+			write_to_db(writes);
+		}
+
+		void ContractStorageService::begin_block_writes()
+		{
+			check_db();
+			if (_block_writes || _pending_writes)
+				BOOST_THROW_EXCEPTION(ContractStorageException("contract storage writes already pending"));
+			auto commit_info = last_commit_info();
+			clear_storage_read_cache();
+			_block_writes.reset(new PendingWrites());
+			_block_writes->last_commit_info_id = commit_info ? commit_info->id : 0;
+		}
+
+		// same ordering as a single commit: commit infos are inserted in one sql transaction, then the leveldb batch is written
+		void ContractStorageService::flush_block_writes()
+		{
+			check_db();
+			if (!_block_writes)
+				BOOST_THROW_EXCEPTION(ContractStorageException("no block writes pending"));
+			std::unique_ptr<PendingWrites> block_writes(std::move(_block_writes));
+			clear_storage_read_cache();
+			if (block_writes->commit_infos.empty())
+				return;
+			begin_sql_transaction();
+			try
+			{
+				auto stmt = prepare_sql("insert into commit_info (" COMMIT_INFO_COLUMNS ") values (?, ?, ?, ?, ?)");
+				for (const auto& commit_info : block_writes->commit_infos)
 				{
-					rollback_sql_transaction();
-					rollback_leveldb_transaction(snapshot, changed_leveldb_keys);
+					bind_commit_info(stmt, commit_info, true);
+					try
+					{
+						exec_sql(stmt);
+					}
+					catch (const ContractStorageException&)
+					{
+						BOOST_THROW_EXCEPTION(ContractStorageException("insert contract change commit to db error"));
+					}
 				}
-			};
-			auto commit_info = get_commit_info(dest_commit_id);
-			if (!commit_info && dest_commit_id != EMPTY_COMMIT_ID)
-				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("Can't find commit ") + dest_commit_id));
-			rollback_to_root_state_hash_without_transactional(dest_commit_id, changed_leveldb_keys);
-			success = true;
+				commit_sql_transaction();
+			}
+			catch (...)
+			{
+				rollback_sql_transaction();
+				throw;
+			}
+			try
+			{
+				write_to_db(*block_writes);
+			}
+			catch (...)
+			{
+				delete_commit_infos_after(block_writes->last_commit_info_id);
+				throw;
+			}
+		}
+
+		void ContractStorageService::drop_block_writes()
+		{
+			clear_storage_read_cache();
+			_block_writes.reset();
+		}
+
+		std::shared_ptr<ContractStorageService> ContractStorageService::create_snapshot() const
+		{
+			check_db();
+			if (_pending_writes || _block_writes)
+				BOOST_THROW_EXCEPTION(ContractStorageException("can't snapshot contract storage with writes pending"));
+			auto snapshot_service = std::make_shared<ContractStorageService>(_magic_number, _storage_db_path, _storage_sql_db_path, false);
+			auto db = _db;
+			snapshot_service->_db = db;
+			snapshot_service->_snapshot.reset(db->GetSnapshot(), [db](const leveldb::Snapshot* snapshot) {
+				db->ReleaseSnapshot(snapshot);
+			});
+			snapshot_service->_current_block_height = _current_block_height;
+			// commits to the snapshot only go to this overlay
+			snapshot_service->_block_writes.reset(new PendingWrites());
+			return snapshot_service;
 		}
 
 	}
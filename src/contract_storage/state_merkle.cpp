@@ -0,0 +1,239 @@
+#include <contract_storage/state_merkle.hpp>
+#include <contract_storage/exceptions.hpp>
+#include <fcrypto/sha256.hpp>
+#include <boost/throw_exception.hpp>
+
+namespace contract
+{
+	namespace storage
+	{
+		static const char NODE_EMPTY = 0;
+		static const char NODE_LEAF = 'L';
+		static const char NODE_INNER = 'I';
+		static const size_t HASH_SIZE = 32;
+
+		const std::string StateMerkleTree::node_key_prefix = "STATE_MERKLE_NODE_";
+		const std::string StateMerkleTree::empty_hash(HASH_SIZE, '\0');
+
+		static std::string sha256_bytes(const std::string& data)
+		{
+			auto digest = fcrypto::sha256::hash(data.data(), static_cast<uint32_t>(data.size()));
+			return std::string(digest.data(), digest.data_size());
+		}
+
+		static std::string hash_leaf(const std::string& key_hash, const std::string& value_hash)
+		{
+			return sha256_bytes(std::string(1, '\0') + key_hash + value_hash);
+		}
+
+		static std::string hash_inner(const std::string& left, const std::string& right)
+		{
+			return sha256_bytes(std::string(1, '\1') + left + right);
+		}
+
+		static bool path_bit(const std::string& key_hash, size_t depth)
+		{
+			return ((static_cast<uint8_t>(key_hash[depth / 8]) >> (7 - depth % 8)) & 1) != 0;
+		}
+
+		// the first depth bits of the key hash, with the depth to tell apart paths ending in zero bits
+		static std::string make_node_key(const std::string& key_hash, size_t depth)
+		{
+			std::string path = key_hash.substr(0, (depth + 7) / 8);
+			if (depth % 8)
+				path.back() = static_cast<char>(static_cast<uint8_t>(path.back()) & (0xff << (8 - depth % 8)));
+			return StateMerkleTree::node_key_prefix + static_cast<char>(depth) + path;
+		}
+
+		static std::string flip_path_bit(std::string key_hash, size_t depth)
+		{
+			key_hash[depth / 8] = static_cast<char>(static_cast<uint8_t>(key_hash[depth / 8]) ^ (0x80 >> (depth % 8)));
+			return key_hash;
+		}
+
+		StateMerkleTree::StateMerkleTree(NodeReader reader)
+			: _reader(std::move(reader))
+		{
+		}
+
+		StateMerkleTree::Node StateMerkleTree::read_node(const std::string& node_key) const
+		{
+			std::string value;
+			auto it = _changed_nodes.find(node_key);
+			if (it != _changed_nodes.end())
+				value = it->second;
+			else if (!_reader(node_key, &value))
+				value.clear();
+			Node node;
+			if (value.empty())
+				return node;
+			if (value.size() != 1 + 2 * HASH_SIZE || (value[0] != NODE_LEAF && value[0] != NODE_INNER))
+				BOOST_THROW_EXCEPTION(ContractStorageException("state merkle node db data error"));
+			node.type = value[0];
+			node.first = value.substr(1, HASH_SIZE);
+			node.second = value.substr(1 + HASH_SIZE, HASH_SIZE);
+			return node;
+		}
+
+		void StateMerkleTree::write_node(const std::string& node_key, const Node& node)
+		{
+			if (node.type == NODE_EMPTY)
+				_changed_nodes[node_key].clear();
+			else
+				_changed_nodes[node_key] = std::string(1, node.type) + node.first + node.second;
+		}
+
+		static std::string hash_node(char type, const std::string& first, const std::string& second)
+		{
+			if (type == NODE_LEAF)
+				return hash_leaf(first, second);
+			if (type == NODE_INNER)
+				return hash_inner(first, second);
+			return StateMerkleTree::empty_hash;
+		}
+
+		std::string StateMerkleTree::insert(const std::string& key_hash, const std::string& value_hash, size_t depth)
+		{
+			if (depth >= 8 * HASH_SIZE)
+				BOOST_THROW_EXCEPTION(ContractStorageException("state merkle key hash collision"));
+			const auto& node_key = make_node_key(key_hash, depth);
+			auto node = read_node(node_key);
+			if (node.type == NODE_EMPTY || (node.type == NODE_LEAF && node.first == key_hash))
+			{
+				node.type = NODE_LEAF;
+				node.first = key_hash;
+				node.second = value_hash;
+				write_node(node_key, node);
+				return hash_leaf(key_hash, value_hash);
+			}
+			if (node.type == NODE_LEAF)
+			{
+				// another leaf was alone in this subtree, move it one level down
+				write_node(make_node_key(node.first, depth + 1), node);
+				const auto& leaf_hash = hash_leaf(node.first, node.second);
+				bool right = path_bit(node.first, depth);
+				node.type = NODE_INNER;
+				node.first = right ? empty_hash : leaf_hash;
+				node.second = right ? leaf_hash : empty_hash;
+			}
+			const auto& child_hash = insert(key_hash, value_hash, depth + 1);
+			if (path_bit(key_hash, depth))
+				node.second = child_hash;
+			else
+				node.first = child_hash;
+			write_node(node_key, node);
+			return hash_inner(node.first, node.second);
+		}
+
+		// returns the node replacing the one at this depth, leaves left alone in a subtree move up
+		StateMerkleTree::Node StateMerkleTree::erase(const std::string& key_hash, size_t depth)
+		{
+			const auto& node_key = make_node_key(key_hash, depth);
+			auto node = read_node(node_key);
+			if (node.type == NODE_EMPTY || (node.type == NODE_LEAF && node.first != key_hash))
+				return node;
+			if (node.type == NODE_LEAF)
+			{
+				write_node(node_key, Node());
+				return Node();
+			}
+			bool right = path_bit(key_hash, depth);
+			const auto& child = erase(key_hash, depth + 1);
+			const auto& child_hash = hash_node(child.type, child.first, child.second);
+			const auto& other_hash = right ? node.first : node.second;
+			if (other_hash == empty_hash && child.type != NODE_INNER)
+			{
+				if (child.type == NODE_LEAF)
+					write_node(make_node_key(key_hash, depth + 1), Node());
+				write_node(node_key, child);
+				return child;
+			}
+			if (child_hash == empty_hash)
+			{
+				const auto& other_key = make_node_key(flip_path_bit(key_hash, depth), depth + 1);
+				const auto& other = read_node(other_key);
+				if (other.type == NODE_LEAF)
+				{
+					write_node(other_key, Node());
+					write_node(node_key, other);
+					return other;
+				}
+			}
+			if (right)
+				node.second = child_hash;
+			else
+				node.first = child_hash;
+			write_node(node_key, node);
+			return node;
+		}
+
+		void StateMerkleTree::put(const std::string& key, const std::string& value)
+		{
+			insert(sha256_bytes(key), sha256_bytes(value), 0);
+		}
+
+		void StateMerkleTree::remove(const std::string& key)
+		{
+			erase(sha256_bytes(key), 0);
+		}
+
+		std::string StateMerkleTree::root() const
+		{
+			const auto& node = read_node(make_node_key(empty_hash, 0));
+			return hash_node(node.type, node.first, node.second);
+		}
+
+		StateMerkleProof StateMerkleTree::prove(const std::string& key) const
+		{
+			const auto& key_hash = sha256_bytes(key);
+			StateMerkleProof proof;
+			for (size_t depth = 0; depth < 8 * HASH_SIZE; depth++)
+			{
+				const auto& node = read_node(make_node_key(key_hash, depth));
+				if (node.type == NODE_LEAF)
+				{
+					proof.leaf_key_hash = node.first;
+					proof.leaf_value_hash = node.second;
+				}
+				if (node.type != NODE_INNER)
+					break;
+				proof.siblings.push_back(path_bit(key_hash, depth) ? node.first : node.second);
+			}
+			return proof;
+		}
+
+		bool StateMerkleTree::verify(const std::string& root, const std::string& key, const std::string* value, const StateMerkleProof& proof)
+		{
+			const auto& key_hash = sha256_bytes(key);
+			const auto depth = proof.siblings.size();
+			if (depth >= 8 * HASH_SIZE)
+				return false;
+			std::string hash;
+			if (proof.leaf_key_hash.empty())
+			{
+				if (value || !proof.leaf_value_hash.empty())
+					return false;
+				hash = empty_hash;
+			}
+			else
+			{
+				if (proof.leaf_key_hash.size() != HASH_SIZE || proof.leaf_value_hash.size() != HASH_SIZE)
+					return false;
+				// the leaf must sit on the key's path
+				if (make_node_key(proof.leaf_key_hash, depth) != make_node_key(key_hash, depth))
+					return false;
+				if (value ? (proof.leaf_key_hash != key_hash || proof.leaf_value_hash != sha256_bytes(*value)) : proof.leaf_key_hash == key_hash)
+					return false;
+				hash = hash_leaf(proof.leaf_key_hash, proof.leaf_value_hash);
+			}
+			for (size_t i = depth; i > 0; i--)
+			{
+				const auto& sibling = proof.siblings[i - 1];
+				if (sibling.size() != HASH_SIZE)
+					return false;
+				hash = path_bit(key_hash, i - 1) ? hash_inner(sibling, hash) : hash_inner(hash, sibling);
+			}
+			return hash == root;
+		}
+	}
+}
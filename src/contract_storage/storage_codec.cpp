@@ -0,0 +1,231 @@
+#include <contract_storage/storage_codec.hpp>
+#include <contract_storage/exceptions.hpp>
+#include <clientversion.h>
+#include <streams.h>
+
+namespace contract
+{
+	namespace storage
+	{
+		using namespace jsondiff;
+
+		// json value tags of the binary storage value format
+		enum JsonValueTag : uint8_t
+		{
+			JSON_TAG_NULL = 0,
+			JSON_TAG_INT64 = 1,
+			JSON_TAG_UINT64 = 2,
+			JSON_TAG_DOUBLE = 3, // kept as json text, legacy json parser decides the result
+			JSON_TAG_BOOL = 4,
+			JSON_TAG_STRING = 5,
+			JSON_TAG_ARRAY = 6,
+			JSON_TAG_OBJECT = 7
+		};
+
+		bool is_binary_record(const std::string& value)
+		{
+			return !value.empty() && value[0] == BINARY_RECORD_TAG;
+		}
+
+		static CDataStream begin_record(ContractStorageRecordType type)
+		{
+			CDataStream ss(SER_DISK, CLIENT_VERSION);
+			ss << (uint8_t) BINARY_RECORD_TAG << (uint8_t) type << CONTRACT_STORAGE_RECORD_VERSION;
+			return ss;
+		}
+
+		static CDataStream open_record(const std::string& value, ContractStorageRecordType type)
+		{
+			CDataStream ss(value.data(), value.data() + value.size(), SER_DISK, CLIENT_VERSION);
+			uint8_t tag, record_type, record_version;
+			ss >> tag >> record_type >> record_version;
+			if (tag != (uint8_t) BINARY_RECORD_TAG || record_type != type)
+				throw ContractStorageException("contract storage record type error");
+			if (record_version > CONTRACT_STORAGE_RECORD_VERSION)
+				throw ContractStorageException(std::string("unsupported contract storage record version ") + std::to_string(record_version));
+			return ss;
+		}
+
+		// numbers and blobs are written with the type the legacy json round trip would have produced,
+		// so storage values read back exactly as they did when stored as json text
+		static void write_json_value(CDataStream& ss, const JsonValue& value)
+		{
+			switch (value.get_type())
+			{
+			case fjson::variant::null_type:
+				ss << (uint8_t) JSON_TAG_NULL;
+				break;
+			case fjson::variant::int64_type:
+			{
+				auto n = value.as_int64();
+				if (n < 0)
+					ss << (uint8_t) JSON_TAG_INT64 << n;
+				else
+					ss << (uint8_t) JSON_TAG_UINT64 << (uint64_t) n;
+				break;
+			}
+			case fjson::variant::uint64_type:
+				ss << (uint8_t) JSON_TAG_UINT64 << value.as_uint64();
+				break;
+			case fjson::variant::double_type:
+				ss << (uint8_t) JSON_TAG_DOUBLE << value.as_string();
+				break;
+			case fjson::variant::bool_type:
+				ss << (uint8_t) JSON_TAG_BOOL << value.as_bool();
+				break;
+			case fjson::variant::string_type:
+			case fjson::variant::blob_type:
+				ss << (uint8_t) JSON_TAG_STRING << value.as_string();
+				break;
+			case fjson::variant::array_type:
+			{
+				const auto& arr = value.get_array();
+				ss << (uint8_t) JSON_TAG_ARRAY;
+				WriteCompactSize(ss, arr.size());
+				for (const auto& item : arr)
+					write_json_value(ss, item);
+				break;
+			}
+			case fjson::variant::object_type:
+			{
+				const auto& obj = value.get_object();
+				ss << (uint8_t) JSON_TAG_OBJECT;
+				WriteCompactSize(ss, obj.size());
+				for (auto it = obj.begin(); it != obj.end(); it++)
+				{
+					ss << it->key();
+					write_json_value(ss, it->value());
+				}
+				break;
+			}
+			default:
+				throw ContractStorageException("unknown json value type in contract storage");
+			}
+		}
+
+		static JsonValue read_json_value(CDataStream& ss)
+		{
+			uint8_t tag;
+			ss >> tag;
+			switch (tag)
+			{
+			case JSON_TAG_NULL:
+				return JsonValue();
+			case JSON_TAG_INT64:
+			{
+				int64_t n;
+				ss >> n;
+				return JsonValue(n);
+			}
+			case JSON_TAG_UINT64:
+			{
+				uint64_t n;
+				ss >> n;
+				return JsonValue(n);
+			}
+			case JSON_TAG_DOUBLE:
+			{
+				std::string text;
+				ss >> text;
+				return json_loads(text);
+			}
+			case JSON_TAG_BOOL:
+			{
+				bool b;
+				ss >> b;
+				return JsonValue(b);
+			}
+			case JSON_TAG_STRING:
+			{
+				std::string str;
+				ss >> str;
+				return JsonValue(str);
+			}
+			case JSON_TAG_ARRAY:
+			{
+				auto size = ReadCompactSize(ss);
+				JsonArray arr;
+				arr.reserve(size);
+				for (uint64_t i = 0; i < size; i++)
+					arr.push_back(read_json_value(ss));
+				return arr;
+			}
+			case JSON_TAG_OBJECT:
+			{
+				auto size = ReadCompactSize(ss);
+				JsonObject obj;
+				obj.reserve(size);
+				for (uint64_t i = 0; i < size; i++)
+				{
+					std::string key;
+					ss >> key;
+					obj.set(key, read_json_value(ss));
+				}
+				return obj;
+			}
+			default:
+				throw ContractStorageException("contract storage value format error");
+			}
+		}
+
+		std::string encode_contract_info_record(const ContractInfo& contract_info)
+		{
+			auto ss = begin_record(RECORD_CONTRACT_INFO);
+			ss << contract_info;
+			return ss.str();
+		}
+
+		ContractInfoP decode_contract_info_record(const std::string& value)
+		{
+			if (!is_binary_record(value))
+			{
+				// legacy json record
+				auto json_value = json_loads(value);
+				if (!json_value.is_object())
+					return nullptr;
+				return ContractInfo::from_json(json_value);
+			}
+			auto ss = open_record(value, RECORD_CONTRACT_INFO);
+			auto contract_info = std::make_shared<ContractInfo>();
+			ss >> *contract_info;
+			return contract_info;
+		}
+
+		std::string encode_storage_value_record(const JsonValue& value)
+		{
+			auto ss = begin_record(RECORD_STORAGE_VALUE);
+			write_json_value(ss, value);
+			return ss.str();
+		}
+
+		JsonValue decode_storage_value_record(const std::string& value)
+		{
+			if (!is_binary_record(value))
+				return json_loads(value);
+			auto ss = open_record(value, RECORD_STORAGE_VALUE);
+			return read_json_value(ss);
+		}
+
+		std::string encode_events_record(const std::vector<ContractEventInfo>& events)
+		{
+			auto ss = begin_record(RECORD_EVENTS);
+			ss << events;
+			return ss.str();
+		}
+
+		std::vector<ContractEventInfo> decode_events_record(const std::string& value)
+		{
+			if (!is_binary_record(value))
+			{
+				const auto& events_json = json_loads(value);
+				if (!events_json.is_array())
+					return std::vector<ContractEventInfo>();
+				return ContractChanges::events_from_json(events_json.as<JsonArray>());
+			}
+			auto ss = open_record(value, RECORD_EVENTS);
+			std::vector<ContractEventInfo> events;
+			ss >> events;
+			return events;
+		}
+	}
+}
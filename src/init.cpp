@@ -43,6 +43,7 @@
 #include <util.h>
 #include <utilmoneystr.h>
 #include <validationinterface.h>
+#include <uvm/uvm_lib.h>
 #ifdef ENABLE_WALLET
 #include <wallet/init.h>
 #endif
@@ -78,6 +79,7 @@ static const bool DEFAULT_STOPAFTERBLOCKIMPORT = false;
 
 std::unique_ptr<CConnman> g_connman;
 std::unique_ptr<PeerLogicValidation> peerLogic;
+static std::unique_ptr<CValidationInterface> mempoolContractRecheck;
 
 #if ENABLE_ZMQ
 static CZMQNotificationInterface* pzmqNotificationInterface = nullptr;
@@ -211,6 +213,8 @@ void Shutdown()
     if (g_connman) g_connman->Stop();
     peerLogic.reset();
     g_connman.reset();
+    if (mempoolContractRecheck) UnregisterValidationInterface(mempoolContractRecheck.get());
+    mempoolContractRecheck.reset();
 
     StopTorControl();
 
@@ -285,6 +289,11 @@ void Shutdown()
 #ifdef ENABLE_WALLET
     CloseWallets();
 #endif
+    CloseContractProfileLog();
+    {
+        LOCK(cs_main);
+        mempoolContractState.Clear();
+    }
     globalVerifyHandle.reset();
     ECC_Stop();
     LogPrintf("%s: done\n", __func__);
@@ -376,6 +385,7 @@ std::string HelpMessage(HelpMessageMode mode)
     if (showDebug)
         strUsage += HelpMessageOpt("-feefilter", strprintf("Tell other nodes to filter invs to us by our mempool min fee (default: %u)", DEFAULT_FEEFILTER));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
+    strUsage += HelpMessageOpt("-loadcontractsnapshot=<file>", _("Load a contract state snapshot written by dumpcontractstate on startup when the contract state is empty"));
     strUsage += HelpMessageOpt("-debuglogfile=<file>", strprintf(_("Specify location of debug log file: this can be an absolute path or a path relative to the data directory (default: %s)"), DEFAULT_DEBUGLOGFILE));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
     strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
@@ -385,6 +395,13 @@ std::string HelpMessage(HelpMessageMode mode)
     }
     strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
     strUsage += HelpMessageOpt("-blockreconstructionextratxn=<n>", strprintf(_("Extra transactions to keep in memory for compact block reconstructions (default: %u)"), DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN));
+    strUsage += HelpMessageOpt("-contractpar=<n>", strprintf(_("Set the number of threads executing contract transactions of a block ahead (%u to %d, 0 = auto, <0 = leave that many cores free, 1 = off, default: %d)"),
+        -GetNumCores(), MAX_CONTRACT_EXEC_THREADS, DEFAULT_CONTRACT_EXEC_THREADS));
+    strUsage += HelpMessageOpt("-contractmodulecache=<n>", strprintf(_("Keep at most <n> checked contract modules in memory (0 to disable, default: %u)"), DEFAULT_UVM_MODULE_CACHE_SIZE));
+    strUsage += HelpMessageOpt("-contractprofile=<file>", _("Append the opcode counts, function instructions and chain api, storage and JSON conversion times of each contract transaction executed in a connected block to <file>, one JSON line each"));
+    strUsage += HelpMessageOpt("-contractprune=<n>", strprintf(_("Delete contract commit history older than <n> blocks, keeping a checkpoint every %d blocks. Contract state can't be rolled back further than that (0 = keep all, >=%u, default: %d)"),
+        CONTRACT_PRUNE_CHECKPOINT_INTERVAL, MIN_BLOCKS_TO_KEEP, DEFAULT_CONTRACT_PRUNE_DEPTH));
+    strUsage += HelpMessageOpt("-contractstatepool=<n>", strprintf(_("Keep at most <n> initialized contract VM states for reuse (0 to disable, default: %u)"), DEFAULT_UVM_STATE_POOL_SIZE));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
 #ifndef WIN32
@@ -645,33 +662,51 @@ void CleanupBlockRevFiles()
     }
 }
 
-std::condition_variable cv_mempool_loaded;
-std::mutex mutex_mempool_load;
-
 /**
- * check contract txs in txmempool every period time(eg. period = 120min)
+ * prune contract commit history out of -contractprune range, checked every minute
  */
-void ReCheckMemPoolThreadWorker()
+void ContractPruneThreadWorker()
 {
-	RenameThread("bitcoin-recheck-contract-tx-mempool");
-	std::unique_lock<std::mutex> lock(mutex_mempool_load);
-	cv_mempool_loaded.wait_until(lock, std::chrono::system_clock::now() + std::chrono::seconds(3));
-	auto period = std::chrono::minutes(120);
-	auto last_time = std::chrono::system_clock::now() - 2 * period;
-    while(!fRequestShutdown) {
-		{
-			if (std::chrono::system_clock::now() - last_time >= period) {
-				last_time = std::chrono::system_clock::now();
-				auto res = ReCheckContractTxsInMempool();
-				if (res > 0) {
-					LogPrintf("removed %d contract txs from txmempool when rechecking\n", res);
-				}
-			}
+	RenameThread("bitcoin-contract-prune");
+	auto period = std::chrono::minutes(1);
+	auto last_time = std::chrono::system_clock::now();
+	while (!fRequestShutdown) {
+		if (std::chrono::system_clock::now() - last_time >= period) {
+			PruneContractCommits();
+			last_time = std::chrono::system_clock::now();
 		}
-        std::this_thread::sleep_for(std::chrono::milliseconds(200));
-    }
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	}
 }
 
+/**
+ * check the contract txs in txmempool reading the contract storage changed by a block once it's connected or
+ * disconnected, on the validation interface's background thread
+ */
+class MempoolContractRecheck final : public CValidationInterface
+{
+protected:
+    void BlockConnected(const std::shared_ptr<const CBlock> &block, const CBlockIndex *pindex, const std::vector<CTransactionRef> &txnConflicted) override
+    {
+        Recheck();
+    }
+    void BlockDisconnected(const std::shared_ptr<const CBlock> &block) override
+    {
+        Recheck();
+    }
+private:
+    void Recheck()
+    {
+        // the txs accepted during the initial download are checked at the first block after it
+        if (IsInitialBlockDownload())
+            return;
+        auto res = ReCheckContractTxsInMempool();
+        if (res > 0) {
+            LogPrintf("removed %d contract txs from txmempool when rechecking\n", res);
+        }
+    }
+};
+
 void ThreadImport(std::vector<fs::path> vImportFiles)
 {
     const CChainParams& chainparams = Params();
@@ -742,10 +777,6 @@ void ThreadImport(std::vector<fs::path> vImportFiles)
     } // End scope of CImportingNow
     if (gArgs.GetArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
         LoadMempool();
-		
-		std::unique_lock<std::mutex> lock_mempool_load(mutex_mempool_load);
-		cv_mempool_loaded.notify_one();
-
         fDumpMempoolLater = !fRequestShutdown;
     }
 }
@@ -1087,6 +1118,22 @@ bool AppInitParameterInteraction()
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    nContractExecThreads = gArgs.GetArg("-contractpar", DEFAULT_CONTRACT_EXEC_THREADS);
+    if (nContractExecThreads <= 0)
+        nContractExecThreads += GetNumCores();
+    if (nContractExecThreads <= 1)
+        nContractExecThreads = 0;
+    else if (nContractExecThreads > MAX_CONTRACT_EXEC_THREADS)
+        nContractExecThreads = MAX_CONTRACT_EXEC_THREADS;
+
+    nContractPruneDepth = gArgs.GetArg("-contractprune", DEFAULT_CONTRACT_PRUNE_DEPTH);
+    if (nContractPruneDepth < 0) {
+        return InitError(_("Contract prune cannot be configured with a negative value."));
+    }
+    if (nContractPruneDepth > 0 && nContractPruneDepth < (int) MIN_BLOCKS_TO_KEEP) {
+        return InitError(strprintf(_("Contract prune configured below the minimum of %d blocks.  Please use a higher number."), MIN_BLOCKS_TO_KEEP));
+    }
+
     // block pruning; get the amount of disk space (in MiB) to allot for block & undo files
     int64_t nPruneArg = gArgs.GetArg("-prune", 0);
     if (nPruneArg < 0) {
@@ -1295,7 +1342,20 @@ bool AppInitMain()
     InitSignatureCache();
     InitScriptExecutionCache();
 
+    int nContractStatePool = gArgs.GetArg("-contractstatepool", DEFAULT_UVM_STATE_POOL_SIZE);
+    uvm::lua::lib::UvmStatePool::instance().set_max_size(std::max(nContractStatePool, 0));
+    LogPrintf("Keeping at most %d contract VM states for reuse\n", std::max(nContractStatePool, 0));
+    int nContractModuleCache = gArgs.GetArg("-contractmodulecache", DEFAULT_UVM_MODULE_CACHE_SIZE);
+    uvm::lua::lib::UvmModuleCache::instance().set_max_size(std::max(nContractModuleCache, 0));
+    if (gArgs.IsArgSet("-contractprofile")) {
+        fs::path pathContractProfile = fs::absolute(gArgs.GetArg("-contractprofile", ""), GetDataDir());
+        if (!OpenContractProfileLog(pathContractProfile))
+            return InitError(strprintf(_("Could not open contract profile file %s"), pathContractProfile.string()));
+        LogPrintf("Writing contract profiles to %s\n", pathContractProfile.string());
+    }
+
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+    LogPrintf("Using %u threads for contract execution\n", nContractExecThreads);
     if (nScriptCheckThreads) {
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
@@ -1347,6 +1407,8 @@ bool AppInitMain()
 
     peerLogic.reset(new PeerLogicValidation(&connman, scheduler));
     RegisterValidationInterface(peerLogic.get());
+    mempoolContractRecheck.reset(new MempoolContractRecheck());
+    RegisterValidationInterface(mempoolContractRecheck.get());
 
     // sanitize comments per BIP-0014, format user agent and check total size
     std::vector<std::string> uacomments;
@@ -1710,13 +1772,31 @@ bool AppInitMain()
     if (gArgs.IsArgSet("-blocknotify"))
         uiInterface.NotifyBlockTip.connect(BlockNotifyCallback);
 
+    if (gArgs.IsArgSet("-loadcontractsnapshot")) {
+        // later starts keep the state loaded by the first one
+        bool fContractStateEmpty = get_contract_storage_service()->top_commit_id() == EMPTY_COMMIT_ID;
+        if (fContractStateEmpty) {
+            uiInterface.InitMessage(_("Loading contract state snapshot..."));
+            ContractSnapshotInfo info;
+            std::string strError;
+            if (!LoadContractState(fs::absolute(gArgs.GetArg("-loadcontractsnapshot", ""), GetDataDir()), info, strError)) {
+                return InitError(strprintf(_("Unable to load contract state snapshot: %s"), strError));
+            }
+        } else {
+            LogPrintf("Contract state isn't empty, -loadcontractsnapshot ignored\n");
+        }
+    }
+
     std::vector<fs::path> vImportFiles;
     for (const std::string& strFile : gArgs.GetArgs("-loadblock")) {
         vImportFiles.push_back(strFile);
     }
 
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
-	threadGroup.create_thread(boost::bind(&ReCheckMemPoolThreadWorker));
+	if (nContractPruneDepth > 0) {
+		LogPrintf("Contract commit history pruning enabled, keeping %d blocks.\n", nContractPruneDepth);
+		threadGroup.create_thread(boost::bind(&ContractPruneThreadWorker));
+	}
 
     // Wait for genesis block to be processed
     {
@@ -18,13 +18,14 @@ namespace jsondiff
 	public:
 		DiffResult();
 		DiffResult(const JsonValue& diff_json);
+		DiffResult(JsonValue&& diff_json);
 		virtual ~DiffResult();
 
 		std::string str() const;
 		std::string pretty_str() const;
 		bool is_undefined() const;
 
-		JsonValue value() const;
+		const JsonValue& value() const;
 
 		//  json diffתѺÿɶַ
 		std::string pretty_diff_str(size_t indent_count=0) const;
@@ -5,13 +5,13 @@ namespace jsondiff
 {
 	namespace utils
 	{
-		bool string_ends_with(std::string str, std::string end)
+		bool string_ends_with(const std::string& str, const std::string& end)
 		{
 			auto pos = str.find(end);
 			return pos >= 0 && (pos + end.size() == str.size());
 		}
 
-		std::string string_without_ext(std::string str, std::string ext)
+		std::string string_without_ext(const std::string& str, const std::string& ext)
 		{
 			if (!string_ends_with(str, ext))
 				return str;
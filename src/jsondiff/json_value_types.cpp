@@ -50,7 +50,7 @@ namespace jsondiff
 		}
 	}
 
-	bool json_has_key(const JsonObject& json_value, std::string key)
+	bool json_has_key(const JsonObject& json_value, const std::string& key)
 	{
 		return json_value.find(key) != json_value.end();
 	}
@@ -59,7 +59,7 @@ namespace jsondiff
 	{
 		if (!diff_json.is_object())
 			return false;
-		auto diff_json_obj = diff_json.as<fjson::mutable_variant_object>();
-		return json_has_key(diff_json_obj, JSONDIFF_KEY_OLD_VALUE) && json_has_key(diff_json_obj, JSONDIFF_KEY_NEW_VALUE);
+		const auto& diff_json_obj = diff_json.get_object();
+		return diff_json_obj.contains(JSONDIFF_KEY_OLD_VALUE) && diff_json_obj.contains(JSONDIFF_KEY_NEW_VALUE);
 	}
 }
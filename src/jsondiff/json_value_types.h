@@ -43,7 +43,7 @@ namespace jsondiff
 
 	JsonValue json_deep_clone(const JsonValue& json_value);
 
-	bool json_has_key(const JsonObject& json_value, std::string key);
+	bool json_has_key(const JsonObject& json_value, const std::string& key);
 
 	bool is_scalar_value_diff_format(const JsonValue& diff_json);
 }
@@ -3,6 +3,10 @@
 #include <jsondiff/diff_result.h>
 #include <jsondiff/helper.h>
 
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
 #include <fjson/io/json.hpp>
 #include <fjson/string.hpp>
 #include <fjson/variant.hpp>
@@ -10,22 +14,217 @@
 
 namespace jsondiff
 {
-	JsonDiff::JsonDiff()
+	// objects up to this size are searched linearly, larger ones through a sorted key index
+	static const size_t JSONDIFF_LINEAR_FIND_MAX_SIZE = 8;
+
+	namespace
 	{
+		// read-only key lookup into a json object, finds the first entry of a key like variant_object::find
+		class ObjectKeyIndex
+		{
+		private:
+			const fjson::variant_object& _obj;
+			std::vector<const fjson::variant_object::entry*> _sorted;
+		public:
+			explicit ObjectKeyIndex(const fjson::variant_object& obj)
+				: _obj(obj)
+			{
+				if (obj.size() <= JSONDIFF_LINEAR_FIND_MAX_SIZE)
+					return;
+				_sorted.reserve(obj.size());
+				for (auto it = obj.begin(); it != obj.end(); it++)
+					_sorted.push_back(&*it);
+				std::stable_sort(_sorted.begin(), _sorted.end(), [](const fjson::variant_object::entry* a, const fjson::variant_object::entry* b) {
+					return a->key() < b->key();
+				});
+			}
+
+			const JsonValue* find(const std::string& key) const
+			{
+				if (_sorted.empty())
+				{
+					auto it = _obj.find(key);
+					return it == _obj.end() ? nullptr : &it->value();
+				}
+				auto it = std::lower_bound(_sorted.begin(), _sorted.end(), key, [](const fjson::variant_object::entry* a, const std::string& k) {
+					return a->key() < k;
+				});
+				if (it == _sorted.end() || (*it)->key() != key)
+					return nullptr;
+				return &(*it)->value();
+			}
+		};
 
+		// ordered key/value list with the set/erase semantics of mutable_variant_object and hashed key lookup
+		class ObjectBuilder
+		{
+		private:
+			struct Entry
+			{
+				std::string key;
+				JsonValue value;
+				bool erased;
+			};
+			std::vector<Entry> _entries;
+			std::unordered_map<std::string, size_t> _index;
+			size_t _erased_count;
+			bool _has_duplicates; // duplicated keys fall back to linear search for the first live entry
+
+			Entry* find(const std::string& key)
+			{
+				if (_has_duplicates)
+				{
+					for (auto& entry : _entries)
+					{
+						if (!entry.erased && entry.key == key)
+							return &entry;
+					}
+					return nullptr;
+				}
+				auto it = _index.find(key);
+				return it == _index.end() ? nullptr : &_entries[it->second];
+			}
+		public:
+			ObjectBuilder()
+				: _erased_count(0), _has_duplicates(false)
+			{
+			}
+
+			void reserve(size_t size)
+			{
+				_entries.reserve(size);
+				_index.reserve(size);
+			}
+
+			// appends without checking for the key, like mutable_variant_object::operator()
+			void append(std::string key, JsonValue value)
+			{
+				if (!_has_duplicates && !_index.emplace(key, _entries.size()).second)
+					_has_duplicates = true;
+				_entries.push_back(Entry{ std::move(key), std::move(value), false });
+			}
+
+			void set(const std::string& key, JsonValue value)
+			{
+				auto entry = find(key);
+				if (entry)
+					entry->value = std::move(value);
+				else
+					append(key, std::move(value));
+			}
+
+			void erase(const std::string& key)
+			{
+				auto entry = find(key);
+				if (!entry)
+					return;
+				entry->erased = true;
+				_erased_count++;
+				if (!_has_duplicates)
+					_index.erase(key);
+			}
+
+			size_t size() const
+			{
+				return _entries.size() - _erased_count;
+			}
+
+			JsonValue to_json()
+			{
+				JsonObject obj;
+				obj.reserve(size());
+				for (auto& entry : _entries)
+				{
+					if (!entry.erased)
+						obj(std::move(entry.key), std::move(entry.value));
+				}
+				return JsonValue(std::move(obj));
+			}
+		};
 	}
 
-	JsonDiff::~JsonDiff()
+	// same as json_dumps(a) == json_dumps(b) for two values of the same scalar JsonValueType
+	static bool scalar_json_values_equal(const JsonValue& a, const JsonValue& b)
 	{
+		switch (a.get_type())
+		{
+		case fjson::variant::null_type:
+			return true;
+		case fjson::variant::bool_type:
+			return a.as_bool() == b.as_bool();
+		case fjson::variant::string_type:
+			return a.get_string() == b.get_string();
+		case fjson::variant::int64_type:
+		case fjson::variant::uint64_type:
+		{
+			if (a.is_int64() && b.is_int64())
+				return a.as_int64() == b.as_int64();
+			if ((a.is_int64() && a.as_int64() < 0) || (b.is_int64() && b.as_int64() < 0))
+				return false;
+			return a.as_uint64() == b.as_uint64();
+		}
+		default:
+			return json_dumps(a) == json_dumps(b);
+		}
+	}
 
+	// strings the legacy json text round trip does not give back unchanged
+	static bool string_changes_by_reparse(const std::string& str)
+	{
+		return str.find('\a') != std::string::npos || str.find('\x04') != std::string::npos;
 	}
 
-	DiffResultP JsonDiff::diff_by_string(const std::string &old_json_str, const std::string &new_json_str)
+	// the value json_loads(json_dumps(value)) gives, built without going through json text
+	static JsonValue json_reparsed_copy(const JsonValue& value)
 	{
-		return diff(json_loads(old_json_str), json_loads(new_json_str));
+		switch (value.get_type())
+		{
+		case fjson::variant::null_type:
+			return JsonValue();
+		case fjson::variant::bool_type:
+		case fjson::variant::uint64_type:
+			return value;
+		case fjson::variant::int64_type:
+		{
+			auto n = value.as_int64();
+			if (n < 0)
+				return value;
+			return JsonValue((uint64_t) n);
+		}
+		case fjson::variant::string_type:
+			if (string_changes_by_reparse(value.get_string()))
+				return json_deep_clone(value);
+			return value;
+		case fjson::variant::array_type:
+		{
+			const auto& arr = value.get_array();
+			JsonArray result;
+			result.reserve(arr.size());
+			for (const auto& item : arr)
+				result.push_back(json_reparsed_copy(item));
+			return JsonValue(std::move(result));
+		}
+		case fjson::variant::object_type:
+		{
+			const auto& obj = value.get_object();
+			JsonObject result;
+			result.reserve(obj.size());
+			for (auto it = obj.begin(); it != obj.end(); it++)
+			{
+				if (string_changes_by_reparse(it->key()))
+					result(json_deep_clone(JsonValue(it->key())).as_string(), json_reparsed_copy(it->value()));
+				else
+					result(it->key(), json_reparsed_copy(it->value()));
+			}
+			return JsonValue(std::move(result));
+		}
+		default:
+			return json_deep_clone(value);
+		}
 	}
 
-	DiffResultP JsonDiff::diff(const JsonValue& old_json, const JsonValue& new_json)
+	// the diff json of old_json to new_json, false when they are the same
+	static bool diff_json_values(const JsonValue& old_json, const JsonValue& new_json, JsonValue& result)
 	{
 		auto old_json_type = guess_json_value_type(old_json);
 		auto new_json_type = guess_json_value_type(new_json);
@@ -36,18 +235,17 @@ namespace jsondiff
 			// should return undefined for two identical values
 			// should return { __old: <old value>, __new : <new value> } object for two different numbers
 
-			if (old_json_type != new_json_type || json_dumps(old_json) != json_dumps(new_json))
-			{
-				fjson::mutable_variant_object result_json;
-				result_json[JSONDIFF_KEY_OLD_VALUE] = old_json;
-				result_json[JSONDIFF_KEY_NEW_VALUE] = new_json;
-				return std::make_shared<DiffResult>(result_json);
-			}
-			else
+			if (old_json_type != new_json_type || !scalar_json_values_equal(old_json, new_json))
 			{
-				// identical scalar values
-				return DiffResult::make_undefined_diff_result();
+				JsonObject result_json;
+				result_json.reserve(2);
+				result_json(JSONDIFF_KEY_OLD_VALUE, old_json);
+				result_json(JSONDIFF_KEY_NEW_VALUE, new_json);
+				result = JsonValue(std::move(result_json));
+				return true;
 			}
+			// identical scalar values
+			return false;
 		}
 		else if (old_json_type == JsonValueType::JVT_OBJECT)
 		{
@@ -58,41 +256,43 @@ namespace jsondiff
 			// should return { <key>__added: <new value> } when the first object is missing a key
 			// should return { <key>: { __old: <old value>, __new : <new value> } } for two objects with diffent scalar values for a key
 			// should return { <key>: <diff> } with a recursive diff for two objects with diffent values for a key
-			auto a_obj = old_json.as<fjson::mutable_variant_object>();
-			auto b_obj = new_json.as<fjson::mutable_variant_object>();
-			bool same = false;
-			fjson::mutable_variant_object diff_json;
+			const auto& a_obj = old_json.get_object();
+			const auto& b_obj = new_json.get_object();
+			ObjectKeyIndex a_keys(a_obj);
+			ObjectKeyIndex b_keys(b_obj);
+			ObjectBuilder diff_json;
 			for (auto i = a_obj.begin(); i != a_obj.end(); i++)
 			{
-				auto a_i_value = i->value();
-				auto a_i_key = i->key();
-				if (b_obj.find(a_i_key) == b_obj.end())
+				const auto& a_i_key = i->key();
+				auto b_i_value = b_keys.find(a_i_key);
+				if (!b_i_value)
 				{
 					// 存在于old不存在于new
-					diff_json[a_i_key + JSONDIFF_KEY_DELETED_POSTFIX] = a_i_value;
+					diff_json.set(a_i_key + JSONDIFF_KEY_DELETED_POSTFIX, i->value());
 				}
 				else
 				{
 					// old和new中都有这个key
-					auto sub_diff_value = diff(a_i_value, b_obj[a_i_key]);
-					if (sub_diff_value->is_undefined()) // same elements
+					JsonValue sub_diff_value;
+					if (!diff_json_values(i->value(), *b_i_value, sub_diff_value)) // same elements
 						continue;
 					// 修改
-					diff_json[a_i_key] = sub_diff_value->value();
+					diff_json.set(a_i_key, std::move(sub_diff_value));
 				}
 			}
 			for (auto j = b_obj.begin(); j != b_obj.end(); j++)
 			{
-				auto key = j->key();
-				if (a_obj.find(key) == a_obj.end())
+				const auto& key = j->key();
+				if (!a_keys.find(key))
 				{
 					// 不存在于old但是存在于new
-					diff_json[key + JSONDIFF_KEY_ADDED_POSTFIX] = j->value();
+					diff_json.set(key + JSONDIFF_KEY_ADDED_POSTFIX, j->value());
 				}
 			}
 			if (diff_json.size() < 1)
-				return DiffResult::make_undefined_diff_result();
-			return std::make_shared<DiffResult>(diff_json);
+				return false;
+			result = diff_json.to_json();
+			return true;
 		}
 		else if (old_json_type == JsonValueType::JVT_ARRAY)
 		{
@@ -108,52 +308,54 @@ namespace jsondiff
 			//   should return[..., ['+', insert_position_index, <added item>], ...] for two arrays when the second array has an extra value
 			//   should return[..., ['~', position_index, <diff>], ...] for two arrays when an item has been modified(note: involves a crazy heuristic)
 
-			auto a_array = old_json.as<fjson::variants>();
-			auto b_array = new_json.as<fjson::variants>();
+			const auto& a_array = old_json.get_array();
+			const auto& b_array = new_json.get_array();
 
 			// TODO: 当两个array的大部分元素相同时，但是可能前方插入部分元素，这时候应该尽量减少diff大小
 
 			// 一个array有多项变化的时候， diff里的索引是用原始对象的index
 
-			fjson::variants diff_json;
+			JsonArray diff_json;
 			for (size_t i = 0; i < a_array.size(); i++)
 			{
 				if (i >= b_array.size())
 				{
 					// 删除元素
-					fjson::variants item_diff;
+					JsonArray item_diff;
+					item_diff.reserve(3);
 					item_diff.push_back("-");
 					item_diff.push_back((int)i);
 					item_diff.push_back(a_array[i]);
-					diff_json.push_back(item_diff);
+					diff_json.push_back(std::move(item_diff));
 				}
 				else
 				{
-					auto item_value_diff = diff(a_array[i], b_array[i]);
-					if (item_value_diff->is_undefined()) // 没有发生改变
+					JsonValue item_value_diff;
+					if (!diff_json_values(a_array[i], b_array[i], item_value_diff)) // 没有发生改变
 						continue;
 					// 修改元素
-					fjson::variants item_diff;
+					JsonArray item_diff;
+					item_diff.reserve(3);
 					item_diff.push_back("~");
 					item_diff.push_back((int)i);
-					item_diff.push_back(item_value_diff->value());
-					diff_json.push_back(item_diff);
+					item_diff.push_back(std::move(item_value_diff));
+					diff_json.push_back(std::move(item_diff));
 				}
 			}
 			for (size_t i = a_array.size(); i < b_array.size(); i++)
 			{
 				// 不存在于old但是存在于new中
-				fjson::variants item_diff;
+				JsonArray item_diff;
+				item_diff.reserve(3);
 				item_diff.push_back("+");
 				item_diff.push_back((int)i);
 				item_diff.push_back(b_array[i]);
-				diff_json.push_back(item_diff);
+				diff_json.push_back(std::move(item_diff));
 			}
 			if (diff_json.size() < 1)
-			{
-				return DiffResult::make_undefined_diff_result();
-			}
-			return std::make_shared<DiffResult>(diff_json);
+				return false;
+			result = JsonValue(std::move(diff_json));
+			return true;
 		}
 		else
 		{
@@ -161,85 +363,83 @@ namespace jsondiff
 		}
 	}
 
-	JsonValue JsonDiff::patch_by_string(const std::string& old_json_value, DiffResultP diff_info)
-	{
-		return patch(json_loads(old_json_value), diff_info);
-	}
-
-	JsonValue JsonDiff::patch(const JsonValue& old_json, const DiffResultP& diff_info)
+	// reverse selects rollback, which applies the diff from the new version back to the old one
+	static JsonValue apply_json_diff(const JsonValue& json, const JsonValue& diff_json, bool is_undefined, bool reverse)
 	{
-		auto old_json_type = guess_json_value_type(old_json);
-		auto diff_json = diff_info->value();
-		auto result = json_deep_clone(old_json);
-		if (diff_info->is_undefined() || diff_json.is_null())
+		auto json_type = guess_json_value_type(json);
+		auto result = json_reparsed_copy(json);
+		if (is_undefined || diff_json.is_null())
 			return result;
-		
-		auto old_json_str = json_dumps(old_json);
-		auto diff_json_str = json_dumps(diff_json);
-		
-		if (is_scalar_json_value_type(old_json_type) || is_scalar_value_diff_format(diff_json))
+
+		if (is_scalar_json_value_type(json_type) || is_scalar_value_diff_format(diff_json))
 		{ // TODO: 这个判断要修改得简单准确一点，修改diffjson格式，区分{__old: ..., __new: ...}和普通object diff
 			if (!diff_json.is_object())
 				throw JsonDiffException("wrong format of diffjson of scalar json value");
-			result = diff_json[JSONDIFF_KEY_NEW_VALUE];
+			return diff_json[reverse ? JSONDIFF_KEY_OLD_VALUE : JSONDIFF_KEY_NEW_VALUE];
 		}
-		else if (old_json_type == JsonValueType::JVT_OBJECT)
+		else if (json_type == JsonValueType::JVT_OBJECT)
 		{
-			auto old_json_obj = old_json.as<fjson::mutable_variant_object>();
-			auto diff_json_obj = diff_json.as<fjson::mutable_variant_object>();
-			auto result_obj = result.as<fjson::mutable_variant_object>();
+			const auto& json_obj = json.get_object();
+			const auto& diff_json_obj = diff_json.get_object();
+			ObjectKeyIndex json_keys(json_obj);
+			const auto& result_obj = result.get_object();
+			ObjectBuilder result_builder;
+			result_builder.reserve(result_obj.size());
+			for (auto it = result_obj.begin(); it != result_obj.end(); it++)
+				result_builder.append(it->key(), it->value());
+			// patch removes <key>__deleted and restores <key>__added, rollback the other way round
+			const char* remove_postfix = reverse ? JSONDIFF_KEY_ADDED_POSTFIX : JSONDIFF_KEY_DELETED_POSTFIX;
+			const char* restore_postfix = reverse ? JSONDIFF_KEY_DELETED_POSTFIX : JSONDIFF_KEY_ADDED_POSTFIX;
 			for (auto i = diff_json_obj.begin(); i != diff_json_obj.end(); i++)
 			{
-				auto key = i->key();
-				auto diff_item = i->value();
+				const auto& key = i->key();
+				const auto& diff_item = i->value();
 				// 如果key是 <key>__deleted 或者 <key>__added，则是删除或者添加，否则是修改现有key的值
-				if (utils::string_ends_with(key, JSONDIFF_KEY_DELETED_POSTFIX) && key.size() > strlen(JSONDIFF_KEY_DELETED_POSTFIX))
+				if (utils::string_ends_with(key, remove_postfix) && key.size() > strlen(remove_postfix))
 				{
-					auto old_key = utils::string_without_ext(key, JSONDIFF_KEY_DELETED_POSTFIX);
-					if (old_json_obj.find(old_key) != old_json_obj.end())
+					auto origin_key = utils::string_without_ext(key, remove_postfix);
+					if (json_keys.find(origin_key))
 					{
-						// 是删除属性操作
-						result_obj.erase(old_key);
+						result_builder.erase(origin_key);
 						continue;
 					}
 				}
-				else if (utils::string_ends_with(key, JSONDIFF_KEY_ADDED_POSTFIX) && key.size() > strlen(JSONDIFF_KEY_ADDED_POSTFIX))
+				else if (utils::string_ends_with(key, restore_postfix) && key.size() > strlen(restore_postfix))
 				{
-					auto old_key = utils::string_without_ext(key, JSONDIFF_KEY_ADDED_POSTFIX);
-					// 是增加属性操作
-					result_obj[old_key] = diff_item;
+					auto origin_key = utils::string_without_ext(key, restore_postfix);
+					result_builder.set(origin_key, diff_item);
 					continue;
 				}
 				// 可能是修改现有key的值
-				if (old_json_obj.find(key) == old_json_obj.end())
+				auto json_item = json_keys.find(key);
+				if (!json_item)
 					throw JsonDiffException("wrong format of diffjson of this old version json");
-				auto sub_item_new = patch(old_json_obj[key], std::make_shared<DiffResult>(diff_item));
-				result_obj[key] = sub_item_new;
+				result_builder.set(key, apply_json_diff(*json_item, diff_item, diff_item.is_null(), reverse));
 			}
-			return result_obj;
+			return result_builder.to_json();
 		}
-		else if (old_json_type == JsonValueType::JVT_ARRAY)
+		else if (json_type == JsonValueType::JVT_ARRAY)
 		{
-			auto old_json_array = old_json.as<fjson::variants>();
-			auto diff_json_array = diff_json.as<fjson::variants>();
-			auto result_array = result.as<fjson::variants>();
+			const auto& json_array = json.get_array();
+			const auto& diff_json_array = diff_json.get_array();
+			auto& result_array = result.get_array();
 			for (size_t i = 0; i < diff_json_array.size(); i++)
 			{
 				if (!diff_json_array[i].is_array())
 					throw JsonDiffException("diffjson format error for array diff");
-				auto diff_item = diff_json_array[i].as<fjson::variants>();
+				const auto& diff_item = diff_json_array[i].get_array();
 				if (diff_item.size() != 3)
 					throw JsonDiffException("diffjson format error for array diff");
 				auto op_item = diff_item[0].as_string();
-				auto pos = diff_item[1].as_uint64();
-				auto inner_diff_json = diff_item[2];
+				auto pos = diff_item[1].as_uint64(); // pos是old的pos， FIXME： 新旧对象的pos不一定一样
+				const auto& inner_diff_json = diff_item[2];
 				// FIXME； 一个array有多项变化的时候， diff里的索引是用原始对象的index，所以这里应该找出 pos => old_json中同值的pos
-				if (op_item == std::string("+"))
+				if (op_item == std::string(reverse ? "-" : "+"))
 				{
 					// 添加元素
 					result_array.insert(result_array.begin() + pos, inner_diff_json);
 				}
-				else if (op_item == std::string("-"))
+				else if (op_item == std::string(reverse ? "+" : "-"))
 				{
 					// 删除元素
 					result_array.erase(result_array.begin() + pos);
@@ -247,21 +447,52 @@ namespace jsondiff
 				else if (op_item == std::string("~"))
 				{
 					// 修改元素
-					auto sub_item_new = patch(old_json_array[i], std::make_shared<DiffResult>(inner_diff_json));
-					result_array[pos] = sub_item_new;
+					result_array[pos] = apply_json_diff(json_array[i], inner_diff_json, inner_diff_json.is_null(), reverse);
 				}
 				else
 				{
 					throw JsonDiffException(std::string("not supported diff array op now: ") + op_item);
 				}
 			}
-			return result_array;
+			return result;
 		}
 		else
 		{
-			throw JsonDiffException(std::string("not supported json value type to merge patch ") + json_dumps(old_json));
+			throw JsonDiffException(std::string(reverse ? "not supported json value type to rollback diff from " : "not supported json value type to merge patch ") + json_dumps(json));
 		}
-		return result;
+	}
+
+	JsonDiff::JsonDiff()
+	{
+
+	}
+
+	JsonDiff::~JsonDiff()
+	{
+
+	}
+
+	DiffResultP JsonDiff::diff_by_string(const std::string &old_json_str, const std::string &new_json_str)
+	{
+		return diff(json_loads(old_json_str), json_loads(new_json_str));
+	}
+
+	DiffResultP JsonDiff::diff(const JsonValue& old_json, const JsonValue& new_json)
+	{
+		JsonValue diff_json;
+		if (!diff_json_values(old_json, new_json, diff_json))
+			return DiffResult::make_undefined_diff_result();
+		return std::make_shared<DiffResult>(std::move(diff_json));
+	}
+
+	JsonValue JsonDiff::patch_by_string(const std::string& old_json_value, DiffResultP diff_info)
+	{
+		return patch(json_loads(old_json_value), diff_info);
+	}
+
+	JsonValue JsonDiff::patch(const JsonValue& old_json, const DiffResultP& diff_info)
+	{
+		return apply_json_diff(old_json, diff_info->value(), diff_info->is_undefined(), false);
 	}
 
 	JsonValue JsonDiff::rollback_by_string(const std::string& new_json_value, DiffResultP diff_info)
@@ -271,99 +502,6 @@ namespace jsondiff
 
 	JsonValue JsonDiff::rollback(const JsonValue& new_json, DiffResultP diff_info)
 	{
-		auto new_json_type = guess_json_value_type(new_json);
-		auto diff_json = diff_info->value();
-		auto result = json_deep_clone(new_json);
-		if (diff_info->is_undefined() || diff_json.is_null())
-			return result;
-
-		auto new_json_str = json_dumps(new_json);
-		auto diff_json_str = json_dumps(diff_json);
-
-		if (is_scalar_json_value_type(new_json_type) || is_scalar_value_diff_format(diff_json))
-		{ // TODO: 这个判断要修改得简单准确一点，修改diffjson格式，区分{__old: ..., __new: ...}和普通object diff
-			if (!diff_json.is_object())
-				throw JsonDiffException("wrong format of diffjson of scalar json value");
-			result = diff_json[JSONDIFF_KEY_OLD_VALUE];
-		}
-		else if (new_json_type == JsonValueType::JVT_OBJECT)
-		{
-			auto new_json_obj = new_json.as<fjson::mutable_variant_object>();
-			auto diff_json_obj = diff_json.as<fjson::mutable_variant_object>();
-			auto result_obj = result.as<fjson::mutable_variant_object>();
-			for (auto i = diff_json_obj.begin(); i != diff_json_obj.end(); i++)
-			{
-				auto key = i->key();
-				auto diff_item = i->value();
-				// 如果key是 <key>__deleted 或者 <key>__added，则是删除或者添加，否则是修改现有key的值
-				if (utils::string_ends_with(key, JSONDIFF_KEY_ADDED_POSTFIX) && key.size() > strlen(JSONDIFF_KEY_ADDED_POSTFIX))
-				{
-					auto origin_key = utils::string_without_ext(key, JSONDIFF_KEY_ADDED_POSTFIX);
-					if (new_json_obj.find(origin_key) != new_json_obj.end())
-					{
-						// 是增加属性操作，需要回滚
-						result_obj.erase(origin_key);
-						continue;
-					}
-				}
-				else if (utils::string_ends_with(key, JSONDIFF_KEY_DELETED_POSTFIX) && key.size() > strlen(JSONDIFF_KEY_DELETED_POSTFIX))
-				{
-					auto origin_key = utils::string_without_ext(key, JSONDIFF_KEY_DELETED_POSTFIX);
-					// 是删除属性操作，需要回滚
-					result_obj[origin_key] = diff_item;
-					continue;
-				}
-				// 可能是修改现有key的值
-				if (new_json_obj.find(key) == new_json_obj.end())
-					throw JsonDiffException("wrong format of diffjson of this old version json");
-				auto sub_item_new = rollback(new_json_obj[key], std::make_shared<DiffResult>(diff_item));
-				result_obj[key] = sub_item_new;
-			}
-			return result_obj;
-		}
-		else if (new_json_type == JsonValueType::JVT_ARRAY)
-		{
-			auto new_json_array = new_json.as<fjson::variants>();
-			auto diff_json_array = diff_json.as<fjson::variants>();
-			auto result_array = result.as<fjson::variants>();
-			for (size_t i = 0; i < diff_json_array.size(); i++)
-			{
-				if (!diff_json_array[i].is_array())
-					throw JsonDiffException("diffjson format error for array diff");
-				auto diff_item = diff_json_array[i].as<fjson::variants>();
-				if (diff_item.size() != 3)
-					throw JsonDiffException("diffjson format error for array diff");
-				auto op_item = diff_item[0].as_string();
-				auto pos = diff_item[1].as_uint64(); // pos是old的pos， FIXME： 新旧对象的pos不一定一样
-				auto inner_diff_json = diff_item[2];
-				// FIXME； 一个array有多项变化的时候， diff里的索引是用原始对象的index，所以这里应该找出 pos => old_json中同值的pos
-				if (op_item == std::string("-"))
-				{
-					// 删除元素，需要回滚
-					result_array.insert(result_array.begin() + pos, inner_diff_json);
-				}
-				else if (op_item == std::string("+"))
-				{
-					// 添加元素，需要回滚
-					result_array.erase(result_array.begin() + pos);
-				}
-				else if (op_item == std::string("~"))
-				{
-					// 修改元素
-					auto sub_item_new = rollback(new_json_array[i], std::make_shared<DiffResult>(inner_diff_json));
-					result_array[pos] = sub_item_new;
-				}
-				else
-				{
-					throw JsonDiffException(std::string("not supported diff array op now: ") + op_item);
-				}
-			}
-			return result_array;
-		}
-		else
-		{
-			throw JsonDiffException(std::string("not supported json value type to rollback diff from ") + json_dumps(new_json));
-		}
-		return result;
+		return apply_json_diff(new_json, diff_info->value(), diff_info->is_undefined(), true);
 	}
 }
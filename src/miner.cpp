@@ -68,8 +68,13 @@ extern CAmount nMinimumInputValue;
 extern CAmount nReserveBalance;
 //extern int nStakeMinConfirmations;
 
-static bool CheckKernel(CBlock* pblock, const COutPoint& prevout, CAmount amount,int nHeight);
-//static bool CheckKernel(CBlock* pblock, const COutPoint& prevout, CAmount amount, int32_t utxoDepth);
+// a wallet coin which may be staked, read from the coins view while holding cs_main
+struct StakeCandidate
+{
+    COutPoint prevout;
+    CAmount amount;
+    int nHeight;
+};
 
 
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
@@ -345,64 +350,106 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlockPos(CWalletRef& pw
     pblocktemplate->vTxSigOpsCost.push_back(-1); // updated at end
     pblocktemplate->vTxSigOpsCost.push_back(-1);
 
-    LOCK2(cs_main, mempool.cs);
+    // the kernel search runs without locks over the stake candidates read while holding them
+    CBlockIndex* pindexPrev;
+    CAmount nBalance;
+    std::vector<StakeCandidate> candidates;
+    uint256 hashPrev10Block;
+    {
+        LOCK2(cs_main, mempool.cs);
 
-    if (!EnsureWalletIsAvailable(pwallet, true))
-        return nullptr;
+        if (!EnsureWalletIsAvailable(pwallet, true))
+            return nullptr;
 
-    if(chainActive.Height()+1 <(Params().GetConsensus().UBCONTRACT_Height))
-    	return nullptr;
+        if(chainActive.Height()+1 <(Params().GetConsensus().UBCONTRACT_Height))
+        	return nullptr;
 
-    //std::shared_ptr<CReserveScript> coinbase_script;
-    //pwallet->GetScriptForMining(coinbase_script);
+        //std::shared_ptr<CReserveScript> coinbase_script;
+        //pwallet->GetScriptForMining(coinbase_script);
 
-    // If the keypool is exhausted, no script is returned at all.  Catch this.
-    //if (!coinbase_script)
-    //    return nullptr;	
+        // If the keypool is exhausted, no script is returned at all.  Catch this.
+        //if (!coinbase_script)
+        //    return nullptr;	
 
-    CBlockIndex* pindexPrev = chainActive.Tip();
-    nHeight = pindexPrev->nHeight + 1;
-    if(nHeight == Params().GetConsensus().ForkV4Height || nHeight == Params().GetConsensus().ForkV5Height)
-        return nullptr;
+        pindexPrev = chainActive.Tip();
+        nHeight = pindexPrev->nHeight + 1;
+        if(nHeight == Params().GetConsensus().ForkV4Height || nHeight == Params().GetConsensus().ForkV5Height)
+            return nullptr;
 
-    pblock->nVersion = ComputeBlockVersion(pindexPrev, chainparams.GetConsensus(), MINING_TYPE_POS);
-    // -regtest only: allow overriding block.nVersion with
-    // -blockversion=N to test forking scenarios
-    if (chainparams.MineBlocksOnDemand())
-        pblock->nVersion = gArgs.GetArg("-blockversion", pblock->nVersion);
+        pblock->nVersion = ComputeBlockVersion(pindexPrev, chainparams.GetConsensus(), MINING_TYPE_POS);
+        // -regtest only: allow overriding block.nVersion with
+        // -blockversion=N to test forking scenarios
+        if (chainparams.MineBlocksOnDemand())
+            pblock->nVersion = gArgs.GetArg("-blockversion", pblock->nVersion);
 
-    pblock->nTime = GetAdjustedTime();
-    const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
+        pblock->nTime = GetAdjustedTime();
+        const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
 
-    nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                       ? nMedianTimePast
-                       : pblock->GetBlockTime();
+        nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                           ? nMedianTimePast
+                           : pblock->GetBlockTime();
 
-    // Decide whether to include witness transactions
-    // This is only needed in case the witness softfork activation is reverted
-    // (which would require a very deep reorganization) or when
-    // -promiscuousmempoolflags is used.
-    // TODO: replace this with a call to main to assess validity of a mempool
-    // transaction (which in most cases can be a no-op).
-    fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus()) && fMineWitnessTx;
+        // Decide whether to include witness transactions
+        // This is only needed in case the witness softfork activation is reverted
+        // (which would require a very deep reorganization) or when
+        // -promiscuousmempoolflags is used.
+        // TODO: replace this with a call to main to assess validity of a mempool
+        // transaction (which in most cases can be a no-op).
+        fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus()) && fMineWitnessTx;
 
-    /*int nPackagesSelected = 0;
-    int nDescendantsUpdated = 0;
-    addPackageTxs(nPackagesSelected, nDescendantsUpdated, minGasPrice, true);*/
+        /*int nPackagesSelected = 0;
+        int nDescendantsUpdated = 0;
+        addPackageTxs(nPackagesSelected, nDescendantsUpdated, minGasPrice, true);*/
 
-    //int64_t nTime1 = GetTimeMicros();
+        //int64_t nTime1 = GetTimeMicros();
 
-    nLastBlockTx = nBlockTx;
-    nLastBlockSize = nBlockSize;
-    nLastBlockWeight = nBlockWeight;
+        nLastBlockTx = nBlockTx;
+        nLastBlockSize = nBlockSize;
+        nLastBlockWeight = nBlockWeight;
     
-    pblocktemplate->vTxFees[0] = -nFees;
+        pblocktemplate->vTxFees[0] = -nFees;
+
+        // Fill in header
+        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+        UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
+        pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
+        pblock->nNonce         = 0;
+
+        posstate.numOfUtxo = 0;
+        posstate.sumOfutxo = 0;
+
+        // Choose coins to use
+        nBalance = pwallet->GetBalance();
+        if (nBalance <= nReserveBalance) {
+            //LogPrintf("CreateNewBlockPos(): nBalance not enough for POS, less than nReserveBalance\n");
+            return nullptr;
+        }
 
-    // Fill in header
-    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-    UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
-    pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
-    pblock->nNonce         = 0;
+        std::set<std::pair<const CWalletTx*,unsigned int> > setCoins;
+        int64_t nValueIn = 0;
+
+        // Select coins with suitable depth
+        if (!pwallet->SelectCoinsForStaking(nBalance - nReserveBalance, setCoins, nValueIn))
+            return nullptr;
+
+        posstate.numOfUtxo = setCoins.size();
+        posstate.sumOfutxo = nValueIn;
+
+        if (setCoins.empty())
+            return nullptr;
+
+        for (const auto& pcoin: setCoins) {
+            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
+            Coin coinStake;
+            if (!pcoinsTip->GetCoin(prevoutStake, coinStake))
+                continue;
+            if ((int) coinStake.nHeight > nHeight - Params().GetConsensus().nStakeMinConfirmations)
+                continue;
+            candidates.push_back(StakeCandidate{prevoutStake, coinStake.out.nValue, (int) coinStake.nHeight});
+        }
+        // the same for every coin
+        hashPrev10Block = GetStakeModifierBlockHash(pindexPrev, pblock->hashPrevBlock);
+    }
 
 	// Create coin stake
 	CTransaction txCoinStake;
@@ -412,106 +459,75 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlockPos(CWalletRef& pw
     CScript scriptEmpty;
     scriptEmpty.clear();
     //txCoinStake.vout.push_back(CTxOut(0, scriptEmpty));
-    posstate.numOfUtxo = 0;
-    posstate.sumOfutxo = 0;
-
-	// Choose coins to use
-    CAmount nBalance = pwallet->GetBalance();
-    if (nBalance <= nReserveBalance) {
-    	//LogPrintf("CreateNewBlockPos(): nBalance not enough for POS, less than nReserveBalance\n");
-        return nullptr;
-    }
-
-    std::set<std::pair<const CWalletTx*,unsigned int> > setCoins;
-    int64_t nValueIn = 0;
-
-    // Select coins with suitable depth
-    if (!pwallet->SelectCoinsForStaking(nBalance - nReserveBalance, setCoins, nValueIn))
-        return nullptr;
-
-    posstate.numOfUtxo = setCoins.size();
-    posstate.sumOfutxo = nValueIn;
-
-    if (setCoins.empty())
-        return nullptr;
 
 	int64_t nCredit = 0;
-	bool fKernelFound = false;
 	CScript scriptPubKeyKernel;
 	COutPoint prevoutFound;
     int64_t startTime=0;
     int64_t endTime=0;
     startTime = GetTimeMillis();
 
-	for (const auto& pcoin: setCoins) {
-		COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-
-		Coin coinStake;
-		if (!pcoinsTip->GetCoin(prevoutStake, coinStake)) {
-			//return nullptr;
-			continue;
-		}	
-
-		//CTxOut vout = pcoin.first->tx->vout[pcoin.second];
-		//int nDepth = pcoin.first->GetDepthInMainChain();
-
-		//if (CheckKernel(pblock, prevoutStake, vout.nValue, nDepth)) {
-		if (CheckKernel(pblock, prevoutStake, coinStake.out.nValue,nHeight)) {
-            // Found a kernel
-            LogPrintf("CreateCoinStake : kernel found\n");
-
-			// Set prevoutFound
-			prevoutFound = prevoutStake;
-		
-            std::vector<std::vector<unsigned char> > vSolutions;
-            txnouttype whichType;
-            CScript scriptPubKeyOut;
-			//scriptPubKeyKernel = vout.scriptPubKey;
-            scriptPubKeyKernel = coinStake.out.scriptPubKey;
-            if (!Solver(scriptPubKeyKernel, whichType, vSolutions))  {
-                LogPrintf("CreateNewBlockPos(): failed to parse kernel\n");
-                break;
-            }
-            LogPrintf("CreateNewBlockPos(): parsed kernel type=%d\n", whichType);
-            if (whichType != TX_SCRIPTHASH  && 
-				whichType != TX_MULTISIG  &&
-				whichType != TX_PUBKEYHASH && 
-				whichType != TX_PUBKEY && 
-				whichType != TX_WITNESS_V0_SCRIPTHASH &&
-				whichType != TX_WITNESS_V0_KEYHASH) {
-                LogPrintf("CreateNewBlockPos(): no support for kernel type=%d\n", whichType);
-                break;  
-            }
-            if (whichType == TX_SCRIPTHASH || 
-				whichType == TX_MULTISIG || 
-				whichType == TX_PUBKEYHASH || 
-				whichType == TX_PUBKEY || 
-				whichType == TX_WITNESS_V0_SCRIPTHASH || 
-				whichType == TX_WITNESS_V0_KEYHASH) {
-				// use the same script pubkey
-                scriptPubKeyOut = scriptPubKeyKernel;
-            }
-
-			// push empty vin
-            txCoinStake.vin.push_back(CTxIn(prevoutStake));
-            nCredit += coinStake.out.nValue;
-            //nCredit += vout.nValue;
-			// push empty vout
-			CTxOut empty_txout = CTxOut();
-			empty_txout.SetEmpty();
-			txCoinStake.vout.push_back(empty_txout);
-            txCoinStake.vout.push_back(CTxOut(nCredit, scriptPubKeyOut));
-
-            LogPrintf("CreateNewBlockPos(): added kernel type=%d\n", whichType);
-            fKernelFound = true;
+    const StakeCandidate* kernel = nullptr;
+    if (!candidates.empty())
+        posstate.ifPos = 2;
+    for (const auto& candidate : candidates) {
+        if (CheckStakeKernelHash(pblock->nTime, pblock->nBits, candidate.prevout, candidate.amount, nHeight, hashPrev10Block)) {
+            kernel = &candidate;
             break;
         }
-	}
+    }
     endTime  = GetTimeMillis();
     posSleepTime = endTime - startTime;
 
-	if (!fKernelFound)
-		return nullptr;
+    if (!kernel)
+        return nullptr;
+
+    LOCK2(cs_main, mempool.cs);
+    // the candidates are coins of the tip they were read at
+    if (chainActive.Tip() != pindexPrev)
+        return nullptr;
+
+    // Found a kernel
+    LogPrintf("CreateCoinStake : kernel found\n");
+
+    // Set prevoutFound
+    prevoutFound = kernel->prevout;
+
+    Coin coinStake;
+    if (!pcoinsTip->GetCoin(prevoutFound, coinStake))
+        return nullptr;
+
+    std::vector<std::vector<unsigned char> > vSolutions;
+    txnouttype whichType;
+    CScript scriptPubKeyOut;
+    scriptPubKeyKernel = coinStake.out.scriptPubKey;
+    if (!Solver(scriptPubKeyKernel, whichType, vSolutions))  {
+        LogPrintf("CreateNewBlockPos(): failed to parse kernel\n");
+        return nullptr;
+    }
+    LogPrintf("CreateNewBlockPos(): parsed kernel type=%d\n", whichType);
+    if (whichType != TX_SCRIPTHASH  && 
+		whichType != TX_MULTISIG  &&
+		whichType != TX_PUBKEYHASH && 
+		whichType != TX_PUBKEY && 
+		whichType != TX_WITNESS_V0_SCRIPTHASH &&
+		whichType != TX_WITNESS_V0_KEYHASH) {
+        LogPrintf("CreateNewBlockPos(): no support for kernel type=%d\n", whichType);
+        return nullptr;
+    }
+    // use the same script pubkey
+    scriptPubKeyOut = scriptPubKeyKernel;
+
+	// push empty vin
+    txCoinStake.vin.push_back(CTxIn(prevoutFound));
+    nCredit += coinStake.out.nValue;
+	// push empty vout
+	CTxOut empty_txout = CTxOut();
+	empty_txout.SetEmpty();
+	txCoinStake.vout.push_back(empty_txout);
+    txCoinStake.vout.push_back(CTxOut(nCredit, scriptPubKeyOut));
+
+    LogPrintf("CreateNewBlockPos(): added kernel type=%d\n", whichType);
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return nullptr;
@@ -678,7 +694,7 @@ bool BlockAssembler::AttemptToAddContractToBlock(CTxMemPool::txiter iter, uint64
     auto service = get_contract_storage_service();
     service->open();
 
-    std::vector<ContractTransaction> contractTransactions = resultConverter.txs;
+    const auto& contractTransactions = resultConverter.txs;
 	CAmount sumGasCoins = 0;
 	CAmount gasCountAllTxs = 0;
 	uint64_t blockGasLimit = UINT64_MAX;
@@ -716,7 +732,10 @@ bool BlockAssembler::AttemptToAddContractToBlock(CTxMemPool::txiter iter, uint64
 			service->rollback_contract_state(old_root_state_hash);
 	};
 
-    if (!exec.performByteCode()) {
+    // the result the tx had when accepted to the mempool, or when executed ahead
+    bool taken = (contractWrites && mempoolContractState.TakeResult(iter->GetTx(), exec, contractWrites->written_keys)) ||
+                 (parallelContractExec && parallelContractExec->take(iter->GetTx(), exec));
+    if (!taken && !exec.performByteCode()) {
         //error, don't add contract
         return false;
     }
@@ -874,6 +893,31 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
     // and modifying them for their already included ancestors
     UpdatePackagesForAdded(inBlock, mapModifiedTx);
 
+    BOOST_SCOPE_EXIT_ALL(&) {
+        parallelContractExec.reset();
+        contractWrites.reset();
+    };
+    // the mempool contract state has the results of its contract txs against the contract storage of the tip
+    if (allow_contract) {
+        mempoolContractState.Get();
+        contractWrites.reset(new ::contract::storage::ContractStorageAccessRecorder());
+    }
+    // execute ahead on several threads the first contract txs of the mempool without a result to take
+    if (allow_contract && nContractExecThreads > 1) {
+        auto service = get_contract_storage_service();
+        service->open();
+        parallelContractExec.reset(new ContractParallelExec(service.get(), *pblock, hardBlockGasLimit));
+        CCoinsViewCache view(pcoinsTip.get());
+        for (auto it = mempool.mapTx.get<ancestor_score_or_gas_price>().begin();
+                it != mempool.mapTx.get<ancestor_score_or_gas_price>().end() && parallelContractExec->size() < MAX_SPECULATIVE_CONTRACT_TXS; ++it) {
+            const CTransaction& tx = it->GetTx();
+            if (tx.HasContractOp() && !mempoolContractState.HasResult(tx.GetHash()))
+                parallelContractExec->add(tx, view.GetValueIn(tx));
+        }
+        if (parallelContractExec->size() > 1)
+            parallelContractExec->run(nContractExecThreads);
+    }
+
     auto mi = mempool.mapTx.get<ancestor_score_or_gas_price>().begin();
     CTxMemPool::txiter iter;
 
@@ -1061,79 +1105,54 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
 }
 
 
-bool CheckKernel(CBlock* pblock, const COutPoint& prevout, CAmount amount,int nHeight)
+uint256 GetStakeModifierBlockHash(const CBlockIndex* pindexPrev, const uint256& hashPrevBlock)
 {
-	Coin coinStake;
-	if (!pcoinsTip->GetCoin(prevout, coinStake))
-		return false;	
-
-	int utxoHeight = coinStake.nHeight;
-	
-	if (utxoHeight > nHeight - Params().GetConsensus().nStakeMinConfirmations)
-		return false;
-
-    posstate.ifPos = 2;
-    return CheckProofOfStake(pblock, prevout, amount, nHeight-utxoHeight);
+    if (!pindexPrev)
+        return hashPrevBlock;
+    const CBlockIndex* pblockindex = pindexPrev->GetAncestor(pindexPrev->nHeight / 10 * 10);
+    return pblockindex ? pblockindex->GetBlockHash() : hashPrevBlock;
 }
 
-
-bool CheckProofOfStake(CBlock* pblock, const COutPoint& prevout,  CAmount amount, int coinAge)
+bool CheckStakeKernelHash(uint32_t nTime, uint32_t nBits, const COutPoint& prevout, CAmount amount, int nHeight, const uint256& hashPrev10Block)
 {
-    int nHeight = 0;
-    int nHeightPre10Blcok = 0;
-
-    uint256 hashPrevBlock = pblock->hashPrevBlock;
-	if (hashPrevBlock != uint256()) 
-	{
-        nHeight =  mapBlockIndex[hashPrevBlock]->nHeight;
-        nHeightPre10Blcok = nHeight / 10 * 10;
-    }
-    
-
     // Base target
     arith_uint256 bnTarget;
-    bnTarget.SetCompact(pblock->nBits);
-    uint256 targetProofOfStake = ArithToUint256(bnTarget);
+    bnTarget.SetCompact(nBits);
 
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
-    if ((nHeight + 1) < Params().GetConsensus().ForkV3Height)
+    if (nHeight < Params().GetConsensus().ForkV3Height)
     {
-	    ss << pblock->nTime << prevout.hash << prevout.n;
+	    ss << nTime << prevout.hash << prevout.n;
 	}
 	else
 	{
-	    uint256 hashPrev10Block = pblock->hashPrevBlock;
-        CBlockIndex* pblockindex = mapBlockIndex[hashPrev10Block];
-        while(pblockindex)
-        {        
-            if(pblockindex->nHeight == nHeightPre10Blcok)
-            {
-                hashPrev10Block = pblockindex->GetBlockHash();
-                break;
-            }
-            else
-                pblockindex = pblockindex->pprev;
-        }
-	    ss << pblock->nTime << prevout.hash << prevout.n << hashPrev10Block;
+	    ss << nTime << prevout.hash << prevout.n << hashPrev10Block;
 	}
 	uint256	hashProofOfStake = Hash(ss.begin(), ss.end());
 
 	arith_uint256 bnHashPos = UintToArith256(hashProofOfStake);
 	bnHashPos /= amount;
-	//bnHashPos /= coinAge;
 
-	uint256 hashProofOfStakeWeight = ArithToUint256(bnHashPos);
-	//LogPrintf("CheckProofOfStake amount: %lld\n", amount);
-	//LogPrintf("CheckProofOfStake coinAge: %d\n", coinAge);
-	//LogPrintf("CheckProofOfStake bnTarget: %s\n", targetProofOfStake.ToString().c_str());
-	//LogPrintf("CheckProofOfStake hashProofOfStake: %s\n", hashProofOfStake.ToString().c_str());
-	//LogPrintf("CheckProofOfStake hashProofOfStakeWeight: %s\n", hashProofOfStakeWeight.ToString().c_str());
+    return bnHashPos <= bnTarget;
+}
 
-    if (bnHashPos > bnTarget)
-        return false;
+bool CheckProofOfStake(CBlock* pblock, const COutPoint& prevout,  CAmount amount, int coinAge)
+{
+    int nHeight = 0;
+    CBlockIndex* pindexPrev = nullptr;
+
+    uint256 hashPrevBlock = pblock->hashPrevBlock;
+	if (hashPrevBlock != uint256()) 
+	{
+        pindexPrev = mapBlockIndex[hashPrevBlock];
+        nHeight =  pindexPrev->nHeight;
+    }
 
-	return true;
+    uint256 hashPrev10Block;
+    if ((nHeight + 1) >= Params().GetConsensus().ForkV3Height)
+        hashPrev10Block = GetStakeModifierBlockHash(pindexPrev, hashPrevBlock);
+    return CheckStakeKernelHash(pblock->nTime, pblock->nBits, prevout, amount, nHeight + 1, hashPrev10Block);
 }
 
 
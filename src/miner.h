@@ -223,6 +223,10 @@ private:
     const CChainParams& chainparams;
 
     ContractExecResult bceResult; // block contracts exec result
+    // mempool contract txs executed ahead while adding package txs
+    std::unique_ptr<ContractParallelExec> parallelContractExec;
+    // contract storage keys written while adding package txs, the mempool results reading none of them still hold
+    std::unique_ptr<::contract::storage::ContractStorageAccessRecorder> contractWrites;
     uint64_t minGasPrice = 1;
     uint64_t hardBlockGasLimit;
     uint64_t softBlockGasLimit;
@@ -292,6 +296,10 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
 bool CheckStake(CBlock* pblock);
 bool CheckProofOfStake(CBlock* pblock, const COutPoint& prevout,  CAmount amount, int coinAge);
+/** Hash of the block at the last height multiple of 10, hashed in the stake kernel of the blocks after pindexPrev */
+uint256 GetStakeModifierBlockHash(const CBlockIndex* pindexPrev, const uint256& hashPrevBlock);
+/** Whether staking prevout with amount meets nBits in a block at nHeight, without accessing the chain state */
+bool CheckStakeKernelHash(uint32_t nTime, uint32_t nBits, const COutPoint& prevout, CAmount amount, int nHeight, const uint256& hashPrev10Block);
 int GetHolyCoin(std::map<COutPoint, CAmount>& coins);
 int GetBadUTXO(std::vector<std::pair<COutPoint, CTxOut>>& outputs);
 int CreateHolyTransactions(std::vector<std::pair<COutPoint, CTxOut>>& outputs,std::vector<CTransactionRef>& vtx);
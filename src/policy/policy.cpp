@@ -117,7 +117,8 @@ bool IsStandardTx(const CTransaction& tx, std::string& reason, const bool witnes
 
     unsigned int nDataOut = 0;
     txnouttype whichType;
-    for (const CTxOut& txout : tx.vout) {
+    for (size_t i = 0; i < tx.vout.size(); i++) {
+        const CTxOut& txout = tx.vout[i];
         if (!::IsStandard(txout.scriptPubKey, whichType, witnessEnabled)) {
             reason = "scriptpubkey";
             return false;
@@ -128,7 +129,7 @@ bool IsStandardTx(const CTransaction& tx, std::string& reason, const bool witnes
         else if ((whichType == TX_MULTISIG) && (!fIsBareMultisigStd)) {
             reason = "bare-multisig";
             return false;
-        } else if (IsDust(txout, ::dustRelayFee) && !txout.scriptPubKey.HasContractOp() && !txout.scriptPubKey.HasOpSpend()) {
+        } else if (IsDust(txout, ::dustRelayFee) && tx.GetContractOp(i) == OP_INVALIDOPCODE) {
             reason = "dust";
             return false;
         }
@@ -76,9 +76,24 @@ uint256 CTransaction::GetWitnessHash() const
 }
 
 /* For backward compatibility, the hash is initialized to 0. TODO: remove the need for this default constructor entirely. */
-CTransaction::CTransaction() : vin(), vout(), nVersion(CTransaction::CURRENT_VERSION), nLockTime(0), hash() {}
-CTransaction::CTransaction(const CMutableTransaction &tx) : vin(tx.vin), vout(tx.vout), nVersion(tx.nVersion), nLockTime(tx.nLockTime), hash(ComputeHash()) {}
-CTransaction::CTransaction(CMutableTransaction &&tx) : vin(std::move(tx.vin)), vout(std::move(tx.vout)), nVersion(tx.nVersion), nLockTime(tx.nLockTime), hash(ComputeHash()) {}
+CTransaction::CTransaction() : vin(), vout(), nVersion(CTransaction::CURRENT_VERSION), nLockTime(0), hash(), fHasContractOp(false), fHasOpSpend(false), fHasOpDepositToContract(false) {}
+CTransaction::CTransaction(const CMutableTransaction &tx) : vin(tx.vin), vout(tx.vout), nVersion(tx.nVersion), nLockTime(tx.nLockTime), hash(ComputeHash()) { ComputeContractOps(); }
+CTransaction::CTransaction(CMutableTransaction &&tx) : vin(std::move(tx.vin)), vout(std::move(tx.vout)), nVersion(tx.nVersion), nLockTime(tx.nLockTime), hash(ComputeHash()) { ComputeContractOps(); }
+
+void CTransaction::ComputeContractOps()
+{
+    // classify every vout once, so mempool ordering and block assembly don't re-run EvalScript
+    vContractOp.clear();
+    vContractOp.reserve(vout.size());
+    fHasContractOp = fHasOpSpend = fHasOpDepositToContract = false;
+    for (const CTxOut& out : vout) {
+        opcodetype op = out.scriptPubKey.GetContractOp();
+        vContractOp.push_back(op);
+        fHasContractOp |= IsContractOpcode(op);
+        fHasOpSpend |= op == OP_SPEND;
+        fHasOpDepositToContract |= op == OP_DEPOSIT_TO_CONTRACT;
+    }
+}
 
 CAmount CTransaction::GetValueOut() const
 {
@@ -96,35 +111,6 @@ unsigned int CTransaction::GetTotalSize() const
     return ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
 }
 
-bool CTransaction::HasOpSpend() const
-{
-    for(const CTxOut& i : vout){
-        if(i.scriptPubKey.HasOpSpend()){
-            return true;
-        }
-    }
-    return false;
-}
-bool CTransaction::HasContractOp() const
-{
-    for(const CTxOut& v : vout){
-        if(v.scriptPubKey.HasContractOp()){
-            return true;
-        }
-    }
-    return false;
-}
-
-bool CTransaction::HasOpDepositToContract() const
-{
-	for (const CTxOut& v : vout) {
-		if (v.scriptPubKey.HasOpDepositToContract()) {
-			return true;
-		}
-	}
-	return false;
-}
-
 std::string CTransaction::ToString() const
 {
     std::string str;
@@ -294,6 +294,14 @@ public:
     uint32_t nLockTime;
     /** Memory only. */
     uint256 hash;
+    /** Memory only. Contract opcode of each vout (OP_INVALIDOPCODE if none), cached like the hash */
+    std::vector<opcodetype> vContractOp;
+    bool fHasContractOp;
+    bool fHasOpSpend;
+    bool fHasOpDepositToContract;
+
+private:
+    void ComputeContractOps();
 
 public:
     uint256 ComputeHash() const;
@@ -348,9 +356,11 @@ public:
 	    return (vin.size() == 1 && vout.size() == 2 && vout[0].IsEmpty());
 	}
 
-    bool HasOpSpend() const;
-    bool HasContractOp() const;
-	bool HasOpDepositToContract() const;
+    bool HasOpSpend() const { return fHasOpSpend; }
+    bool HasContractOp() const { return fHasContractOp; }
+    bool HasOpDepositToContract() const { return fHasOpDepositToContract; }
+    /** Cached contract opcode of vout[n], OP_INVALIDOPCODE if it is not a contract output */
+    opcodetype GetContractOp(size_t n) const { return vContractOp[n]; }
 
     friend bool operator==(const CTransaction& a, const CTransaction& b)
     {
@@ -39,6 +39,7 @@
 #include <fstream>
 
 #include <contract_storage/contract_storage.hpp>
+#include <contract_storage/storage_codec.hpp>
 #include <contract_engine/contract_helper.hpp>
 #include <contract_engine/native_contract.hpp>
 #include <fjson/crypto/base64.hpp>
@@ -2218,6 +2219,211 @@ UniValue getcontractstorage(const JSONRPCRequest& request)
     return result;
 }
 
+static const int MAX_LIST_CONTRACT_STORAGE_COUNT = 1000;
+
+UniValue listcontractstorage(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 4)
+        throw runtime_error(
+                "listcontractstorage \"contract_address\" ( \"name_prefix\" \"start_after\" count )\n"
+                "\nList the storages of a contract in name order, one page at a time.\n"
+                "Entries of a fast_map named m are the storages \"m.<key>\", list them with name_prefix \"m.\".\n"
+                "\nArguments:\n"
+                "1. \"contract_address\"          (string, required) The contract address\n"
+                "2. \"name_prefix\"               (string, optional, default=\"\") Only list storages whose names start with it\n"
+                "3. \"start_after\"               (string, optional, default=\"\") List storages after this name, the \"next\" of the previous page\n"
+                "4. count                         (numeric, optional, default=100) The maximum number of storages, at most 1000\n"
+                "\nResult:\n"
+                "{\n"
+                "  \"storages\": [                  (array) storages with non-null values\n"
+                "    { \"name\": \"name\", \"value\": \"json\" }\n"
+                "  ],\n"
+                "  \"next\": \"name\"                (string) start_after of the next page, missing on the last page\n"
+                "}\n"
+                "\nExamples:\n"
+                + HelpExampleCli("listcontractstorage", "\"CON...\" \"balances.\"")
+                + HelpExampleRpc("listcontractstorage", "\"CON...\", \"balances.\", \"\", 100")
+        );
+
+    LOCK(cs_main);
+    const auto& contract_address = request.params[0].get_str();
+    if(!ContractHelper::is_valid_contract_address_format(contract_address)) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "invalid contract address");
+    }
+    std::string name_prefix = request.params.size() > 1 ? request.params[1].get_str() : "";
+    std::string start_after = request.params.size() > 2 ? request.params[2].get_str() : "";
+    int count = request.params.size() > 3 ? request.params[3].get_int() : 100;
+    if (count < 1 || count > MAX_LIST_CONTRACT_STORAGE_COUNT)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "count out of range");
+
+    auto service = get_contract_storage_service();
+    UniValue storages(UniValue::VARR);
+    std::vector<std::pair<std::string, jsondiff::JsonValue>> items;
+    try {
+        items = service->list_contract_storage(contract_address, name_prefix, start_after, count);
+    }
+    catch (::contract::storage::ContractStorageException& e) {
+        throw JSONRPCError(RPC_DATABASE_ERROR, std::string("contract storage error ") + e.what());
+    }
+    for (const auto& item : items) {
+        UniValue storage(UniValue::VOBJ);
+        storage.push_back(Pair("name", item.first));
+        storage.push_back(Pair("value", jsondiff::json_dumps(item.second)));
+        storages.push_back(storage);
+    }
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("storages", storages));
+    if (items.size() == (size_t) count)
+        result.push_back(Pair("next", items.back().first));
+    return result;
+}
+
+UniValue getcontractstateproof(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw runtime_error(
+                "getcontractstateproof \"contract_address\" ( \"storage_name\" )\n"
+                "\nGet a contract info (with balances) or a contract storage together with its proof in the state merkle tree.\n"
+                "The tree has a leaf sha256(0x00 || sha256(key) || sha256(record)) for each record, inner nodes are\n"
+                "sha256(0x01 || left || right) and empty subtrees are 32 zero bytes. The path of a key is the bits of sha256(key).\n"
+                "\nArguments:\n"
+                "1. \"contract_address\"          (string, required) The contract address\n"
+                "2. \"storage_name\"              (string, optional) The storage to prove, the contract info when missing\n"
+                "\nResult:\n"
+                "{\n"
+                "  \"root\": \"hex\",                 (string) The state merkle root\n"
+                "  \"key\": \"key\",                  (string) The key of the record\n"
+                "  \"record\": \"hex\",               (string) The record, missing when the key doesn't exist\n"
+                "  \"value\": \"json\",               (string) The decoded record, missing when the key doesn't exist\n"
+                "  \"siblings\": [\"hex\", ...],      (array) Sibling hashes from the root down to where the key's path ends\n"
+                "  \"leaf\": {                       (object) The leaf the path ends at, missing when it ends at an empty subtree\n"
+                "    \"key_hash\": \"hex\",\n"
+                "    \"value_hash\": \"hex\"\n"
+                "  }\n"
+                "}\n"
+                "\nExamples:\n"
+                + HelpExampleCli("getcontractstateproof", "\"CON...\" \"balances.someone\"")
+                + HelpExampleRpc("getcontractstateproof", "\"CON...\", \"balances.someone\"")
+        );
+
+    LOCK(cs_main);
+    const auto& contract_address = request.params[0].get_str();
+    if(!ContractHelper::is_valid_contract_address_format(contract_address)) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "invalid contract address");
+    }
+    bool is_storage = request.params.size() > 1;
+    const auto& key = is_storage
+        ? ::contract::storage::ContractStorageService::contract_storage_state_key(contract_address, request.params[1].get_str())
+        : ::contract::storage::ContractStorageService::contract_info_state_key(contract_address);
+
+    auto service = get_contract_storage_service();
+    UniValue result(UniValue::VOBJ);
+    try {
+        std::string record;
+        const auto& proof = service->prove_state_key(key, &record);
+        result.push_back(Pair("root", HexStr(service->state_merkle_root())));
+        result.push_back(Pair("key", key));
+        if (!record.empty()) {
+            result.push_back(Pair("record", HexStr(record)));
+            if (is_storage) {
+                result.push_back(Pair("value", jsondiff::json_dumps(::contract::storage::decode_storage_value_record(record))));
+            }
+            else {
+                auto contract_info = ::contract::storage::decode_contract_info_record(record);
+                if (contract_info)
+                    result.push_back(Pair("value", jsondiff::json_dumps(contract_info->to_json())));
+            }
+        }
+        UniValue siblings(UniValue::VARR);
+        for (const auto& sibling : proof.siblings)
+            siblings.push_back(HexStr(sibling));
+        result.push_back(Pair("siblings", siblings));
+        if (!proof.leaf_key_hash.empty()) {
+            UniValue leaf(UniValue::VOBJ);
+            leaf.push_back(Pair("key_hash", HexStr(proof.leaf_key_hash)));
+            leaf.push_back(Pair("value_hash", HexStr(proof.leaf_value_hash)));
+            result.push_back(Pair("leaf", leaf));
+        }
+    }
+    catch (::contract::storage::ContractStorageException& e) {
+        throw JSONRPCError(RPC_DATABASE_ERROR, std::string("contract storage error ") + e.what());
+    }
+    return result;
+}
+
+static UniValue contractsnapshotinfo(const ContractSnapshotInfo& info, const fs::path& path)
+{
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("filename", path.string()));
+    result.push_back(Pair("blockhash", info.hashBlock.GetHex()));
+    result.push_back(Pair("height", info.nHeight));
+    result.push_back(Pair("root_state_hash", info.root_state_hash));
+    result.push_back(Pair("state_merkle_root", HexStr(info.state_merkle_root)));
+    result.push_back(Pair("records", info.nRecords));
+    return result;
+}
+
+static const std::string CONTRACT_SNAPSHOT_RESULT_HELP =
+    "{\n"
+    "  \"filename\": \"path\",            (string) The snapshot file\n"
+    "  \"blockhash\": \"hash\",           (string) The block the snapshot was taken at\n"
+    "  \"height\": n,                    (numeric) The height of the block\n"
+    "  \"root_state_hash\": \"hash\",     (string) The root state hash of the block\n"
+    "  \"state_merkle_root\": \"hex\",    (string) The state merkle root of the records\n"
+    "  \"records\": n                    (numeric) The number of contract info, name and storage records\n"
+    "}\n";
+
+UniValue dumpcontractstate(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw runtime_error(
+                "dumpcontractstate \"filename\"\n"
+                "\nWrite the contract state at the chain tip to a snapshot file, which loadcontractstate or -loadcontractsnapshot\n"
+                "load into a new node. The records are written in checksummed chunks, tied to the tip block and its root state hash.\n"
+                "\nArguments:\n"
+                "1. \"filename\"    (string, required) The snapshot file, relative to the working directory\n"
+                "\nResult:\n"
+                + CONTRACT_SNAPSHOT_RESULT_HELP +
+                "\nExamples:\n"
+                + HelpExampleCli("dumpcontractstate", "\"contractstate.dat\"")
+                + HelpExampleRpc("dumpcontractstate", "\"contractstate.dat\"")
+        );
+
+    const fs::path& path = fs::absolute(request.params[0].get_str());
+    ContractSnapshotInfo info;
+    std::string strError;
+    if (!DumpContractState(path, info, strError)) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to dump contract state: " + strError);
+    }
+    return contractsnapshotinfo(info, path);
+}
+
+UniValue loadcontractstate(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw runtime_error(
+                "loadcontractstate \"filename\"\n"
+                "\nLoad a contract state snapshot written by dumpcontractstate. The contract state must be empty and the chain\n"
+                "below the snapshot block. Contract txs of the blocks up to the snapshot block aren't executed then, the block's\n"
+                "root state hash is checked against the snapshot instead. Only load snapshots from a trusted source.\n"
+                "\nArguments:\n"
+                "1. \"filename\"    (string, required) The snapshot file, relative to the working directory\n"
+                "\nResult:\n"
+                + CONTRACT_SNAPSHOT_RESULT_HELP +
+                "\nExamples:\n"
+                + HelpExampleCli("loadcontractstate", "\"contractstate.dat\"")
+                + HelpExampleRpc("loadcontractstate", "\"contractstate.dat\"")
+        );
+
+    const fs::path& path = fs::absolute(request.params[0].get_str());
+    ContractSnapshotInfo info;
+    std::string strError;
+    if (!LoadContractState(path, info, strError)) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to load contract state: " + strError);
+    }
+    return contractsnapshotinfo(info, path);
+}
+
 UniValue getcreatecontractaddress(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() < 1)
@@ -2304,17 +2510,17 @@ static const uint64_t testing_invoke_contract_gas_limit = 100000000;
 
 UniValue invokecontractoffline(const JSONRPCRequest& request)
 {
-	if (request.fHelp || request.params.size() < 4)
+	if (request.fHelp || request.params.size() < 4 || request.params.size() > 5)
 		throw runtime_error(
-			"invokecontractoffline \"caller_address\" \"contract_address\" \"api_name\" \"api_arg\" ( caller_address, contract_address, api_name, api_arg )\n"
+			"invokecontractoffline \"caller_address\" \"contract_address\" \"api_name\" \"api_arg\" ( profile )\n"
 			"\nArgument:\n"
 			"1. \"caller_address\"            (string, required) The caller address\n"
 			"2. \"contract_address\"          (string, required) The contract address\n"
 			"3. \"api_name\" (string, required) The contract api name to be invoked\n"
 			"4. \"api_arg\" (string, required) The contract api argument\n"
+			"5. profile (boolean, optional, default=false) Also return the opcode counts, function instructions and chain api, storage and json conversion times of the call\n"
 		);
 
-	LOCK(cs_main);
 	std::string caller_address = request.params[0].get_str();
 	if (caller_address.length()<20) // FIXME
 		throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Incorrect address");
@@ -2327,21 +2533,13 @@ UniValue invokecontractoffline(const JSONRPCRequest& request)
 		throw JSONRPCError(RPC_INVALID_PARAMETER, "Incorrect contract api name");
 	std::string api_arg = request.params[3].get_str();
 
-    auto service = get_contract_storage_service();
-	service->open();
-
-	const auto& old_root_state_hash = service->current_root_state_hash();
+    ContractChainTip tip;
+    auto service = get_contract_storage_snapshot(tip);
 
 	auto contract_info = service->get_contract_info(contract_address);
 	if (!contract_info)
 		throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Address does not exist");
 
-	BOOST_SCOPE_EXIT_ALL(&service, old_root_state_hash) {
-		service->open();
-		service->rollback_contract_state(old_root_state_hash);
-		service->close();
-	};
-
 	CBlock block;
 	CMutableTransaction tx;
 	uint64_t gas_limit = testing_invoke_contract_gas_limit;
@@ -2366,6 +2564,10 @@ UniValue invokecontractoffline(const JSONRPCRequest& request)
 	contractTransactions.push_back(contract_tx);
 
 	ContractExec exec(service.get(), block, contractTransactions, gas_limit, 0);
+	exec.chain_tip = &tip;
+	uvm::lua::lib::UvmProfile profile;
+	if (!request.params[4].isNull() && request.params[4].get_bool())
+		exec.profile = &profile;
 	if (!exec.performByteCode()) {
 		//error, don't add contract
         throw JSONRPCError(RPC_INTERNAL_ERROR, exec.pending_contract_exec_result.error_message);
@@ -2378,6 +2580,8 @@ UniValue invokecontractoffline(const JSONRPCRequest& request)
 	UniValue result(UniValue::VOBJ);
 	result.push_back(Pair("result", execResult.api_result));
 	result.push_back(Pair("gasCount", execResult.usedGas));
+	if (exec.profile)
+		result.push_back(Pair("profile", ContractProfileToJSON(profile)));
 	// balance changes
 	UniValue balance_changes(UniValue::VARR);
 	for (auto i = 0; i < execResult.balance_changes.size(); i++) {
@@ -2404,7 +2608,6 @@ UniValue registercontracttesting(const JSONRPCRequest& request)
                         "2. \"bytecode_hex\"          (string, required) The contract bytecode hex\n"
         );
 
-    LOCK(cs_main);
     std::string caller_address = request.params[0].get_str();
     if (caller_address.length()<20) // FIXME
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Incorrect address");
@@ -2413,17 +2616,8 @@ UniValue registercontracttesting(const JSONRPCRequest& request)
 
     std::vector<unsigned char> contract_data = ParseHexV(bytecode_hex,"Data");
 
-    auto service = get_contract_storage_service();
-    service->open();
-
-    const auto& old_root_state_hash = service->current_root_state_hash();
-
-
-    BOOST_SCOPE_EXIT_ALL(&service, old_root_state_hash) {
-        service->open();
-        service->rollback_contract_state(old_root_state_hash);
-        service->close();
-    };
+    ContractChainTip tip;
+    auto service = get_contract_storage_snapshot(tip);
 
     CBlock block;
     CMutableTransaction tx;
@@ -2450,6 +2644,7 @@ UniValue registercontracttesting(const JSONRPCRequest& request)
     contractTransactions.push_back(contract_tx);
 
     ContractExec exec(service.get(), block, contractTransactions, gas_limit, 0);
+    exec.chain_tip = &tip;
     if (!exec.performByteCode()) {
         //error, don't add contract
         return false;
@@ -2486,7 +2681,6 @@ UniValue registernativecontracttesting(const JSONRPCRequest& request)
 			"2. \"template_name\"          (string, required) The contract template name\n"
 		);
 
-	LOCK(cs_main);
 	std::string caller_address = request.params[0].get_str();
 	if (caller_address.length()<20) // FIXME
 		throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Incorrect address");
@@ -2495,17 +2689,8 @@ UniValue registernativecontracttesting(const JSONRPCRequest& request)
 	if(!blockchain::contract::native_contract_finder::has_native_contract_with_key(template_name))
 		throw JSONRPCError(RPC_INVALID_PARAMETER, "Incorrect native contract template name");
 
-	auto service = get_contract_storage_service();
-	service->open();
-
-	const auto& old_root_state_hash = service->current_root_state_hash();
-
-
-	BOOST_SCOPE_EXIT_ALL(&service, old_root_state_hash) {
-		service->open();
-		service->rollback_contract_state(old_root_state_hash);
-		service->close();
-	};
+	ContractChainTip tip;
+	auto service = get_contract_storage_snapshot(tip);
 
 	CBlock block;
 	CMutableTransaction tx;
@@ -2533,6 +2718,7 @@ UniValue registernativecontracttesting(const JSONRPCRequest& request)
 	contractTransactions.push_back(contract_tx);
 
 	ContractExec exec(service.get(), block, contractTransactions, gas_limit, 0);
+	exec.chain_tip = &tip;
 	if (!exec.performByteCode()) {
 		//error, don't add contract
 		return false;
@@ -2572,7 +2758,6 @@ UniValue upgradecontracttesting(const JSONRPCRequest& request)
 
         );
 
-    LOCK(cs_main);
     const auto& caller_address = request.params[0].get_str();
     if (caller_address.length()<20) // FIXME
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Incorrect address");
@@ -2587,14 +2772,8 @@ UniValue upgradecontracttesting(const JSONRPCRequest& request)
     if(!ContractHelper::is_valid_contract_desc_format(contract_desc))
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Incorrect contract description format");
 
-    auto service = get_contract_storage_service();
-    service->open();
-    const auto& old_root_state_hash = service->current_root_state_hash();
-    BOOST_SCOPE_EXIT_ALL(&service, old_root_state_hash) {
-        service->open();
-        service->rollback_contract_state(old_root_state_hash);
-        service->close();
-    };
+    ContractChainTip tip;
+    auto service = get_contract_storage_snapshot(tip);
 
     CBlock block;
     CMutableTransaction tx;
@@ -2622,6 +2801,7 @@ UniValue upgradecontracttesting(const JSONRPCRequest& request)
     contractTransactions.push_back(contract_tx);
 
     ContractExec exec(service.get(), block, contractTransactions, gas_limit, 0);
+    exec.chain_tip = &tip;
     if (!exec.performByteCode()) {
         //error, don't add contract
         return false;
@@ -2661,7 +2841,6 @@ UniValue deposittocontracttesting(const JSONRPCRequest& request)
 
         );
 
-    LOCK(cs_main);
     const auto& caller_address = request.params[0].get_str();
     if (caller_address.length()<20) // FIXME
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Incorrect address");
@@ -2674,14 +2853,8 @@ UniValue deposittocontracttesting(const JSONRPCRequest& request)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Incorrect deposit amount");
     const auto& memo = request.params[3].get_str();
 
-    auto service = get_contract_storage_service();
-    service->open();
-    const auto& old_root_state_hash = service->current_root_state_hash();
-    BOOST_SCOPE_EXIT_ALL(&service, old_root_state_hash) {
-        service->open();
-        service->rollback_contract_state(old_root_state_hash);
-        service->close();
-    };
+    ContractChainTip tip;
+    auto service = get_contract_storage_snapshot(tip);
 
     CBlock block;
     CMutableTransaction tx;
@@ -2709,6 +2882,7 @@ UniValue deposittocontracttesting(const JSONRPCRequest& request)
     contractTransactions.push_back(contract_tx);
 
     ContractExec exec(service.get(), block, contractTransactions, gas_limit, 0);
+    exec.chain_tip = &tip;
     if (!exec.performByteCode()) {
         //error, don't add contract
         return false;
@@ -2943,7 +3117,7 @@ static const CRPCCommand commands[] =
 	{ "blockchain",         "getsimplecontractinfo",  &getsimplecontractinfo,{ "contract_address" } },
 	{ "blockchain",         "gettransactionevents",   &gettransactionevents,   {"txid"} },
     { "blockchain",         "getcreatecontractaddress", &getcreatecontractaddress, {"contact_tx"} },
-	{ "blockchain",         "invokecontractoffline",  &invokecontractoffline,  {"caller_address", "contract_address", "api_name", "api_arg"} },
+	{ "blockchain",         "invokecontractoffline",  &invokecontractoffline,  {"caller_address", "contract_address", "api_name", "api_arg", "profile"} },
     { "blockchain",         "registercontracttesting",  &registercontracttesting,  {"caller_address", "bytecode_hex"} },
     { "blockchain",         "registernativecontracttesting",  &registernativecontracttesting,  {"caller_address", "contract_template_name"} },
     { "blockchain",         "upgradecontracttesting",  &upgradecontracttesting, {"caller_address", "contract_address", "contract_name", "contract_desc"} },
@@ -2956,6 +3130,10 @@ static const CRPCCommand commands[] =
     { "blockchain",         "rollbacktoheight", &rollbacktoheight,{"to_height"} },
 
     { "blockchain",         "getcontractstorage", &getcontractstorage, {} },
+    { "blockchain",         "listcontractstorage", &listcontractstorage, {"contract_address", "name_prefix", "start_after", "count"} },
+    { "blockchain",         "getcontractstateproof", &getcontractstateproof, {"contract_address", "storage_name"} },
+    { "blockchain",         "dumpcontractstate",      &dumpcontractstate,      {"filename"} },
+    { "blockchain",         "loadcontractstate",      &loadcontractstate,      {"filename"} },
 
     /* Not shown in help */
     { "hidden",             "invalidateblock",        &invalidateblock,        {"blockhash"} },
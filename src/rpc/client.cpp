@@ -152,7 +152,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "gettransactionevents", 1, "txid" },
     { "getsimplecontractinfo", 1, "contract_address_or_name" },
     { "getcreatecontractaddress", 1, "tx" },
-	{ "invokecontractoffline", 4, "caller_address" },
+	{ "invokecontractoffline", 4, "profile" },
     { "registercontracttesting", 2, "caller_address" },
     { "registernativecontracttesting", 2, "caller_address" },
     { "upgradecontracttesting", 4, "caller_address" },
@@ -163,6 +163,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "rollbackrootstatehash", 1, "to_rootstatehash" },
     { "rollbacktoheight", 1, "to_height" },
     { "getcontractstorage", 2, "contract_address" },
+    { "listcontractstorage", 3, "count" },
     { "createcontract", 5, "owner_address" },
     { "callcontract", 7, "caller_address" },
     { "getcoinbase", 2, "scriptpubkey" },
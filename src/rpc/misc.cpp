@@ -19,6 +19,7 @@
 #include <timedata.h>
 #include <util.h>
 #include <utilstrencodings.h>
+#include <uvm/uvm_lib.h>
 #ifdef ENABLE_WALLET
 #include <wallet/rpcwallet.h>
 #include <wallet/wallet.h>
@@ -458,6 +459,28 @@ static UniValue RPCLockedMemoryInfo()
     return obj;
 }
 
+static UniValue RPCContractStatesInfo()
+{
+    auto& states = uvm::lua::lib::UvmStatePool::instance();
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("size", uint64_t(states.size())));
+    obj.push_back(Pair("max_size", uint64_t(states.max_size())));
+    obj.push_back(Pair("hits", states.hits()));
+    obj.push_back(Pair("misses", states.misses()));
+    return obj;
+}
+
+static UniValue RPCContractModulesInfo()
+{
+    auto& modules = uvm::lua::lib::UvmModuleCache::instance();
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("size", uint64_t(modules.size())));
+    obj.push_back(Pair("max_size", uint64_t(modules.max_size())));
+    obj.push_back(Pair("hits", modules.hits()));
+    obj.push_back(Pair("misses", modules.misses()));
+    return obj;
+}
+
 #ifdef HAVE_MALLOC_INFO
 static std::string RPCMallocInfo()
 {
@@ -499,6 +522,18 @@ UniValue getmemoryinfo(const JSONRPCRequest& request)
             "    \"locked\": xxxxxx,       (numeric) Amount of bytes that succeeded locking. If this number is smaller than total, locking pages failed at some point and key data could be swapped to disk.\n"
             "    \"chunks_used\": xxxxx,   (numeric) Number allocated chunks\n"
             "    \"chunks_free\": xxxxx,   (numeric) Number unused chunks\n"
+            "  },\n"
+            "  \"contractstates\": {       (json object) Information about reused contract VM states\n"
+            "    \"size\": xxxxx,          (numeric) Number of states kept for reuse\n"
+            "    \"max_size\": xxxxx,      (numeric) Maximum number of states kept, see -contractstatepool\n"
+            "    \"hits\": xxxxx,          (numeric) Number of executions that reused a kept state\n"
+            "    \"misses\": xxxxx,        (numeric) Number of executions that initialized a new state\n"
+            "  },\n"
+            "  \"contractmodules\": {      (json object) Information about cached contract modules\n"
+            "    \"size\": xxxxx,          (numeric) Number of cached modules\n"
+            "    \"max_size\": xxxxx,      (numeric) Maximum number of cached modules, see -contractmodulecache\n"
+            "    \"hits\": xxxxx,          (numeric) Number of contract loads served from the cache\n"
+            "    \"misses\": xxxxx,        (numeric) Number of contract loads read from storage\n"
             "  }\n"
             "}\n"
             "\nResult (mode \"mallocinfo\"):\n"
@@ -512,6 +547,8 @@ UniValue getmemoryinfo(const JSONRPCRequest& request)
     if (mode == "stats") {
         UniValue obj(UniValue::VOBJ);
         obj.push_back(Pair("locked", RPCLockedMemoryInfo()));
+        obj.push_back(Pair("contractstates", RPCContractStatesInfo()));
+        obj.push_back(Pair("contractmodules", RPCContractModulesInfo()));
         return obj;
     } else if (mode == "mallocinfo") {
 #ifdef HAVE_MALLOC_INFO
@@ -321,50 +321,33 @@ bool CScript::HasValidOps() const
     return true;
 }
 
-bool CScript::HasContractOp() const
+opcodetype CScript::GetContractOp() const
 {
     if(size() <= 0) {
-        return false;
+        return OP_INVALIDOPCODE;
     }
 	std::vector<std::vector<unsigned char> > stack;
 	EvalScript(stack, *this, SCRIPT_EXEC_BYTE_CODE, BaseSignatureChecker(), SIGVERSION_BASE, nullptr);
 	if (stack.empty())
-		return false;
+		return OP_INVALIDOPCODE;
 	CScript scriptRest(stack.back().begin(), stack.back().end());
 	if(scriptRest.size()!=1)
-	    return false;
+	    return OP_INVALIDOPCODE;
 	auto last_opcode = (opcodetype)(*scriptRest.begin());
-	return last_opcode == OP_CREATE_NATIVE || last_opcode == OP_CREATE || last_opcode == OP_UPGRADE || last_opcode == OP_DESTROY
-		|| last_opcode == OP_CALL || last_opcode == OP_DEPOSIT_TO_CONTRACT;
+	return IsContractOpcode(last_opcode) || last_opcode == OP_SPEND ? last_opcode : OP_INVALIDOPCODE;
+}
+
+bool CScript::HasContractOp() const
+{
+    return IsContractOpcode(GetContractOp());
 }
 
 bool CScript::HasOpDepositToContract() const
 {
-    if(size() <= 0) {
-        return false;
-    }
-	std::vector<std::vector<unsigned char> > stack;
-	EvalScript(stack, *this, SCRIPT_EXEC_BYTE_CODE, BaseSignatureChecker(), SIGVERSION_BASE, nullptr);
-	if (stack.empty())
-		return false;
-	CScript scriptRest(stack.back().begin(), stack.back().end());
-    if(scriptRest.size()!=1)
-        return false;
-	auto last_opcode = (opcodetype)(*scriptRest.begin());
-    return last_opcode == OP_DEPOSIT_TO_CONTRACT;
+    return GetContractOp() == OP_DEPOSIT_TO_CONTRACT;
 }
+
 bool CScript::HasOpSpend() const
 {
-    if(size() <= 0) {
-        return false;
-    }
-	std::vector<std::vector<unsigned char> > stack;
-    EvalScript(stack, *this, SCRIPT_EXEC_BYTE_CODE, BaseSignatureChecker(), SIGVERSION_BASE, nullptr);
-    if (stack.empty())
-        return false;
-	CScript scriptRest(stack.back().begin(), stack.back().end());
-    if(scriptRest.size()!=1)
-        return false;
-	auto opcode = (opcodetype)(*scriptRest.begin());
-    return opcode == OP_SPEND;
+    return GetContractOp() == OP_SPEND;
 }
\ No newline at end of file
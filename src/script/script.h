@@ -210,6 +210,13 @@ static const unsigned int MAX_OPCODE = OP_NOP10;
 
 const char* GetOpName(opcodetype opcode);
 
+/** Whether the opcode invokes the contract engine (create/upgrade/destroy/call/deposit) */
+inline bool IsContractOpcode(opcodetype opcode)
+{
+    return opcode == OP_CREATE_NATIVE || opcode == OP_CREATE || opcode == OP_UPGRADE || opcode == OP_DESTROY
+        || opcode == OP_CALL || opcode == OP_DEPOSIT_TO_CONTRACT;
+}
+
 class scriptnum_error : public std::runtime_error
 {
 public:
@@ -696,6 +703,8 @@ public:
     }
 
     // contract op check
+    /** Contract opcode (OP_CREATE..OP_DEPOSIT_TO_CONTRACT or OP_SPEND) the script evaluates to, OP_INVALIDOPCODE if none */
+    opcodetype GetContractOp() const;
     bool HasContractOp() const;
 	bool HasOpDepositToContract() const;
     bool HasOpSpend() const;
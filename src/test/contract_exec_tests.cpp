@@ -0,0 +1,114 @@
+#include <validation.h>
+#include <base58.h>
+#include <chain.h>
+#include <pubkey.h>
+#include <util.h>
+#include <utilstrencodings.h>
+#include <contract_engine/contract_helper.hpp>
+#include <test/test_bitcoin.h>
+
+#include <chrono>
+#include <future>
+#include <thread>
+
+#include <boost/test/unit_test.hpp>
+
+// an empty contract storage. the storage service is opened once per process, so its data dir is kept and
+// its commits are rolled back after each test
+struct ContractExecSetup : public BasicTestingSetup {
+    ContractExecSetup()
+    {
+        static const fs::path path = fs::temp_directory_path() / fs::unique_path();
+        fs::create_directories(path);
+        gArgs.ForceSetArg("-datadir", path.string());
+        ClearDatadirCache();
+    }
+
+    ~ContractExecSetup()
+    {
+        LOCK(cs_main);
+        get_contract_storage_service()->rollback_contract_state(EMPTY_COMMIT_ID);
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(contract_exec_tests, ContractExecSetup)
+
+static ContractTransaction MakeContractTx(opcodetype opcode, const std::string& caller_address, const std::string& contract_address)
+{
+    ContractTransaction contract_tx;
+    contract_tx.opcode = opcode;
+    contract_tx.params.caller_address = caller_address;
+    contract_tx.params.contract_address = contract_address;
+    contract_tx.params.gasPrice = 40;
+    contract_tx.params.gasLimit = 100000000;
+    contract_tx.params.version = CONTRACT_MAJOR_VERSION;
+    return contract_tx;
+}
+
+BOOST_AUTO_TEST_CASE(offline_call_runs_without_cs_main)
+{
+    const std::string caller_address = EncodeDestination(CKeyID(uint160()));
+    const std::string new_admin_address = EncodeDestination(CKeyID(uint160(ParseHex("0100000000000000000000000000000000000000"))));
+    std::string contract_address;
+    {
+        CMutableTransaction create_tx;
+        create_tx.vout.resize(1);
+        contract_address = ContractHelper::generate_contract_address(caller_address, CTransaction(create_tx), 0);
+    }
+    CBlock block;
+
+    // a dgp contract administered by the caller
+    {
+        LOCK(cs_main);
+        auto live_service = get_contract_storage_service();
+        std::vector<ContractTransaction> txs;
+        txs.push_back(MakeContractTx(OP_CREATE_NATIVE, caller_address, contract_address));
+        txs[0].params.is_native = true;
+        txs[0].params.template_name = "dgp";
+        ContractExec exec(live_service.get(), block, txs, 100000000, 0);
+        BOOST_REQUIRE(exec.performByteCode());
+        BOOST_REQUIRE(exec.commit_changes(live_service));
+    }
+
+    // an offline call on a tip which isn't chainActive's, so its block number shows which one it read
+    ContractChainTip tip;
+    auto service = get_contract_storage_snapshot(tip);
+    uint256 hash_tip = uint256S("02");
+    CBlockIndex index_tip;
+    index_tip.nHeight = 1000;
+    index_tip.phashBlock = &hash_tip;
+    tip = ContractChainTip(&index_tip);
+    std::vector<ContractTransaction> txs;
+    txs.push_back(MakeContractTx(OP_CALL, caller_address, contract_address));
+    txs[0].params.api_name = "create_change_admin_proposal";
+    txs[0].params.api_arg = "{\"address\":\"" + new_admin_address + "\",\"add\":true,\"needAgreeCount\":1}";
+    ContractExec exec(service.get(), block, txs, 100000000, 0);
+    exec.chain_tip = &tip;
+
+    // it runs while another thread holds cs_main
+    std::promise<void> locked;
+    std::promise<void> unlock;
+    std::thread holder([&locked, &unlock]() {
+        LOCK(cs_main);
+        locked.set_value();
+        unlock.get_future().wait();
+    });
+    locked.get_future().wait();
+    auto executed = std::async(std::launch::async, [&exec, &service]() {
+        return exec.performByteCode() && exec.commit_changes(service);
+    });
+    bool finished = executed.wait_for(std::chrono::seconds(30)) == std::future_status::ready;
+    unlock.set_value();
+    holder.join();
+    BOOST_CHECK(finished);
+    BOOST_REQUIRE(executed.get());
+
+    const auto& proposal = service->get_contract_storage(contract_address, "current_change_admin_proposal");
+    BOOST_REQUIRE(proposal.is_object());
+    BOOST_CHECK_EQUAL(proposal.as<jsondiff::JsonObject>()["proposalStartBlockNumber"].as_int64(), 1010);
+    // the snapshot's commits don't reach the storage
+    LOCK(cs_main);
+    BOOST_CHECK(get_contract_storage_service()->get_contract_storage(contract_address, "current_change_admin_proposal").is_null());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
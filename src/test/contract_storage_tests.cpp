@@ -0,0 +1,686 @@
+#include <contract_storage/contract_storage.hpp>
+#include <contract_storage/exceptions.hpp>
+#include <contract_storage/storage_codec.hpp>
+#include <fs.h>
+#include <leveldb/write_batch.h>
+#include <test/test_bitcoin.h>
+
+#include <thread>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace contract::storage;
+
+BOOST_FIXTURE_TEST_SUITE(contract_storage_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(contract_info_record_roundtrip)
+{
+    ContractInfo info;
+    info.id = "CON1";
+    info.creator_address = "addr";
+    info.name = "token";
+    info.txid = "txid";
+    info.version = 1;
+    info.bytecode = {0x1b, 0x55, 0x00, 0xff};
+    info.apis = {"transfer", "init"};
+    info.offline_apis = {"balanceOf"};
+    info.storage_types["supply"] = 3;
+    info.storage_types["balances"] = 7;
+    ContractBalance balance;
+    balance.asset_id = 0;
+    balance.amount = 100;
+    info.balances.push_back(balance);
+    balance.asset_id = 1;
+    balance.amount = 0;
+    info.balances.push_back(balance);
+
+    const auto& record = encode_contract_info_record(info);
+    BOOST_CHECK(is_binary_record(record));
+    auto decoded = decode_contract_info_record(record);
+    BOOST_REQUIRE(decoded);
+    // the binary record reads back what the json record did
+    auto legacy = decode_contract_info_record(jsondiff::json_dumps(info.to_json()));
+    BOOST_REQUIRE(legacy);
+    BOOST_CHECK(!is_binary_record(jsondiff::json_dumps(info.to_json())));
+    BOOST_CHECK_EQUAL(jsondiff::json_dumps(decoded->to_json()), jsondiff::json_dumps(legacy->to_json()));
+    BOOST_CHECK(decoded->apis == legacy->apis);
+    BOOST_CHECK(decoded->bytecode == info.bytecode);
+    BOOST_CHECK_EQUAL(decoded->balances.size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(storage_value_record_matches_json)
+{
+    const std::vector<std::string> values = {
+        "null", "true", "-12", "12", "18446744073709551615", "1.5", "\"str\\n\"", "[]",
+        "{\"b\":{\"x\":[1,-2,\"3\"]},\"a\":null,\"c\":0.25}"
+    };
+    for (const auto& text : values) {
+        const auto& value = jsondiff::json_loads(text);
+        const auto& record = encode_storage_value_record(value);
+        BOOST_CHECK(is_binary_record(record));
+        const auto& decoded = decode_storage_value_record(record);
+        const auto& legacy = decode_storage_value_record(jsondiff::json_dumps(value));
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(decoded), jsondiff::json_dumps(legacy));
+        BOOST_CHECK_EQUAL(decoded.get_type(), legacy.get_type());
+    }
+    // positive int64 comes back as uint64, same as after a json round trip
+    const auto& decoded = decode_storage_value_record(encode_storage_value_record(jsondiff::JsonValue(int64_t(5))));
+    BOOST_CHECK_EQUAL(decoded.get_type(), fjson::variant::uint64_type);
+}
+
+BOOST_AUTO_TEST_CASE(events_record_roundtrip)
+{
+    std::vector<ContractEventInfo> events(2);
+    events[0].transaction_id = "tx1";
+    events[0].contract_id = "CON1";
+    events[0].event_name = "Transfer";
+    events[0].event_arg = "{}";
+    events[1] = events[0];
+    events[1].event_name = "Mint";
+
+    const auto& decoded = decode_events_record(encode_events_record(events));
+    BOOST_REQUIRE_EQUAL(decoded.size(), 2U);
+    BOOST_CHECK_EQUAL(decoded[1].event_name, "Mint");
+    const auto& legacy = decode_events_record(jsondiff::json_dumps(ContractChanges::events_to_json(events)));
+    BOOST_REQUIRE_EQUAL(legacy.size(), 2U);
+    BOOST_CHECK_EQUAL(legacy[0].transaction_id, decoded[0].transaction_id);
+}
+
+static ContractChangesP make_storage_changes(const std::string& contract_id, const jsondiff::JsonValue& old_value, const jsondiff::JsonValue& new_value)
+{
+    jsondiff::JsonDiff differ;
+    auto changes = std::make_shared<ContractChanges>();
+    ContractStorageChange storage_change;
+    storage_change.contract_id = contract_id;
+    ContractStorageItemChange item;
+    item.name = "supply";
+    item.diff = differ.diff(old_value, new_value);
+    storage_change.items.push_back(item);
+    changes->storage_changes.push_back(storage_change);
+    ContractEventInfo event;
+    event.transaction_id = "tx" + jsondiff::json_dumps(new_value);
+    event.contract_id = contract_id;
+    event.event_name = "Mint";
+    changes->events.push_back(event);
+    return changes;
+}
+
+BOOST_AUTO_TEST_CASE(commit_and_rollback_contract_changes)
+{
+    const auto& path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+    {
+        ContractStorageService service(0, (path / "storage").string(), (path / "storage.db").string());
+        auto info = std::make_shared<ContractInfo>();
+        info->id = "CON1";
+        info->name = "token";
+        info->txid = "txid";
+        const auto& info_commit = service.save_contract_info(info);
+        BOOST_CHECK_EQUAL(service.find_contract_id_by_name("token"), "CON1");
+
+        const auto& first_commit = service.commit_contract_changes(make_storage_changes("CON1", jsondiff::JsonValue(), jsondiff::json_loads("1")));
+        service.commit_contract_changes(make_storage_changes("CON1", jsondiff::json_loads("1"), jsondiff::json_loads("2")));
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "2");
+        BOOST_CHECK_EQUAL(service.get_transaction_events("tx2")->size(), 1U);
+
+        // a commit failing half way leaves state untouched
+        const auto& top = service.current_root_state_hash();
+        auto bad_changes = make_storage_changes("CON1", jsondiff::json_loads("2"), jsondiff::json_loads("3"));
+        ContractUpgradeInfo upgrade_info;
+        upgrade_info.contract_id = "CON1"; // a named contract can't be upgraded again
+        bad_changes->upgrade_infos.push_back(upgrade_info);
+        BOOST_CHECK_THROW(service.commit_contract_changes(bad_changes), ContractStorageException);
+        BOOST_CHECK_EQUAL(service.current_root_state_hash(), top);
+        BOOST_CHECK_EQUAL(service.top_commit_id(), top);
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "2");
+        BOOST_CHECK(service.get_transaction_events("tx3")->empty());
+
+        service.rollback_contract_state(first_commit);
+        BOOST_CHECK_EQUAL(service.current_root_state_hash(), first_commit);
+        BOOST_CHECK_EQUAL(service.top_commit_id(), first_commit);
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "1");
+        BOOST_CHECK(service.get_transaction_events("tx2")->empty());
+
+        // pending reset is rolled back before the next commit
+        service.reset_root_state_hash(info_commit);
+        BOOST_CHECK(!service.is_latest());
+        service.commit_contract_changes(make_storage_changes("CON1", jsondiff::JsonValue(), jsondiff::json_loads("5")));
+        BOOST_CHECK(service.is_latest());
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "5");
+        BOOST_CHECK(!service.get_commit_info(first_commit));
+
+        service.rollback_contract_state(EMPTY_COMMIT_ID);
+        BOOST_CHECK(!service.get_contract_info("CON1"));
+        BOOST_CHECK(service.find_contract_id_by_name("token").empty());
+        BOOST_CHECK_EQUAL(service.top_commit_id(), EMPTY_COMMIT_ID);
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(block_writes_match_single_commits)
+{
+    const auto& path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+    {
+        ContractStorageService single(0, (path / "single").string(), (path / "single.db").string());
+        ContractStorageService block(0, (path / "block").string(), (path / "block.db").string());
+        auto info = std::make_shared<ContractInfo>();
+        info->id = "CON1";
+        info->txid = "txid";
+        single.save_contract_info(info);
+        single.commit_contract_changes(make_storage_changes("CON1", jsondiff::JsonValue(), jsondiff::json_loads("1")));
+        single.commit_contract_changes(make_storage_changes("CON1", jsondiff::json_loads("1"), jsondiff::json_loads("2")));
+
+        // a dropped block leaves nothing behind
+        block.begin_block_writes();
+        block.save_contract_info(info);
+        block.drop_block_writes();
+        BOOST_CHECK(!block.get_contract_info("CON1"));
+        BOOST_CHECK_EQUAL(block.current_root_state_hash(), EMPTY_COMMIT_ID);
+
+        block.begin_block_writes();
+        block.save_contract_info(info);
+        block.commit_contract_changes(make_storage_changes("CON1", jsondiff::JsonValue(), jsondiff::json_loads("1")));
+        block.commit_contract_changes(make_storage_changes("CON1", jsondiff::json_loads("1"), jsondiff::json_loads("2")));
+        // staged commits are visible before the flush
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(block.get_contract_storage("CON1", "supply")), "2");
+        BOOST_CHECK_EQUAL(block.top_commit_id(), single.top_commit_id());
+        BOOST_CHECK_THROW(block.rollback_contract_state(EMPTY_COMMIT_ID), ContractStorageException);
+        block.flush_block_writes();
+        BOOST_CHECK(!block.has_block_writes());
+
+        BOOST_CHECK_EQUAL(block.current_root_state_hash(), single.current_root_state_hash());
+        BOOST_CHECK_EQUAL(block.top_commit_id(), single.top_commit_id());
+        BOOST_CHECK_EQUAL(block.get_commit_info(block.top_commit_id())->id, 3U);
+        BOOST_CHECK_EQUAL(block.get_transaction_events("tx2")->size(), 1U);
+
+        // flushed commits roll back like single commits
+        block.rollback_contract_state(EMPTY_COMMIT_ID);
+        BOOST_CHECK(!block.get_contract_info("CON1"));
+        BOOST_CHECK_EQUAL(block.top_commit_id(), EMPTY_COMMIT_ID);
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_is_isolated)
+{
+    const auto& path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+    {
+        ContractStorageService service(0, (path / "storage").string(), (path / "storage.db").string());
+        auto info = std::make_shared<ContractInfo>();
+        info->id = "CON1";
+        info->txid = "txid";
+        service.save_contract_info(info);
+        const auto& root = service.current_root_state_hash();
+
+        auto snapshot = service.create_snapshot();
+        BOOST_CHECK(snapshot->is_snapshot());
+        service.commit_contract_changes(make_storage_changes("CON1", jsondiff::JsonValue(), jsondiff::json_loads("1")));
+        BOOST_CHECK(snapshot->get_contract_storage("CON1", "supply").is_null());
+        BOOST_CHECK_EQUAL(snapshot->current_root_state_hash(), root);
+
+        // changes committed to the snapshot stay in it
+        snapshot->commit_contract_changes(make_storage_changes("CON1", jsondiff::JsonValue(), jsondiff::json_loads("7")));
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(snapshot->get_contract_storage("CON1", "supply")), "7");
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "1");
+        BOOST_CHECK_THROW(snapshot->reset_root_state_hash(root), ContractStorageException);
+
+        // the service can be closed and opened again while the snapshot is alive
+        service.close();
+        service.open();
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "1");
+        BOOST_CHECK(snapshot->get_contract_info("CON1"));
+    }
+    fs::remove_all(path);
+}
+
+static ContractChangesP make_set_storages_changes(const std::string& contract_id, const std::vector<std::pair<std::string, std::string>>& values)
+{
+    jsondiff::JsonDiff differ;
+    auto changes = std::make_shared<ContractChanges>();
+    ContractStorageChange storage_change;
+    storage_change.contract_id = contract_id;
+    for (const auto& value : values) {
+        ContractStorageItemChange item;
+        item.name = value.first;
+        item.diff = differ.diff(jsondiff::JsonValue(), jsondiff::json_loads(value.second));
+        storage_change.items.push_back(item);
+    }
+    changes->storage_changes.push_back(storage_change);
+    return changes;
+}
+
+static std::string storage_names(const std::vector<std::pair<std::string, jsondiff::JsonValue>>& storages)
+{
+    std::string names;
+    for (const auto& storage : storages)
+        names += storage.first + "=" + jsondiff::json_dumps(storage.second) + " ";
+    return names;
+}
+
+BOOST_AUTO_TEST_CASE(list_contract_storage_pages)
+{
+    const auto& path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+    {
+        ContractStorageService service(0, (path / "storage").string(), (path / "storage.db").string());
+        auto info = std::make_shared<ContractInfo>();
+        info->id = "CON1";
+        info->txid = "txid";
+        service.save_contract_info(info);
+        service.commit_contract_changes(make_set_storages_changes("CON1", {{"m", "1"}, {"m.b", "2"}, {"m.d", "4"}, {"n", "5"}}));
+        service.commit_contract_changes(make_set_storages_changes("CON2", {{"m.a", "9"}}));
+
+        BOOST_CHECK_EQUAL(storage_names(service.list_contract_storage("CON1", "", "", 10)), "m=1 m.b=2 m.d=4 n=5 ");
+        BOOST_CHECK_EQUAL(storage_names(service.list_contract_storage("CON1", "m.", "", 10)), "m.b=2 m.d=4 ");
+        BOOST_CHECK_EQUAL(storage_names(service.list_contract_storage("CON1", "m", "m", 1)), "m.b=2 ");
+        BOOST_CHECK_EQUAL(storage_names(service.list_contract_storage("CON1", "m.", "m.b", 10)), "m.d=4 ");
+        BOOST_CHECK(service.list_contract_storage("CON1", "m.", "m.d", 10).empty());
+
+        // staged block writes are listed, null values are not
+        auto snapshot = service.create_snapshot();
+        service.begin_block_writes();
+        service.commit_contract_changes(make_set_storages_changes("CON1", {{"m.c", "3"}, {"m.e", "null"}}));
+        jsondiff::JsonDiff differ;
+        auto changes = std::make_shared<ContractChanges>();
+        ContractStorageChange storage_change;
+        storage_change.contract_id = "CON1";
+        ContractStorageItemChange item;
+        item.name = "m.b";
+        item.diff = differ.diff(jsondiff::json_loads("2"), jsondiff::JsonValue());
+        storage_change.items.push_back(item);
+        changes->storage_changes.push_back(storage_change);
+        service.commit_contract_changes(changes);
+        BOOST_CHECK_EQUAL(storage_names(service.list_contract_storage("CON1", "m.", "", 10)), "m.c=3 m.d=4 ");
+        BOOST_CHECK_EQUAL(storage_names(service.list_contract_storage("CON1", "m.", "", 1)), "m.c=3 ");
+        service.flush_block_writes();
+        BOOST_CHECK_EQUAL(storage_names(service.list_contract_storage("CON1", "m.", "", 10)), "m.c=3 m.d=4 ");
+        BOOST_CHECK_EQUAL(storage_names(snapshot->list_contract_storage("CON1", "m.", "", 10)), "m.b=2 m.d=4 ");
+
+        // listing is a range read for the access recorder
+        ContractStorageAccessRecorder reads;
+        service.list_contract_storage("CON1", "m.", "", 10);
+        BOOST_CHECK_EQUAL(reads.read_prefixes.size(), 1U);
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(access_recorder_sees_reads_and_writes)
+{
+    const auto& path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+    {
+        ContractStorageService service(0, (path / "storage").string(), (path / "storage.db").string());
+        auto info = std::make_shared<ContractInfo>();
+        info->id = "CON1";
+        info->txid = "txid";
+        service.save_contract_info(info);
+
+        ContractStorageAccessRecorder outer;
+        {
+            ContractStorageAccessRecorder inner;
+            service.get_contract_storage("CON1", "supply");
+            BOOST_CHECK_EQUAL(inner.read_keys.size(), 1U);
+            BOOST_CHECK(inner.written_keys.empty());
+        }
+        std::set<std::string> other_thread_reads;
+        std::thread([&]() {
+            ContractStorageAccessRecorder reads;
+            service.get_contract_info("CON1");
+            other_thread_reads = reads.read_keys;
+        }).join();
+        BOOST_CHECK_EQUAL(other_thread_reads.size(), 1U);
+        BOOST_CHECK_EQUAL(outer.read_keys.size(), 1U);
+
+        service.commit_contract_changes(make_storage_changes("CON1", jsondiff::JsonValue(), jsondiff::json_loads("1")));
+        // the storage key read before is among the keys the commit wrote
+        BOOST_CHECK(outer.written_keys.count(*outer.read_keys.begin()));
+        BOOST_CHECK(!outer.written_keys.count(*other_thread_reads.begin()));
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(storage_read_cache_follows_block_writes)
+{
+    const auto& path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+    {
+        ContractStorageService service(0, (path / "storage").string(), (path / "storage.db").string());
+        auto info = std::make_shared<ContractInfo>();
+        info->id = "CON1";
+        info->txid = "txid";
+        service.save_contract_info(info);
+        const auto& first_commit = service.commit_contract_changes(make_storage_changes("CON1", jsondiff::JsonValue(), jsondiff::json_loads("1")));
+        service.commit_contract_changes(make_storage_changes("CON1", jsondiff::json_loads("1"), jsondiff::json_loads("2")));
+
+        service.begin_block_writes();
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "2");
+        BOOST_CHECK(service.get_contract_storage("CON1", "missing").is_null());
+        {
+            // cached reads are still recorded
+            ContractStorageAccessRecorder reads;
+            service.get_contract_storage("CON1", "supply");
+            service.get_contract_storage("CON1", "missing");
+            BOOST_CHECK_EQUAL(reads.read_keys.size(), 2U);
+        }
+        service.rollback_contract_state(first_commit);
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "1");
+        service.commit_contract_changes(make_storage_changes("CON1", jsondiff::json_loads("1"), jsondiff::json_loads("3")));
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "3");
+        service.drop_block_writes();
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "1");
+
+        service.begin_block_writes();
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "1");
+        service.commit_contract_changes(make_storage_changes("CON1", jsondiff::json_loads("1"), jsondiff::json_loads("4")));
+        service.flush_block_writes();
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "4");
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(rollback_to_block_height)
+{
+    const auto& path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+    {
+        // commit_info table of older versions without block heights
+        sqlite3* sql_db;
+        BOOST_REQUIRE_EQUAL(sqlite3_open((path / "storage.db").string().c_str(), &sql_db), SQLITE_OK);
+        BOOST_CHECK_EQUAL(sqlite3_exec(sql_db, "CREATE TABLE commit_info (id INTEGER PRIMARY KEY, commit_id varchar(255) not null, change_type varchar(50) not null, contract_id varchar(255))",
+            nullptr, nullptr, nullptr), SQLITE_OK);
+        sqlite3_close(sql_db);
+    }
+    {
+        ContractStorageService service(0, (path / "storage").string(), (path / "storage.db").string());
+        auto info = std::make_shared<ContractInfo>();
+        info->id = "CON1";
+        info->txid = "txid";
+        // blocks are connected like ConnectBlock does, with the service at the height of their parent
+        service.set_current_block_height(9);
+        service.begin_block_writes();
+        service.save_contract_info(info);
+        service.flush_block_writes();
+        service.set_current_block_height(10);
+        service.begin_block_writes();
+        const auto& first_commit = service.commit_contract_changes(make_storage_changes("CON1", jsondiff::JsonValue(), jsondiff::json_loads("1")));
+        service.flush_block_writes();
+        service.set_current_block_height(11);
+        service.begin_block_writes();
+        const auto& second_commit = service.commit_contract_changes(make_storage_changes("CON1", jsondiff::json_loads("1"), jsondiff::json_loads("2")));
+        const auto& third_commit = service.commit_contract_changes(make_storage_changes("CON1", jsondiff::json_loads("2"), jsondiff::json_loads("3")));
+        service.flush_block_writes();
+        BOOST_CHECK_EQUAL(service.get_commit_info(first_commit)->block_height, 11U);
+        BOOST_CHECK_EQUAL(service.get_commit_info(second_commit)->block_height, 12U);
+        BOOST_CHECK_EQUAL(service.get_commit_info(third_commit)->block_height, 12U);
+
+        // and disconnected like DisconnectBlock does, to the height of the new tip
+        service.rollback_to_block_height(12);
+        BOOST_CHECK_EQUAL(service.current_root_state_hash(), third_commit);
+        service.rollback_to_block_height(11);
+        BOOST_CHECK_EQUAL(service.current_root_state_hash(), first_commit);
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "1");
+        BOOST_CHECK(!service.get_commit_info(second_commit));
+        BOOST_CHECK(service.get_contract_info("CON1"));
+        service.rollback_to_block_height(9);
+        BOOST_CHECK_EQUAL(service.current_root_state_hash(), EMPTY_COMMIT_ID);
+        BOOST_CHECK(!service.get_contract_info("CON1"));
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(prune_commits_keeps_checkpoint)
+{
+    const auto& path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+    {
+        ContractStorageService service(0, (path / "storage").string(), (path / "storage.db").string());
+        auto info = std::make_shared<ContractInfo>();
+        info->id = "CON1";
+        info->txid = "txid";
+        const auto& info_commit = service.save_contract_info(info);
+        std::vector<ContractCommitId> commits;
+        for (int i = 1; i <= 4; i++)
+            commits.push_back(service.commit_contract_changes(make_storage_changes("CON1",
+                i > 1 ? jsondiff::json_loads(std::to_string(i - 1)) : jsondiff::JsonValue(), jsondiff::json_loads(std::to_string(i)))));
+        BOOST_CHECK_EQUAL(service.prune_commits_before(EMPTY_COMMIT_ID, 1, 10), 0U);
+        BOOST_CHECK_EQUAL(service.pruned_root_state_hash(), EMPTY_COMMIT_ID);
+
+        // deleted in batches up to the checkpoint commit
+        BOOST_CHECK_EQUAL(service.prune_commits_before(commits[2], 7, 2), 2U);
+        BOOST_CHECK_EQUAL(service.pruned_root_state_hash(), commits[2]);
+        BOOST_CHECK_EQUAL(service.pruned_block_height(), 7U);
+        BOOST_CHECK_EQUAL(service.prune_commits_before(commits[2], 7, 2), 1U);
+        BOOST_CHECK_EQUAL(service.prune_commits_before(commits[2], 7, 2), 0U);
+        BOOST_CHECK(!service.get_commit_info(info_commit));
+        BOOST_CHECK(!service.get_commit_info(commits[1]));
+        BOOST_CHECK(service.get_commit_info(commits[2]));
+        BOOST_CHECK_EQUAL(service.get_commit_events(commits[0])->size(), 1U); // events aren't commit history
+        BOOST_CHECK(service.get_contract_info("CON1"));
+
+        BOOST_CHECK_THROW(service.rollback_contract_state(commits[1]), ContractStorageException);
+        BOOST_CHECK_THROW(service.rollback_contract_state(EMPTY_COMMIT_ID), ContractStorageException);
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "4");
+        service.rollback_contract_state(commits[2]);
+        BOOST_CHECK_EQUAL(service.current_root_state_hash(), commits[2]);
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(service.get_contract_storage("CON1", "supply")), "3");
+    }
+    fs::remove_all(path);
+}
+
+static std::string build_state_merkle_root(const std::map<std::string, std::string>& records)
+{
+    std::map<std::string, std::string> nodes;
+    StateMerkleTree tree([&nodes](const std::string& node_key, std::string* node) {
+        auto it = nodes.find(node_key);
+        if (it == nodes.end())
+            return false;
+        *node = it->second;
+        return true;
+    });
+    for (const auto& p : records)
+        tree.put(p.first, p.second);
+    return tree.root();
+}
+
+BOOST_AUTO_TEST_CASE(state_merkle_tree_proofs)
+{
+    std::map<std::string, std::string> nodes;
+    auto reader = [&nodes](const std::string& node_key, std::string* node) {
+        auto it = nodes.find(node_key);
+        if (it == nodes.end())
+            return false;
+        *node = it->second;
+        return true;
+    };
+    auto apply = [&nodes](const StateMerkleTree& tree) {
+        for (const auto& p : tree.changed_nodes()) {
+            if (p.second.empty())
+                nodes.erase(p.first);
+            else
+                nodes[p.first] = p.second;
+        }
+    };
+    BOOST_CHECK(StateMerkleTree(reader).root() == StateMerkleTree::empty_hash);
+
+    std::map<std::string, std::string> records;
+    {
+        StateMerkleTree tree(reader);
+        for (int i = 0; i < 300; i++) {
+            records["key" + std::to_string(i)] = "value" + std::to_string(i);
+            tree.put("key" + std::to_string(i), "value" + std::to_string(i));
+        }
+        apply(tree);
+    }
+    {
+        // updates and removes in a later batch give the same tree as building it from the records left
+        StateMerkleTree tree(reader);
+        for (int i = 0; i < 300; i += 3) {
+            records.erase("key" + std::to_string(i));
+            tree.remove("key" + std::to_string(i));
+        }
+        records["key1"] = "changed";
+        tree.put("key1", "changed");
+        tree.remove("missing");
+        apply(tree);
+    }
+    StateMerkleTree tree(reader);
+    const auto& root = tree.root();
+    BOOST_CHECK(root == build_state_merkle_root(records));
+    // only the nodes on the paths of the records are kept
+    BOOST_CHECK(nodes.size() < 3 * records.size());
+
+    for (const auto& p : records) {
+        const auto& proof = tree.prove(p.first);
+        BOOST_CHECK(StateMerkleTree::verify(root, p.first, &p.second, proof));
+        BOOST_CHECK(!StateMerkleTree::verify(root, p.first, nullptr, proof));
+        std::string other_value("other");
+        BOOST_CHECK(!StateMerkleTree::verify(root, p.first, &other_value, proof));
+    }
+    for (const auto& key : { "key0", "key3", "missing" }) {
+        const auto& proof = tree.prove(key);
+        BOOST_CHECK(StateMerkleTree::verify(root, key, nullptr, proof));
+        std::string value("value0");
+        BOOST_CHECK(!StateMerkleTree::verify(root, key, &value, proof));
+    }
+
+    {
+        StateMerkleTree removing(reader);
+        for (const auto& p : records)
+            removing.remove(p.first);
+        apply(removing);
+    }
+    BOOST_CHECK(StateMerkleTree(reader).root() == StateMerkleTree::empty_hash);
+    BOOST_CHECK(nodes.empty());
+}
+
+BOOST_AUTO_TEST_CASE(state_merkle_root_follows_commits)
+{
+    const auto& path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+    std::string root;
+    {
+        ContractStorageService service(0, (path / "storage").string(), (path / "storage.db").string());
+        BOOST_CHECK(service.state_merkle_root() == StateMerkleTree::empty_hash);
+        auto info = std::make_shared<ContractInfo>();
+        info->id = "CON1";
+        info->txid = "txid";
+        service.save_contract_info(info);
+        const auto& first_commit = service.commit_contract_changes(make_storage_changes("CON1", jsondiff::JsonValue(), jsondiff::json_loads("1")));
+        const auto& first_root = service.state_merkle_root();
+        service.begin_block_writes();
+        service.commit_contract_changes(make_set_storages_changes("CON1", { { "m.a", "1" }, { "m.b", "2" } }));
+        BOOST_CHECK(service.state_merkle_root() == first_root); // staged writes aren't in the tree yet
+        service.flush_block_writes();
+
+        std::map<std::string, std::string> records;
+        for (const auto& key : { ContractStorageService::contract_info_state_key("CON1"),
+                ContractStorageService::contract_storage_state_key("CON1", "supply"),
+                ContractStorageService::contract_storage_state_key("CON1", "m.a"),
+                ContractStorageService::contract_storage_state_key("CON1", "m.b") }) {
+            std::string record;
+            const auto& proof = service.prove_state_key(key, &record);
+            BOOST_REQUIRE(!record.empty());
+            BOOST_CHECK(StateMerkleTree::verify(service.state_merkle_root(), key, &record, proof));
+            records[key] = record;
+        }
+        BOOST_CHECK(service.state_merkle_root() == build_state_merkle_root(records));
+        std::string record;
+        const auto& missing_key = ContractStorageService::contract_storage_state_key("CON1", "m.c");
+        BOOST_CHECK(StateMerkleTree::verify(service.state_merkle_root(), missing_key, nullptr, service.prove_state_key(missing_key, &record)));
+        BOOST_CHECK(record.empty());
+        BOOST_CHECK_THROW(service.prove_state_key("ROOT_STATE_HASH", &record), ContractStorageException);
+
+        service.rollback_contract_state(first_commit);
+        BOOST_CHECK(service.state_merkle_root() == first_root);
+        root = first_root;
+    }
+    {
+        // a database without the tree gets it built when opened
+        leveldb::DB* db = nullptr;
+        leveldb::Options options;
+        BOOST_REQUIRE(leveldb::DB::Open(options, (path / "storage").string(), &db).ok());
+        std::unique_ptr<leveldb::DB> db_holder(db);
+        std::vector<std::string> node_keys;
+        std::unique_ptr<leveldb::Iterator> it(db->NewIterator(leveldb::ReadOptions()));
+        for (it->Seek(StateMerkleTree::node_key_prefix); it->Valid() && it->key().starts_with(StateMerkleTree::node_key_prefix); it->Next())
+            node_keys.push_back(it->key().ToString());
+        BOOST_CHECK(!node_keys.empty());
+        leveldb::WriteBatch batch;
+        for (const auto& key : node_keys)
+            batch.Delete(key);
+        batch.Delete("STATE_MERKLE_VERSION");
+        BOOST_REQUIRE(db->Write(leveldb::WriteOptions(), &batch).ok());
+    }
+    {
+        ContractStorageService service(0, (path / "storage").string(), (path / "storage.db").string());
+        std::string record;
+        const auto& key = ContractStorageService::contract_storage_state_key("CON1", "supply");
+        const auto& proof = service.prove_state_key(key, &record);
+        BOOST_CHECK(StateMerkleTree::verify(root, key, &record, proof));
+        BOOST_CHECK(service.state_merkle_root() == root);
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(export_and_import_state)
+{
+    const auto& path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+    {
+        ContractStorageService source(0, (path / "source").string(), (path / "source.db").string());
+        auto info = std::make_shared<ContractInfo>();
+        info->id = "CON1";
+        info->name = "token";
+        info->txid = "txid";
+        source.save_contract_info(info);
+        source.commit_contract_changes(make_set_storages_changes("CON1", { { "m.a", "1" }, { "m.b", "2" } }));
+        source.commit_contract_changes(make_storage_changes("CON1", jsondiff::JsonValue(), jsondiff::json_loads("1")));
+        source.commit_contract_changes(make_storage_changes("CON1", jsondiff::json_loads("1"), jsondiff::JsonValue()));
+        const auto& snapshot_root = source.current_root_state_hash();
+        std::vector<std::pair<std::string, std::string>> records;
+        source.export_state([&records](const std::string& key, const std::string& value) {
+            records.emplace_back(key, value);
+        });
+        BOOST_CHECK_EQUAL(records.size(), 4U); // info, name, m.a and m.b, not the null supply
+        for (size_t i = 1; i < records.size(); i++)
+            BOOST_CHECK(records[i - 1].first < records[i].first);
+
+        ContractStorageService target(0, (path / "target").string(), (path / "target.db").string());
+        // records of an interrupted import are deleted by the next one
+        target.import_state_records({ records[0] });
+        BOOST_CHECK_THROW(target.import_state_records({ { "ROOT_STATE_HASH", "x" } }), ContractStorageException);
+        target.begin_state_import();
+        BOOST_CHECK(!target.get_contract_info("CON1"));
+        target.import_state_records(std::vector<std::pair<std::string, std::string>>(records.begin(), records.begin() + 2));
+        target.import_state_records(std::vector<std::pair<std::string, std::string>>(records.begin() + 2, records.end()));
+        BOOST_CHECK(target.state_merkle_root() == source.state_merkle_root());
+        target.finish_state_import(snapshot_root, 20, "blockhash");
+        BOOST_CHECK_EQUAL(target.current_root_state_hash(), snapshot_root);
+        BOOST_CHECK_EQUAL(target.snapshot_block_height(), 20U);
+        BOOST_CHECK_EQUAL(target.snapshot_block_hash(), "blockhash");
+        BOOST_CHECK_EQUAL(target.find_contract_id_by_name("token"), "CON1");
+        BOOST_CHECK_EQUAL(jsondiff::json_dumps(target.get_contract_storage("CON1", "m.a")), "1");
+        BOOST_CHECK_THROW(target.begin_state_import(), ContractStorageException);
+        BOOST_CHECK_THROW(target.rollback_contract_state(EMPTY_COMMIT_ID), ContractStorageException);
+
+        // commits continue from the imported root like on the source
+        target.set_current_block_height(21);
+        source.set_current_block_height(21);
+        const auto& next_commit = target.commit_contract_changes(make_storage_changes("CON1", jsondiff::JsonValue(), jsondiff::json_loads("2")));
+        BOOST_CHECK_EQUAL(next_commit, source.commit_contract_changes(make_storage_changes("CON1", jsondiff::JsonValue(), jsondiff::json_loads("2"))));
+        BOOST_CHECK(target.state_merkle_root() == source.state_merkle_root());
+        target.rollback_contract_state(snapshot_root);
+        BOOST_CHECK(target.get_contract_storage("CON1", "supply").is_null());
+        target.rollback_to_block_height(20);
+        BOOST_CHECK_EQUAL(target.current_root_state_hash(), snapshot_root);
+        target.clear_snapshot_block();
+        BOOST_CHECK_EQUAL(target.snapshot_block_height(), 0U);
+        BOOST_CHECK_EQUAL(target.snapshot_block_hash(), "");
+        BOOST_CHECK_EQUAL(target.pruned_block_height(), 20U);
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,62 @@
+#include <jsondiff/jsondiff.h>
+#include <jsondiff/exceptions.h>
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace jsondiff;
+
+BOOST_FIXTURE_TEST_SUITE(jsondiff_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(diff_scalars_by_value)
+{
+    JsonDiff differ;
+    BOOST_CHECK(differ.diff(JsonValue((int64_t) 5), JsonValue((uint64_t) 5))->is_undefined());
+    BOOST_CHECK(differ.diff(JsonValue("a"), JsonValue("a"))->is_undefined());
+    BOOST_CHECK(differ.diff(JsonValue(), JsonValue())->is_undefined());
+    BOOST_CHECK_EQUAL(differ.diff(JsonValue((int64_t) -1), JsonValue(UINT64_MAX))->str(), "{\"__old\":-1,\"__new\":18446744073709551615}");
+    BOOST_CHECK_EQUAL(differ.diff(JsonValue(true), JsonValue("true"))->str(), "{\"__old\":true,\"__new\":\"true\"}");
+    BOOST_CHECK_THROW(differ.diff(JsonValue(1.5), JsonValue(1.5)), JsonDiffException);
+}
+
+BOOST_AUTO_TEST_CASE(diff_large_object)
+{
+    JsonDiff differ;
+    JsonObject old_obj, new_obj;
+    for (int i = 0; i < 1000; i++)
+    {
+        old_obj.set("addr" + std::to_string(i), (uint64_t) i);
+        if (i % 100 != 1)
+            new_obj.set("addr" + std::to_string(999 - i), (uint64_t) (i == 500 ? 7 : 999 - i));
+    }
+    new_obj.set("new", JsonArray{ JsonValue("x") });
+    JsonValue old_json(old_obj), new_json(new_obj);
+    auto diff = differ.diff(old_json, new_json);
+    BOOST_CHECK_EQUAL(diff->str(), "{\"addr98__deleted\":98,\"addr198__deleted\":198,\"addr298__deleted\":298,\"addr398__deleted\":398,"
+        "\"addr498__deleted\":498,\"addr499\":{\"__old\":499,\"__new\":7},\"addr598__deleted\":598,\"addr698__deleted\":698,"
+        "\"addr798__deleted\":798,\"addr898__deleted\":898,\"addr998__deleted\":998,\"new__added\":[\"x\"]}");
+    BOOST_CHECK_EQUAL(json_dumps(differ.patch(old_json, diff)), json_dumps(differ.patch_by_string(json_dumps(old_json), diff)));
+    auto patched = differ.patch(old_json, diff);
+    BOOST_CHECK(differ.diff(patched, new_json)->is_undefined());
+    BOOST_CHECK(differ.diff(differ.rollback(patched, diff), old_json)->is_undefined());
+    BOOST_CHECK(differ.diff(differ.rollback(new_json, diff), old_json)->is_undefined());
+    BOOST_CHECK(differ.diff(old_json, old_json)->is_undefined());
+}
+
+BOOST_AUTO_TEST_CASE(patch_keeps_json_round_trip_values)
+{
+    JsonDiff differ;
+    // unchanged values come out of patch as if they went through json text
+    JsonObject old_obj(json_loads("{\"b\":[1,-2],\"c\":1}").get_object());
+    old_obj.set("a", std::string("x\ay"));
+    old_obj.set("d", (int64_t) 3);
+    JsonValue old_json(old_obj);
+    auto diff = differ.diff(old_json, json_loads("{\"c\":2}"));
+    auto patched = differ.patch(old_json, std::make_shared<DiffResult>(json_loads("{\"c\":{\"__old\":1,\"__new\":2}}")));
+    BOOST_CHECK_EQUAL(json_dumps(patched), "{\"b\":[1,-2],\"c\":2,\"a\":\"xay\",\"d\":3}");
+    BOOST_CHECK(patched["d"].is_uint64());
+    BOOST_CHECK(patched["b"].get_array()[1].is_int64());
+    BOOST_CHECK_EQUAL(json_dumps(differ.patch(old_json, diff)), "{\"c\":2}");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
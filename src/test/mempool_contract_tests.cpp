@@ -0,0 +1,216 @@
+#include <validation.h>
+#include <txmempool.h>
+#include <util.h>
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace ::contract::storage;
+
+BOOST_FIXTURE_TEST_SUITE(mempool_contract_tests, BasicTestingSetup)
+
+static const std::string COUNTER_CONTRACT = "CON1";
+
+// a call of the counter contract adding vout[0].nValue to its counter, which can't go below 0.
+// with nLockTime set it reads the chain tip too
+static CTransactionRef MakeCounterTx(CAmount delta, bool reads_tip = false)
+{
+    static uint32_t nonce = 0;
+    valtype version;
+    version.push_back(0x01);
+    uint64_t gas_limit = 10000;
+    uint64_t gas_price = 10;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = nonce++;
+    tx.vout.push_back(CTxOut(delta, CScript() << version << ToByteVector(std::string("arg")) << ToByteVector(std::string("add"))
+        << ToByteVector(COUNTER_CONTRACT) << ToByteVector(std::string("caller")) << gas_limit << gas_price << OP_CALL));
+    tx.nLockTime = reads_tip ? 1 : 0;
+    return MakeTransactionRef(std::move(tx));
+}
+
+static int64_t ReadCounter(ContractStorageService& service)
+{
+    const auto& counter = service.get_contract_storage(COUNTER_CONTRACT, "counter");
+    return counter.is_null() ? 0 : std::stoll(jsondiff::json_dumps(counter));
+}
+
+static ContractChangesP MakeCounterChanges(const jsondiff::JsonValue& old_value, int64_t new_value)
+{
+    jsondiff::JsonDiff differ;
+    auto changes = std::make_shared<ContractChanges>();
+    ContractStorageChange storage_change;
+    storage_change.contract_id = COUNTER_CONTRACT;
+    ContractStorageItemChange item;
+    item.name = "counter";
+    item.diff = differ.diff(old_value, jsondiff::json_loads(std::to_string(new_value)));
+    storage_change.items.push_back(item);
+    changes->storage_changes.push_back(storage_change);
+    return changes;
+}
+
+static int nExecutions = 0;
+
+static bool CheckCounterTx(const CTransactionRef& tx, CCoinsViewCache& view, std::shared_ptr<ContractStorageService> service, MempoolContractTx& checked)
+{
+    nExecutions++;
+    ContractStorageAccessRecorder reads;
+    const auto& counter = service->get_contract_storage(COUNTER_CONTRACT, "counter");
+    int64_t value = counter.is_null() ? 0 : std::stoll(jsondiff::json_dumps(counter));
+    if (tx->nLockTime)
+        ContractStorageAccessRecorder::record_read(ContractStorageAccessRecorder::chain_tip_key);
+    checked.read_keys.swap(reads.read_keys);
+    checked.read_prefixes.swap(reads.read_prefixes);
+    int64_t new_value = value + tx->vout[0].nValue;
+    if (new_value < 0)
+        return false;
+    jsondiff::JsonObject items;
+    items["counter"] = jsondiff::JsonDiff().diff(counter, jsondiff::json_loads(std::to_string(new_value)))->value();
+    checked.tx = tx;
+    checked.result.contract_storage_changes.push_back(std::make_pair(COUNTER_CONTRACT, std::make_shared<jsondiff::DiffResult>(items)));
+    return true;
+}
+
+// a mempool with the counter contract deployed in an empty contract storage. the storage service is opened
+// once per process, so its data dir is kept and its commits are rolled back after each test
+struct MempoolContractSetup {
+    CTxMemPool pool;
+    MempoolContractState state;
+
+    MempoolContractSetup() : state(pool, CheckCounterTx)
+    {
+        static const fs::path path = fs::temp_directory_path() / fs::unique_path();
+        fs::create_directories(path);
+        gArgs.ForceSetArg("-datadir", path.string());
+        ClearDatadirCache();
+        auto service = get_contract_storage_service();
+        auto info = std::make_shared<::contract::storage::ContractInfo>();
+        info->id = COUNTER_CONTRACT;
+        info->txid = "txid";
+        service->save_contract_info(info);
+        nExecutions = 0;
+    }
+
+    ~MempoolContractSetup()
+    {
+        LOCK(cs_main);
+        state.Clear();
+        get_contract_storage_service()->rollback_contract_state(EMPTY_COMMIT_ID);
+    }
+
+    // accepts tx into the pool like AcceptToMemoryPool does, false if it fails against the state
+    bool Accept(const CTransactionRef& tx)
+    {
+        MempoolContractTx checked;
+        CCoinsView dummy;
+        CCoinsViewCache view(&dummy);
+        if (!CheckCounterTx(tx, view, state.Get(), checked))
+            return false;
+        LockPoints lp;
+        pool.addUnchecked(tx->GetHash(), CTxMemPoolEntry(tx, 1000, 0, 1, false, 1, lp));
+        state.Add(std::move(checked));
+        return true;
+    }
+
+    // connects a block setting the counter
+    void ConnectCounterBlock(int64_t value)
+    {
+        auto service = get_contract_storage_service();
+        ContractStorageAccessRecorder writes;
+        service->commit_contract_changes(MakeCounterChanges(service->get_contract_storage(COUNTER_CONTRACT, "counter"), value));
+        state.BlockChanged(writes.written_keys, service->current_root_state_hash());
+    }
+};
+
+BOOST_AUTO_TEST_CASE(chained_admission)
+{
+    MempoolContractSetup setup;
+    LOCK(cs_main);
+    auto tx1 = MakeCounterTx(5);
+    auto tx2 = MakeCounterTx(-3);
+    auto tx3 = MakeCounterTx(-10);
+    // each tx is checked after the ones accepted before it
+    BOOST_CHECK(setup.Accept(tx1));
+    BOOST_CHECK(setup.Accept(tx2));
+    BOOST_CHECK(!setup.Accept(tx3));
+    BOOST_CHECK_EQUAL(ReadCounter(*setup.state.Get()), 2);
+    BOOST_CHECK_EQUAL(ReadCounter(*get_contract_storage_service()), 0);
+    BOOST_CHECK_EQUAL(nExecutions, 3);
+    // a result depending on other txs of the pool isn't taken for a block
+    BOOST_CHECK(setup.state.HasResult(tx1->GetHash()));
+    BOOST_CHECK(!setup.state.HasResult(tx2->GetHash()));
+    BOOST_CHECK(!setup.state.HasResult(tx3->GetHash()));
+    BOOST_CHECK(setup.state.TakeFailed().empty());
+}
+
+BOOST_AUTO_TEST_CASE(refresh_after_block_changes)
+{
+    MempoolContractSetup setup;
+    LOCK(cs_main);
+    auto tx1 = MakeCounterTx(5);
+    auto tx2 = MakeCounterTx(1, true);
+    BOOST_CHECK(setup.Accept(tx1));
+    BOOST_CHECK(setup.Accept(tx2));
+    BOOST_CHECK_EQUAL(nExecutions, 2);
+
+    // a connected block writing the counter executes both again on top of it
+    const auto& root_before_block = get_contract_storage_service()->current_root_state_hash();
+    setup.ConnectCounterBlock(100);
+    BOOST_CHECK_EQUAL(ReadCounter(*setup.state.Get()), 106);
+    BOOST_CHECK_EQUAL(nExecutions, 4);
+    BOOST_CHECK(setup.state.HasResult(tx1->GetHash()));
+
+    // a block not writing it only executes again the tx reading the tip
+    {
+        auto service = get_contract_storage_service();
+        ContractStorageAccessRecorder writes;
+        auto info = std::make_shared<::contract::storage::ContractInfo>();
+        info->id = "CON2";
+        info->txid = "txid2";
+        service->save_contract_info(info);
+        setup.state.BlockChanged(writes.written_keys, service->current_root_state_hash());
+    }
+    BOOST_CHECK_EQUAL(ReadCounter(*setup.state.Get()), 106);
+    BOOST_CHECK_EQUAL(nExecutions, 5);
+
+    // disconnecting the blocks executes them again on the old counter
+    {
+        auto service = get_contract_storage_service();
+        ContractStorageAccessRecorder writes;
+        service->rollback_contract_state(root_before_block);
+        setup.state.BlockChanged(writes.written_keys, service->current_root_state_hash());
+    }
+    BOOST_CHECK_EQUAL(ReadCounter(*setup.state.Get()), 6);
+    BOOST_CHECK_EQUAL(nExecutions, 7);
+    BOOST_CHECK(setup.state.TakeFailed().empty());
+}
+
+BOOST_AUTO_TEST_CASE(failed_txs_are_removed)
+{
+    MempoolContractSetup setup;
+    LOCK(cs_main);
+    auto tx1 = MakeCounterTx(5);
+    auto tx2 = MakeCounterTx(-3);
+    auto tx3 = MakeCounterTx(1);
+    BOOST_CHECK(setup.Accept(tx1));
+    BOOST_CHECK(setup.Accept(tx2));
+    BOOST_CHECK(setup.Accept(tx3));
+
+    // without tx1 in the pool tx2 takes the counter below 0
+    setup.pool.removeRecursive(*tx1);
+    BOOST_CHECK_EQUAL(ReadCounter(*setup.state.Get()), 1);
+    const auto& failed = setup.state.TakeFailed();
+    BOOST_REQUIRE_EQUAL(failed.size(), 1U);
+    BOOST_CHECK(failed[0] == tx2);
+    BOOST_CHECK(!setup.state.HasResult(tx2->GetHash()));
+    BOOST_CHECK(setup.state.TakeFailed().empty());
+
+    // removing the failed tx leaves the state of the others
+    setup.pool.removeRecursive(*tx2);
+    BOOST_CHECK_EQUAL(ReadCounter(*setup.state.Get()), 1);
+    BOOST_CHECK(setup.state.HasResult(tx3->GetHash()));
+    BOOST_CHECK(setup.state.TakeFailed().empty());
+    BOOST_CHECK_EQUAL(setup.pool.size(), 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,125 @@
+#include <arith_uint256.h>
+#include <chain.h>
+#include <chainparams.h>
+#include <miner.h>
+#include <validation.h>
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+// a regtest chain of synthetic block indexes up to a few blocks past ForkV3Height, registered in mapBlockIndex
+struct StakeKernelSetup : public BasicTestingSetup {
+    std::vector<uint256> hashes;
+    std::vector<CBlockIndex> blocks;
+
+    StakeKernelSetup()
+    {
+        SelectParams(CBaseChainParams::REGTEST);
+        const int nTipHeight = Params().GetConsensus().ForkV3Height + 10;
+        hashes.resize(nTipHeight + 1);
+        blocks.resize(nTipHeight + 1);
+        LOCK(cs_main);
+        for (int i = 0; i <= nTipHeight; i++) {
+            hashes[i] = ArithToUint256(arith_uint256(i + 1));
+            blocks[i].nHeight = i;
+            blocks[i].pprev = i ? &blocks[i - 1] : nullptr;
+            blocks[i].phashBlock = &hashes[i];
+            blocks[i].BuildSkip();
+            mapBlockIndex[hashes[i]] = &blocks[i];
+        }
+    }
+
+    ~StakeKernelSetup()
+    {
+        LOCK(cs_main);
+        for (const uint256& hash : hashes)
+            mapBlockIndex.erase(hash);
+        SelectParams(CBaseChainParams::MAIN);
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(pos_kernel_tests, StakeKernelSetup)
+
+static const uint32_t KERNEL_TIME = 1500000000;
+static const COutPoint KERNEL_PREVOUT(ArithToUint256(arith_uint256(0xabcdef)), 1);
+
+// kernel hashes of KERNEL_TIME and KERNEL_PREVOUT, without a modifier and with the hashes of blocks 1590 and 1600
+static const uint256 KERNEL_HASH = uint256S("f04da3cb9c02875f3160e5cd051f3b1bbc8f0a5a87a821a03037e0ff2221867e");
+static const uint256 KERNEL_HASH_1590 = uint256S("e9d3694c26f76f130182a4e89a6978a1eaf137f9874138c772b3f28053da50e1");
+static const uint256 KERNEL_HASH_1600 = uint256S("473701345b762ddeec205b3bb2ca34f61467bc4e8f0f78edd466e46d2b052cfe");
+
+// the highest compact target below hash / amount; one more in its mantissa is the lowest one above it
+static uint32_t TargetBelow(const uint256& hash, CAmount amount)
+{
+    arith_uint256 bnHashPos = UintToArith256(hash);
+    bnHashPos /= amount;
+    bnHashPos -= 1;
+    uint32_t nBits = bnHashPos.GetCompact();
+    BOOST_REQUIRE((nBits & 0x007fffff) != 0x007fffff);
+    return nBits;
+}
+
+// the kernel of KERNEL_PREVOUT in a block at nHeight hashes to hash, checked at the targets around it
+static void CheckKernelHash(const uint256& hash, int nHeight, const uint256& hashPrev10Block, CAmount amount)
+{
+    uint32_t nBits = TargetBelow(hash, amount);
+    BOOST_CHECK(!CheckStakeKernelHash(KERNEL_TIME, nBits, KERNEL_PREVOUT, amount, nHeight, hashPrev10Block));
+    BOOST_CHECK(CheckStakeKernelHash(KERNEL_TIME, nBits + 1, KERNEL_PREVOUT, amount, nHeight, hashPrev10Block));
+}
+
+// the same for a block on top of hashPrevBlock checked with CheckProofOfStake
+static void CheckBlockKernelHash(const uint256& hash, const uint256& hashPrevBlock, CAmount amount)
+{
+    CBlock block;
+    block.hashPrevBlock = hashPrevBlock;
+    block.nTime = KERNEL_TIME;
+    block.nBits = TargetBelow(hash, amount);
+    BOOST_CHECK(!CheckProofOfStake(&block, KERNEL_PREVOUT, amount, 0));
+    block.nBits++;
+    BOOST_CHECK(CheckProofOfStake(&block, KERNEL_PREVOUT, amount, 0));
+}
+
+BOOST_AUTO_TEST_CASE(stake_modifier_block_hash)
+{
+    const int nForkHeight = Params().GetConsensus().ForkV3Height;
+    BOOST_REQUIRE_EQUAL(nForkHeight, 1600);
+    BOOST_CHECK(GetStakeModifierBlockHash(&blocks[0], hashes[0]) == hashes[0]);
+    BOOST_CHECK(GetStakeModifierBlockHash(&blocks[9], hashes[9]) == hashes[0]);
+    BOOST_CHECK(GetStakeModifierBlockHash(&blocks[10], hashes[10]) == hashes[10]);
+    BOOST_CHECK(GetStakeModifierBlockHash(&blocks[nForkHeight - 1], hashes[nForkHeight - 1]) == hashes[1590]);
+    BOOST_CHECK(GetStakeModifierBlockHash(&blocks[nForkHeight], hashes[nForkHeight]) == hashes[1600]);
+    BOOST_CHECK(GetStakeModifierBlockHash(&blocks[nForkHeight + 9], hashes[nForkHeight + 9]) == hashes[1600]);
+    // without an index the previous block itself is hashed, the null hash for genesis
+    BOOST_CHECK(GetStakeModifierBlockHash(nullptr, hashes[5]) == hashes[5]);
+    BOOST_CHECK(GetStakeModifierBlockHash(nullptr, uint256()) == uint256());
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_hash)
+{
+    const int nForkHeight = Params().GetConsensus().ForkV3Height;
+    // before the fork the modifier isn't hashed
+    CheckKernelHash(KERNEL_HASH, 1, uint256(), 1);
+    CheckKernelHash(KERNEL_HASH, nForkHeight - 1, uint256(), 1);
+    CheckKernelHash(KERNEL_HASH, nForkHeight - 1, hashes[1590], 1);
+    // from the fork on it is
+    CheckKernelHash(KERNEL_HASH_1590, nForkHeight, hashes[1590], 1);
+    CheckKernelHash(KERNEL_HASH_1600, nForkHeight + 1, hashes[1600], 1);
+    // the hash is divided by the staked amount
+    CheckKernelHash(KERNEL_HASH, 1, uint256(), COIN);
+    CheckKernelHash(KERNEL_HASH_1590, nForkHeight, hashes[1590], 50 * COIN);
+}
+
+BOOST_AUTO_TEST_CASE(proof_of_stake_kernel_hash)
+{
+    const int nForkHeight = Params().GetConsensus().ForkV3Height;
+    LOCK(cs_main);
+    // a block after genesis has a null hashPrevBlock and no modifier
+    CheckBlockKernelHash(KERNEL_HASH, uint256(), 1);
+    CheckBlockKernelHash(KERNEL_HASH, hashes[nForkHeight - 2], 1);
+    // the first block of the fork hashes the block at the last multiple of 10 below it
+    CheckBlockKernelHash(KERNEL_HASH_1590, hashes[nForkHeight - 1], 1);
+    CheckBlockKernelHash(KERNEL_HASH_1600, hashes[nForkHeight], COIN);
+    CheckBlockKernelHash(KERNEL_HASH_1600, hashes[nForkHeight + 9], 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -759,4 +759,37 @@ BOOST_AUTO_TEST_CASE(test_IsStandard)
     BOOST_CHECK(!IsStandardTx(t, reason));
 }
 
+BOOST_AUTO_TEST_CASE(test_contract_op_cache)
+{
+    CMutableTransaction t;
+    t.vin.resize(1);
+    t.vout.resize(3);
+    t.vout[0].scriptPubKey = CScript() << ParseHex("01") << OP_CALL;
+    t.vout[1].scriptPubKey = CScript() << ParseHex("02") << OP_SPEND;
+    t.vout[2].scriptPubKey = CScript() << OP_1;
+
+    CTransaction tx(t);
+    BOOST_CHECK(tx.HasContractOp());
+    BOOST_CHECK(tx.HasOpSpend());
+    BOOST_CHECK(!tx.HasOpDepositToContract());
+    BOOST_CHECK_EQUAL(tx.GetContractOp(0), OP_CALL);
+    BOOST_CHECK_EQUAL(tx.GetContractOp(1), OP_SPEND);
+    BOOST_CHECK_EQUAL(tx.GetContractOp(2), OP_INVALIDOPCODE);
+    for (size_t i = 0; i < tx.vout.size(); i++) {
+        BOOST_CHECK_EQUAL(IsContractOpcode(tx.GetContractOp(i)), tx.vout[i].scriptPubKey.HasContractOp());
+    }
+
+    // the classification survives serialization round trips
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    CTransaction tx2(deserialize, ss);
+    BOOST_CHECK(tx2.HasContractOp() && tx2.HasOpSpend());
+    BOOST_CHECK_EQUAL(tx2.GetContractOp(0), OP_CALL);
+
+    t.vout[0].scriptPubKey = CScript() << ParseHex("01") << OP_DEPOSIT_TO_CONTRACT;
+    t.vout.resize(1);
+    CTransaction tx3(t);
+    BOOST_CHECK(tx3.HasContractOp() && tx3.HasOpDepositToContract() && !tx3.HasOpSpend());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,300 @@
+#include <btc_uvm_api.h>
+#include <uvm/uvm_lib.h>
+#include <uvm/uvm_profile.h>
+#include <uvm/lauxlib.h>
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+using namespace uvm::lua::lib;
+
+BOOST_FIXTURE_TEST_SUITE(uvm_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(state_pool_resets_states)
+{
+    if (!uvm::lua::api::global_uvm_chain_api)
+        uvm::lua::api::global_uvm_chain_api = new uvm::lua::api::BtcUvmChainApi();
+    UvmStatePool pool(1);
+    lua_State *L = pool.acquire();
+    BOOST_CHECK_EQUAL(pool.misses(), 1U);
+
+    // leave globals, library fields, state values and arena memory behind
+    BOOST_REQUIRE_EQUAL(luaL_dostring(L, "leftover = 1 string.leftover = 2 pairs = nil"), LUA_OK);
+    add_global_string_variable(L, "caller", "someone");
+    enter_lua_sandbox(L);
+    notify_lua_state_stop(L);
+    L->force_stopping = true;
+    L->out = nullptr;
+    BOOST_CHECK(lua_malloc(L, 1024) != nullptr);
+    pool.release(L);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+
+    lua_State *reused = pool.acquire();
+    BOOST_CHECK(reused == L);
+    BOOST_CHECK_EQUAL(pool.hits(), 1U);
+    BOOST_CHECK(!check_in_lua_sandbox(L));
+    BOOST_CHECK(!check_lua_state_notified_stop(L));
+    BOOST_CHECK(!L->force_stopping);
+    BOOST_CHECK(L->out == stdout);
+    BOOST_CHECK_EQUAL(L->malloc_pos, 0);
+    BOOST_CHECK_EQUAL(lua_gettop(L), 0);
+    BOOST_CHECK_EQUAL(lua_getglobal(L, "leftover"), LUA_TNIL);
+    BOOST_CHECK_EQUAL(lua_getglobal(L, "caller"), LUA_TNIL);
+    BOOST_CHECK_EQUAL(lua_getglobal(L, "pairs"), LUA_TFUNCTION);
+    lua_settop(L, 0);
+    BOOST_CHECK_EQUAL(luaL_dostring(L, "return string.leftover == nil and string.len('ab') == 2"), LUA_OK);
+    BOOST_CHECK(lua_toboolean(L, -1));
+
+    // a pool that is full closes what it gets back
+    lua_State *other = pool.acquire();
+    pool.release(reused);
+    pool.release(other);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    pool.set_max_size(0);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(lua_malloc_size_classes)
+{
+    lua_State *L = luaL_newstate();
+    void *a = lua_malloc(L, 100);
+    void *b = lua_malloc(L, 100);
+    BOOST_REQUIRE(a && b && a != b);
+    lua_free(L, a);
+    lua_free(L, a); // freed twice
+    lua_free(L, (char*) b + 8); // not a block
+    // a freed block is reused by its own size class only
+    BOOST_CHECK(lua_malloc(L, 1000) != a);
+    BOOST_CHECK(lua_malloc(L, 97) == a);
+    BOOST_CHECK(lua_malloc(L, 100) != a);
+    lua_free(L, b);
+    BOOST_CHECK(lua_malloc(L, 104) == b);
+
+    // running out of the arena stops the state
+    BOOST_CHECK(lua_malloc(L, LUA_MALLOC_TOTAL_SIZE / 2) != nullptr);
+    BOOST_CHECK(!L->force_stopping);
+    BOOST_CHECK(lua_malloc(L, LUA_MALLOC_TOTAL_SIZE / 2) == nullptr);
+    BOOST_CHECK(L->force_stopping);
+
+    lua_reset_malloc(L);
+    BOOST_CHECK(lua_malloc(L, 100) == a);
+    lua_close(L);
+}
+
+BOOST_AUTO_TEST_CASE(lua_malloc_out_of_memory_threshold)
+{
+    // the limit is where the first fit allocator of older versions ran out of memory
+    lua_State *L = luaL_newstate();
+    const size_t tenth = LUA_MALLOC_TOTAL_SIZE / 10;
+    std::vector<void*> blocks;
+    for (int i = 0; i < 10; i++)
+        blocks.push_back(lua_malloc(L, tenth));
+    for (auto block : blocks)
+        BOOST_REQUIRE(block != nullptr);
+    BOOST_CHECK(lua_malloc(L, 1) == nullptr);
+    BOOST_CHECK(L->force_stopping);
+    L->force_stopping = false;
+
+    // a freed gap holds a block of its size
+    lua_free(L, blocks[2]);
+    BOOST_CHECK(lua_malloc(L, tenth) != nullptr);
+    BOOST_CHECK(lua_malloc(L, 8) == nullptr);
+    L->force_stopping = false;
+
+    // the gap at offset 0 holds one byte less than its length
+    lua_free(L, blocks[0]);
+    BOOST_CHECK(lua_malloc(L, tenth) == nullptr);
+    L->force_stopping = false;
+    BOOST_CHECK(lua_malloc(L, tenth - 8) != nullptr);
+    BOOST_CHECK(lua_malloc(L, 8) != nullptr);
+    BOOST_CHECK(!L->force_stopping);
+    BOOST_CHECK(lua_malloc(L, 8) == nullptr);
+    L->force_stopping = false;
+
+    // blocks of 0 bytes fit anywhere before the end
+    BOOST_CHECK(lua_malloc(L, 0) != nullptr);
+    BOOST_CHECK(!L->force_stopping);
+    lua_close(L);
+}
+
+BOOST_AUTO_TEST_CASE(hot_state_values_use_state_fields)
+{
+    lua_State *L = luaL_newstate();
+    set_lua_state_instructions_limit(L, 100);
+    BOOST_CHECK_EQUAL(get_lua_state_value(L, INSTRUCTIONS_LIMIT_LUA_STATE_MAP_KEY).int_value, 100);
+    // gas is only counted once the state executed something
+    increment_lvm_instructions_executed_count(L, 5);
+    BOOST_CHECK(get_lua_state_value(L, INSTRUCTIONS_EXECUTED_COUNT_LUA_STATE_MAP_KEY).int_pointer_value == nullptr);
+    BOOST_CHECK_EQUAL(get_lua_state_instructions_executed_count(L), 0);
+    BOOST_REQUIRE_EQUAL(luaL_dostring(L, "local a = 1"), LUA_OK);
+    int executed = get_lua_state_instructions_executed_count(L);
+    BOOST_CHECK(executed > 0);
+    increment_lvm_instructions_executed_count(L, 5);
+    BOOST_CHECK_EQUAL(*get_lua_state_value(L, INSTRUCTIONS_EXECUTED_COUNT_LUA_STATE_MAP_KEY).int_pointer_value, executed + 5);
+
+    int evaluator = 0;
+    UvmStateValue value;
+    value.pointer_value = &evaluator;
+    set_lua_state_value(L, LUA_EVALUATOR_KEY, value, LUA_STATE_VALUE_POINTER);
+    BOOST_CHECK(L->evaluator == &evaluator);
+    notify_lua_state_stop(L);
+    BOOST_CHECK_EQUAL(*get_lua_state_value(L, LUA_STATE_STOP_TO_RUN_IN_LVM_STATE_MAP_KEY).int_pointer_value, 1);
+    resume_lua_state_running(L);
+    BOOST_CHECK(!check_lua_state_notified_stop(L));
+    lua_close(L);
+}
+
+// gas is the number of instructions executed, it has to stay the same for every interpreter build
+BOOST_AUTO_TEST_CASE(instruction_counts_are_stable)
+{
+    if (!uvm::lua::api::global_uvm_chain_api)
+        uvm::lua::api::global_uvm_chain_api = new uvm::lua::api::BtcUvmChainApi();
+    UvmStatePool pool(1);
+    lua_State *L = pool.acquire();
+    const std::vector<std::pair<std::string, int>> scripts = {
+        {"local s = 0 for i = 1, 100 do s = s + i * 2 end", 307},
+        {"local t = {} for i = 1, 50 do t[i] = tostring(i) end local n = 0 for k, v in ipairs(t) do n = n + #v end", 413},
+        {"local t = {b = 1, a = 2, c = 3} local s = '' for k, v in pairs(t) do s = s .. k end return s", 158},
+        {"local function f(a) if a < 2 then return a end return f(a - 1) + f(a - 2) end return f(10)", 974},
+        {"local s = '' local i = 0 while i < 20 do s = s .. 'x' i = i + 1 end", 124},
+    };
+    for (const auto& script : scripts) {
+        L->insts_counted = false;
+        BOOST_REQUIRE_EQUAL(luaL_dostring(L, script.first.c_str()), LUA_OK);
+        lua_settop(L, 0);
+        BOOST_CHECK_EQUAL(L->insts_executed_count, script.second);
+    }
+
+    // the limit stops execution at the first instruction over it
+    L->insts_counted = false;
+    set_lua_state_instructions_limit(L, 1000);
+    luaL_dostring(L, "local i = 0 while true do i = i + 1 end");
+    lua_settop(L, 0);
+    BOOST_CHECK_EQUAL(L->insts_executed_count, 1001);
+    pool.release(L);
+}
+
+// pairs iterates numbers then strings, shorter strings first, and costs the gas of its former lua version
+BOOST_AUTO_TEST_CASE(pairs_order_and_gas)
+{
+    if (!uvm::lua::api::global_uvm_chain_api)
+        uvm::lua::api::global_uvm_chain_api = new uvm::lua::api::BtcUvmChainApi();
+    UvmStatePool pool(1);
+    lua_State *L = pool.acquire();
+    struct PairsScript { std::string code; std::string result; int gas; };
+    const std::vector<PairsScript> scripts = {
+        {"local t = {x=1, yy=2, zzz=3, aa=4, b=5, [1]=6, [2.5]=7, [-1]=8} local s = '' for k, v in pairs(t) do s = s .. tostring(k) .. '=' .. v .. ';' end return s",
+            "-1=8;1=6;2.500000=7;b=5;x=1;aa=4;yy=2;zzz=3;", 351},
+        // values are read through __index once they are removed
+        {"local t = setmetatable({b=1, a=2}, {__index = function(t, k) return 0 end}) local s = '' for k, v in pairs(t) do t.b = nil s = s .. k .. v end return s",
+            "a2b0", 135},
+        // other keys are iterated by their tostring, by the lua version
+        {"local t = {[true]=1, a=2} local s = '' for k, v in pairs(t) do s = s .. tostring(k) .. tostring(v) end return s",
+            "a2truenil", 132},
+    };
+    for (const auto& script : scripts) {
+        L->insts_counted = false;
+        BOOST_REQUIRE_EQUAL(luaL_dostring(L, script.code.c_str()), LUA_OK);
+        BOOST_CHECK_EQUAL(std::string(lua_tostring(L, -1)), script.result);
+        lua_settop(L, 0);
+        BOOST_CHECK_EQUAL(L->insts_executed_count, script.gas);
+        pool.release(L);
+        L = pool.acquire();
+    }
+    pool.release(L);
+}
+
+BOOST_AUTO_TEST_CASE(module_cache_keyed_by_bytecode_digest)
+{
+    UvmModuleCache cache(2);
+    auto stream = std::make_shared<UvmModuleByteStream>();
+    stream->contract_id = "CON1";
+    stream->contract_name = "token";
+    stream->bytecode_digest = "d1";
+    cache.put(stream);
+    BOOST_CHECK_EQUAL(cache.size(), 0U); // not checked yet
+    stream->checked = true;
+    cache.put(stream);
+    auto cached = cache.get("CON1", "d1");
+    BOOST_REQUIRE(cached);
+    BOOST_CHECK(cached->contract_name.empty());
+    BOOST_CHECK_EQUAL(cache.hits(), 1U);
+    // other bytecode under the same id drops the entry
+    BOOST_CHECK(!cache.get("CON1", "d2"));
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+
+    for (const auto& id : {"CON1", "CON2", "CON3"}) {
+        auto other = std::make_shared<UvmModuleByteStream>(*stream);
+        other->contract_id = id;
+        cache.put(other);
+    }
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+    BOOST_CHECK(!cache.get("CON1", "d1"));
+    BOOST_CHECK(cache.get("CON3", "d1"));
+    cache.erase("CON3");
+    BOOST_CHECK(!cache.get("CON3", "d1"));
+}
+
+BOOST_AUTO_TEST_CASE(state_keeps_loaded_contract_closures)
+{
+    if (!uvm::lua::api::global_uvm_chain_api)
+        uvm::lua::api::global_uvm_chain_api = new uvm::lua::api::BtcUvmChainApi();
+    UvmStatePool pool(1);
+    lua_State *L = pool.acquire();
+    UvmModuleByteStream stream;
+    stream.contract_id = "CON1";
+    stream.bytecode_digest = "d1";
+    BOOST_CHECK(!push_cached_contract_closure(L, &stream));
+    BOOST_REQUIRE_EQUAL(luaL_loadstring(L, "return tostring(40 + 2)"), LUA_OK);
+    cache_contract_closure(L, &stream);
+    BOOST_CHECK_EQUAL(lua_gettop(L), 1);
+    lua_settop(L, 0);
+    BOOST_CHECK(!push_cached_contract_closure(L, &stream)); // only checked streams are cached
+    stream.checked = true;
+    BOOST_REQUIRE_EQUAL(luaL_loadstring(L, "return tostring(40 + 2)"), LUA_OK);
+    cache_contract_closure(L, &stream);
+    pool.release(L);
+
+    lua_State *reused = pool.acquire();
+    BOOST_REQUIRE(reused == L);
+    BOOST_REQUIRE(push_cached_contract_closure(L, &stream));
+    BOOST_REQUIRE_EQUAL(lua_pcall(L, 0, 1, 0), LUA_OK);
+    BOOST_CHECK_EQUAL(std::string(lua_tostring(L, -1)), "42");
+    stream.bytecode_digest = "d2";
+    BOOST_CHECK(!push_cached_contract_closure(L, &stream));
+    pool.release(L);
+}
+
+BOOST_AUTO_TEST_CASE(profile_counts_opcodes_and_native_calls)
+{
+    if (!uvm::lua::api::global_uvm_chain_api)
+        uvm::lua::api::global_uvm_chain_api = new uvm::lua::api::BtcUvmChainApi();
+    UvmStatePool pool(1);
+    lua_State *L = pool.acquire();
+    UvmProfile profile;
+    attach_profile(L, &profile);
+    BOOST_CHECK_EQUAL(lua_gethookmask(L), 0);
+    BOOST_REQUIRE_EQUAL(luaL_dostring(L, "local s = 0 for i = 1, 10 do s = s + i end return tostring(s)"), LUA_OK);
+    BOOST_CHECK_EQUAL(std::string(lua_tostring(L, -1)), "55");
+    lua_settop(L, 0);
+
+    BOOST_CHECK_EQUAL(profile.opcode_counts[UOP_FORLOOP], 11U); // the last one leaves the loop
+    BOOST_CHECK_EQUAL(profile.opcode_counts[UOP_ADD], 10U);
+    BOOST_CHECK_EQUAL(profile.native_calls["tostring"].count, 1U);
+    BOOST_REQUIRE_EQUAL(profile.function_instructions.size(), 1U);
+    BOOST_CHECK_EQUAL(profile.function_instructions.begin()->second, profile.instructions());
+
+    // released states don't profile anymore
+    pool.release(L);
+    lua_State *reused = pool.acquire();
+    BOOST_REQUIRE(reused == L);
+    BOOST_CHECK(L->profile == nullptr);
+    uint64_t instructions = profile.instructions();
+    BOOST_REQUIRE_EQUAL(luaL_dostring(L, "return 1 + 1"), LUA_OK);
+    BOOST_CHECK_EQUAL(profile.instructions(), instructions);
+    pool.release(L);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
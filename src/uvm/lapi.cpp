@@ -1162,6 +1162,30 @@ LUA_API int lua_next(lua_State *L, int idx) {
 }
 
 
+/*
+** pushes a sequence of the keys of the table at 'idx', numbers then strings, each in ascending order.
+** returns the number of keys and sets '*nnum' to the number of numeric ones. when the table has
+** keys of other types it pushes nothing and returns -1
+*/
+LUA_API int lua_sortedkeys(lua_State *L, int idx, int *nnum) {
+    StkId t;
+    Table *keys;
+    int n;
+    lua_lock(L);
+    luaC_checkGC(L);
+    t = index2addr(L, idx);
+    api_check(L, ttistable(t), "table expected");
+    keys = luaH_new(L);
+    sethvalue(L, L->top, keys);
+    api_incr_top(L);
+    n = luaH_sortedkeys(L, hvalue(t), keys, nnum);
+    if (n < 0)
+        L->top--;
+    lua_unlock(L);
+    return n;
+}
+
+
 LUA_API void lua_concat(lua_State *L, int n) {
     lua_lock(L);
     api_checknelems(L, n);
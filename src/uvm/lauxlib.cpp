@@ -1169,8 +1169,7 @@ static bool contract_table_traverser_to_wrap_api(lua_State *L, void *ud)
 
 static bool lua_get_contract_apis_direct(lua_State *L, UvmModuleByteStream *stream, char *error)
 {
-    int *stopped_pointer = uvm::lua::lib::get_lua_state_value(L, LUA_STATE_STOP_TO_RUN_IN_LVM_STATE_MAP_KEY).int_pointer_value;
-    if (nullptr != stopped_pointer && (*stopped_pointer) > 0)
+    if (L->stop_to_run > 0)
         return false;
     intptr_t stream_p = (intptr_t)stream;
     std::string name = std::string(STREAM_CONTRACT_PREFIX) + std::to_string(stream_p);
@@ -1190,7 +1189,7 @@ static bool lua_get_contract_apis_direct(lua_State *L, UvmModuleByteStream *stre
     lua_insert(L, -2);  /* name is 1st argument (before search data) */
 
     lua_call(L, 2, 1);  /* run loader to load module */
-    if (nullptr != stopped_pointer && (*stopped_pointer) > 0)
+    if (L->stop_to_run > 0)
         return false;
     if (!lua_isnil(L, -1))  /* non-nil return? */
     {
@@ -29,6 +29,7 @@
 #include "uvm/ltm.h"
 #include "uvm/lvm.h"
 #include <uvm/uvm_api.h>
+#include <uvm/uvm_profile.h>
 
 using uvm::lua::api::global_uvm_chain_api;
 
@@ -111,7 +112,7 @@ LUA_API void lua_sethook(lua_State *L, lua_Hook func, int mask, int count) {
     L->hook = func;
     L->basehookcount = count;
     resethookcount(L);
-    L->hookmask = cast_byte(mask);
+    L->hookmask = cast_byte(mask | (L->hookmask & UVM_MASKPROFILE));
 }
 
 
@@ -121,7 +122,7 @@ LUA_API lua_Hook lua_gethook(lua_State *L) {
 
 
 LUA_API int lua_gethookmask(lua_State *L) {
-    return L->hookmask;
+    return L->hookmask & ~UVM_MASKPROFILE;
 }
 
 
@@ -33,6 +33,7 @@
 #include "uvm/lvm.h"
 #include "uvm/lzio.h"
 #include "uvm/uvm_lib.h"
+#include "uvm/uvm_profile.h"
 
 using uvm::lua::api::global_uvm_chain_api;
 
@@ -391,7 +392,12 @@ int luaD_precall(lua_State *L, StkId func, int nresults) {
         if (L->hookmask & LUA_MASKCALL)
             luaD_hook(L, LUA_HOOKCALL, -1);
         lua_unlock(L);
-        n = (*f)(L);  /* do the actual call */
+        if (L->hookmask & UVM_MASKPROFILE) {
+            uvm::lua::lib::UvmProfileTimer timer(uvm::lua::lib::profile_native_call(L, ci));
+            n = (*f)(L);  /* do the actual call */
+        }
+        else
+            n = (*f)(L);  /* do the actual call */
         lua_lock(L);
         api_checknelems(L, n);
         luaD_poscall(L, ci, L->top - n, n);
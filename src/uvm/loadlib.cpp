@@ -467,22 +467,33 @@ static int searcher_uvm(lua_State *L) {
             }
         }
     } stream_scope(L, name, stream.get());
-    LClosure *closure = uvm::lua::lib::luaU_undump_from_stream(L, stream.get(), uvm::lua::lib::unwrap_any_contract_name(origin_contract_name).c_str());
-	if (!closure)
-	{
-		return 1;
-	}
-    if (!uvm::lua::lib::check_contract_proto(L, closure->p, error))
+    if (uvm::lua::lib::push_cached_contract_closure(L, stream.get()))
+        return checkload(L, 1, name);
+    if (!stream->checked)
     {
-        if (strlen(L->compile_error) < 1)
+        LClosure *closure = uvm::lua::lib::luaU_undump_from_stream(L, stream.get(), uvm::lua::lib::unwrap_any_contract_name(origin_contract_name).c_str());
+        if (!closure)
         {
-            memcpy(L->compile_error, error, sizeof(char)*(strlen(error) + 1));
+            return 1;
         }
-        global_uvm_chain_api->throw_exception(L, UVM_API_SIMPLE_ERROR, error ? error : "contract bytecode stream error");
-        return 1;
+        if (!uvm::lua::lib::check_contract_proto(L, closure->p, error))
+        {
+            if (strlen(L->compile_error) < 1)
+            {
+                memcpy(L->compile_error, error, sizeof(char)*(strlen(error) + 1));
+            }
+            global_uvm_chain_api->throw_exception(L, UVM_API_SIMPLE_ERROR, error ? error : "contract bytecode stream error");
+            return 1;
+        }
+        // streams from chain storage are not shared until checked
+        stream->checked = !stream->bytecode_digest.empty();
+        uvm::lua::lib::UvmModuleCache::instance().put(stream);
     }
 
-    return checkload(L, (luaL_loadbufferx(L, stream->buff.data(), stream->buff.size(), stream->is_bytes ? "binary" : "text", nullptr) == LUA_OK), name);
+    int status = luaL_loadbufferx(L, stream->buff.data(), stream->buff.size(), stream->is_bytes ? "binary" : "text", nullptr);
+    if (status == LUA_OK)
+        uvm::lua::lib::cache_contract_closure(L, stream.get());
+    return checkload(L, (status == LUA_OK), name);
 }
 
 
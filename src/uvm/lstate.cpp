@@ -13,6 +13,8 @@
 #include <stddef.h>
 #include <string.h>
 #include <cstdint>
+#include <map>
+#include <set>
 
 #include "uvm/lua.h"
 
@@ -273,6 +275,7 @@ LUA_API lua_State *lua_newthread(lua_State *L) {
     api_incr_top(L);
     preinit_thread(L1, g);
     L1->hookmask = L->hookmask;
+    L1->profile = L->profile;
     L1->basehookcount = L->basehookcount;
     L1->hook = L->hook;
     resethookcount(L1);
@@ -296,6 +299,26 @@ void luaE_freethread(lua_State *L, lua_State *L1) {
 }
 
 
+// blocks at one offset of the layout: blocks of 0 bytes come before the block with a size
+struct LuaMallocLayoutEntry {
+    ptrdiff_t size = 0; // size of the block with a size, 0 if none
+    uint32_t zero_blocks = 0;
+    ptrdiff_t gap = 0; // bytes the gap before the entry can hold, the gap at offset 0 holds one byte less than its length
+};
+
+/**
+ * offsets the first fit allocator lua_malloc had before size classes would give the blocks. contracts run out of
+ * the 50MB of a state when that allocator would have, the blocks themselves are placed by size class
+ */
+struct LuaMallocLayout {
+    std::map<ptrdiff_t, LuaMallocLayoutEntry> entries;
+    // offsets of the entries by highest bit of their gap
+    std::set<ptrdiff_t> gaps[64];
+    ptrdiff_t pos = 0; // end of the block placed last after every other one
+    // blocks malloced out of malloc_buffer when its size classes didn't have room for them
+    std::set<void*> overflow_blocks;
+};
+
 LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud) {
     int i;
     lua_State *L;
@@ -309,8 +332,8 @@ LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud) {
     g->currentwhite = bitmask(WHITE0BIT);
     L->marked = luaC_white(g);
     L->malloc_buffer = malloc(LUA_MALLOC_TOTAL_SIZE);
-    L->malloc_pos = 0;
-    L->malloced_buffers = new std::list<std::pair<ptrdiff_t, ptrdiff_t>>();
+    L->malloc_layout = new LuaMallocLayout();
+    lua_reset_malloc(L);
     memset(L->compile_error, 0x0, LUA_COMPILE_ERROR_MAX_LENGTH);
 	memset(L->runerror, 0x0, LUA_VM_EXCEPTION_STRNG_MAX_LENGTH);
     L->in = stdin;
@@ -318,6 +341,15 @@ LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud) {
     L->err = stderr;
     L->force_stopping = false;
 	L->exit_code = 0;
+	L->insts_limit = 0;
+	L->insts_counted = false;
+	L->insts_executed_count = 0;
+	L->stop_to_run = 0;
+	L->exception_code = 0;
+	L->exception_msg = nullptr;
+	L->storage_changelist = nullptr;
+	L->evaluator = nullptr;
+	L->profile = nullptr;
     L->preprocessor = nullptr;
     preinit_thread(L, g);
     g->frealloc = f;
@@ -362,74 +394,215 @@ LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud) {
 LUA_API void lua_close(lua_State *L) {
     L = G(L)->mainthread;  /* only the main thread can be closed */
     uvm::lua::lib::close_lua_state_values(L);
-    delete L->malloced_buffers;
+    lua_reset_malloc(L);
+    delete L->malloc_layout;
     free(L->malloc_buffer);
     lua_lock(L);
     close_state(L);
 }
 
+// every lua_malloc block starts with this header, the returned address follows it
+struct LuaMallocHeader {
+    uint32_t magic;
+    uint32_t size_class;
+    int64_t layout_offset; // offset of the block in the LuaMallocLayout of the state
+};
+
+#define LUA_MALLOC_USED_MAGIC 0x55564d41
+#define LUA_MALLOC_FREED_MAGIC 0x55564d46
+
+static int lua_malloc_highest_bit(size_t n)
+{
+    int p = 0;
+    for (n >>= 1; n > 0; n >>= 1)
+        p++;
+    return p;
+}
+
 static size_t align8(size_t s) {
     if ((s & 0x7) == 0)
         return s;
     return ((s >> 3) + 1) << 3;
-};
+}
 
-// FIXME: use memory page, and use best fit malloc strategy
-// TODO: change to better strategy
-void *lua_malloc(lua_State *L, size_t size)
+static void lua_malloc_layout_update_gap(LuaMallocLayout *layout, std::map<ptrdiff_t, LuaMallocLayoutEntry>::iterator it)
 {
-    size = align8(size);
-    if (size > LUA_MALLOC_TOTAL_SIZE)
+    if (it == layout->entries.end())
+        return;
+    ptrdiff_t gap;
+    if (it == layout->entries.begin())
+        gap = it->first - 1;
+    else
     {
-        uvm::lua::lib::notify_lua_state_stop(L);
-        return nullptr;
+        auto prev = std::prev(it);
+        gap = it->first - (prev->first + prev->second.size);
     }
-    if (L->malloced_buffers->size() < 1)
+    if (gap == it->second.gap)
+        return;
+    if (it->second.gap > 0)
+        layout->gaps[lua_malloc_highest_bit(it->second.gap)].erase(it->first);
+    it->second.gap = gap;
+    if (gap > 0)
+        layout->gaps[lua_malloc_highest_bit(gap)].insert(it->first);
+}
+
+// the offset the first fit allocator gave to a block of size bytes, -1 when it ran out of memory
+static ptrdiff_t lua_malloc_layout_add(LuaMallocLayout *layout, ptrdiff_t size)
+{
+    auto &entries = layout->entries;
+    ptrdiff_t offset = -1;
+    if (entries.empty())
+    {
+        // it didn't check the first block against the limit
+        offset = layout->pos;
+    }
+    else if (size == 0)
     {
-        auto offset = L->malloc_pos;
-        void *p = (void*)((intptr_t)(L->malloc_buffer) + offset);
-        L->malloc_pos += size;
-        L->malloced_buffers->push_back(std::make_pair(offset, size));
-        return p;
+        // the first gap of the walk holds it, including the empty ones between blocks at the same offset
+        auto first = entries.begin();
+        if (first->first > 0 || first->second.zero_blocks + (first->second.size > 0 ? 1 : 0) > 1)
+            offset = 0;
+        else if (std::next(first) != entries.end())
+            offset = first->first + first->second.size;
     }
-    std::pair<ptrdiff_t, ptrdiff_t> last_pair;
-    auto begin = L->malloced_buffers->begin();
-    for (auto it = begin; it != L->malloced_buffers->end(); ++it)
+    else
     {
-        if (it == begin)
+        // the gap with the lowest offset holding size bytes
+        int bit = lua_malloc_highest_bit(size);
+        ptrdiff_t found = -1;
+        for (int i = bit + 1; i < 64; i++)
+        {
+            if (!layout->gaps[i].empty() && (found < 0 || *layout->gaps[i].begin() < found))
+                found = *layout->gaps[i].begin();
+        }
+        for (auto next : layout->gaps[bit])
         {
-            if (it->first > (ptrdiff_t)size)
+            if (found >= 0 && next > found)
+                break;
+            if (entries[next].gap >= size)
             {
-                // can alloc memory before first block
-                ptrdiff_t offset = 0;
-                void *p = L->malloc_buffer;
-                L->malloced_buffers->insert(L->malloced_buffers->begin(), std::make_pair(offset, size));
-                return p;
+                found = next;
+                break;
             }
-            last_pair = *it;
-            continue;
         }
-        if (it->first >= last_pair.first + last_pair.second + (ptrdiff_t)size)
+        if (found >= 0)
         {
-            ptrdiff_t offset = last_pair.first + last_pair.second;
-            void *p = (void*)((intptr_t)(L->malloc_buffer) + offset);
-            L->malloced_buffers->insert(it, std::make_pair(offset, size));
-            return p;
+            auto it = entries.find(found);
+            if (it == entries.begin())
+                offset = 0;
+            else
+            {
+                auto prev = std::prev(it);
+                offset = prev->first + prev->second.size;
+            }
         }
-        last_pair = *it;
     }
-    if (L->malloc_pos + size > LUA_MALLOC_TOTAL_SIZE)
+    if (offset < 0)
+    {
+        // after the last block
+        if (layout->pos + size > LUA_MALLOC_TOTAL_SIZE)
+            return -1;
+        offset = layout->pos;
+    }
+    if (offset == layout->pos)
+        layout->pos += size;
+    auto it = entries.emplace(offset, LuaMallocLayoutEntry()).first;
+    if (size > 0)
+        it->second.size = size;
+    else
+        it->second.zero_blocks++;
+    lua_malloc_layout_update_gap(layout, it);
+    lua_malloc_layout_update_gap(layout, std::next(it));
+    return offset;
+}
+
+// the first fit allocator freed the first block at offset
+static void lua_malloc_layout_remove(LuaMallocLayout *layout, ptrdiff_t offset)
+{
+    auto it = layout->entries.find(offset);
+    if (it == layout->entries.end())
+        return;
+    if (it->second.zero_blocks > 0)
+        it->second.zero_blocks--;
+    else
+        it->second.size = 0;
+    auto next = std::next(it);
+    if (it->second.zero_blocks == 0 && it->second.size == 0)
+    {
+        if (it->second.gap > 0)
+            layout->gaps[lua_malloc_highest_bit(it->second.gap)].erase(it->first);
+        layout->entries.erase(it);
+    }
+    lua_malloc_layout_update_gap(layout, next);
+}
+
+static size_t lua_malloc_class_size(int size_class)
+{
+    if (size_class < LUA_MALLOC_SMALL_CLASSES)
+        return (size_t)(size_class + 1) << 3;
+    int p = 7 + (size_class - LUA_MALLOC_SMALL_CLASSES) / 4;
+    size_t k = 1 + (size_class - LUA_MALLOC_SMALL_CLASSES) % 4;
+    return ((size_t)1 << p) + k * ((size_t)1 << (p - 2));
+}
+
+static int lua_malloc_size_class(size_t size)
+{
+    if (size <= 8)
+        return 0;
+    if (size <= 128)
+        return (int)((size + 7) >> 3) - 1;
+    int p = lua_malloc_highest_bit(size - 1);
+    size_t step = (size_t)1 << (p - 2);
+    size_t k = (size - ((size_t)1 << p) + step - 1) / step;
+    return LUA_MALLOC_SMALL_CLASSES + (p - 7) * 4 + (int)k - 1;
+}
+
+static LuaMallocHeader *lua_malloc_header(void *address)
+{
+    return (LuaMallocHeader*)((intptr_t)address - sizeof(LuaMallocHeader));
+}
+
+// blocks come from the free list of their size class, or are cut from the unused end of malloc_buffer
+void *lua_malloc(lua_State *L, size_t size)
+{
+    if (size > LUA_MALLOC_TOTAL_SIZE)
+    {
+        uvm::lua::lib::notify_lua_state_stop(L);
+        return nullptr;
+    }
+    ptrdiff_t layout_offset = lua_malloc_layout_add(L->malloc_layout, (ptrdiff_t)align8(size));
+    if (layout_offset < 0)
     {
         L->force_stopping = true;
-		lua_set_run_error(L, "malloc too large memory in lvm");
+        lua_set_run_error(L, "malloc too large memory in lvm");
         // uvm::lua::lib::notify_lua_state_stop(L);
         return nullptr;
     }
-    ptrdiff_t offset = L->malloc_pos;
-    void *p = (void*)((intptr_t)(L->malloc_buffer) + offset);
-    L->malloced_buffers->push_back(std::make_pair(offset, size));
-    L->malloc_pos += size;
-    return p;
+    int size_class = lua_malloc_size_class(size);
+    void *address;
+    ptrdiff_t offset = L->malloc_free_lists[size_class];
+    size_t block_size = sizeof(LuaMallocHeader) + lua_malloc_class_size(size_class);
+    if (offset > 0)
+    {
+        address = (void*)((intptr_t)(L->malloc_buffer) + offset);
+        L->malloc_free_lists[size_class] = *(ptrdiff_t*)address;
+    }
+    else if (L->malloc_pos + block_size <= LUA_MALLOC_TOTAL_SIZE)
+    {
+        address = (void*)((intptr_t)(L->malloc_buffer) + L->malloc_pos + sizeof(LuaMallocHeader));
+        L->malloc_pos += block_size;
+    }
+    else
+    {
+        // the limit is the layout's, the size classes may need more
+        address = (void*)((intptr_t)malloc(block_size) + sizeof(LuaMallocHeader));
+        L->malloc_layout->overflow_blocks.insert(address);
+    }
+    auto header = lua_malloc_header(address);
+    header->magic = LUA_MALLOC_USED_MAGIC;
+    header->size_class = size_class;
+    header->layout_offset = layout_offset;
+    return address;
 }
 
 void *lua_calloc(lua_State *L, size_t element_count, size_t element_size)
@@ -446,15 +619,30 @@ void lua_free(lua_State *L, void *address)
     if (nullptr == address || nullptr == L)
         return;
     auto offset = (intptr_t)address - (intptr_t)L->malloc_buffer;
-    if (offset < 0 || offset > LUA_MALLOC_TOTAL_SIZE)
+    bool overflow = offset < 0 || offset >= L->malloc_pos;
+    if (overflow ? L->malloc_layout->overflow_blocks.count(address) == 0 : offset < (ptrdiff_t)sizeof(LuaMallocHeader) || (offset & 0x7) != 0)
         return;
-    size_t offset_size = (size_t)offset;
-    for (auto it = L->malloced_buffers->begin(); it != L->malloced_buffers->end(); ++it)
+    // addresses lua_malloc didn't return and blocks already freed are ignored
+    auto header = lua_malloc_header(address);
+    if (header->magic != LUA_MALLOC_USED_MAGIC || header->size_class >= LUA_MALLOC_SIZE_CLASSES)
+        return;
+    lua_malloc_layout_remove(L->malloc_layout, (ptrdiff_t)header->layout_offset);
+    if (overflow)
     {
-        if (it->first == offset_size)
-        {
-            L->malloced_buffers->erase(it);
-            return;
-        }
+        L->malloc_layout->overflow_blocks.erase(address);
+        free(header);
+        return;
     }
+    header->magic = LUA_MALLOC_FREED_MAGIC;
+    *(ptrdiff_t*)address = L->malloc_free_lists[header->size_class];
+    L->malloc_free_lists[header->size_class] = offset;
+}
+
+void lua_reset_malloc(lua_State *L)
+{
+    L->malloc_pos = 0;
+    memset(L->malloc_free_lists, 0x0, sizeof(L->malloc_free_lists));
+    for (auto address : L->malloc_layout->overflow_blocks)
+        free(lua_malloc_header(address));
+    *L->malloc_layout = LuaMallocLayout();
 }
@@ -26,6 +26,7 @@
 #include <math.h>
 #include <limits.h>
 
+#include <algorithm>
 #include <map>
 #include <vector>
 
@@ -339,6 +340,52 @@ int luaH_next(lua_State *L, Table *t, StkId key) {
 }
 
 
+/*
+** fills the array part of 'keys' with the keys of 't', the numbers first and then the strings,
+** each sorted by '<' as 'table.sort' sorts them. returns the number of keys and sets '*nnum' to
+** the number of numeric ones, or returns -1 when 't' has keys of other types
+*/
+int luaH_sortedkeys(lua_State *L, Table *t, Table *keys, int *nnum) {
+    std::vector<TValue> nums;
+    std::vector<TValue> strs;
+    TValue k;
+    unsigned int i;
+    for (i = 0; i < t->sizearray; i++) {
+        if (!ttisnil(&t->array[i])) {
+            setivalue(&k, i + 1);
+            nums.push_back(k);
+        }
+    }
+    for (i = 0; cast_int(i) < sizenode(t); i++) {
+        Node *n = gnode(t, i);
+        if (ttisnil(gval(n)))
+            continue;
+        setobj(L, &k, gkey(n));
+        if (ttisnumber(&k))
+            nums.push_back(k);
+        else if (ttisstring(&k))
+            strs.push_back(k);
+        else
+            return -1;
+    }
+    /* keys are distinct and '<' is a total order on numbers and on strings, so any sort gives that order */
+    auto less = [L](const TValue &a, const TValue &b) { return luaV_lessthan(L, &a, &b) != 0; };
+    std::sort(nums.begin(), nums.end(), less);
+    std::sort(strs.begin(), strs.end(), less);
+    luaH_resize(L, keys, lua_cast(unsigned int, nums.size() + strs.size()), 0);
+    TValue *slot = keys->array;
+    for (const auto &v : nums) {
+        setobj2t(L, slot++, &v);
+    }
+    for (const auto &v : strs) {
+        setobj2t(L, slot++, &v);
+        luaC_barrierback(L, keys, &v);
+    }
+    *nnum = cast_int(nums.size());
+    return cast_int(nums.size() + strs.size());
+}
+
+
 /*
 ** {=============================================================
 ** Rehash
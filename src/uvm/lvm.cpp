@@ -37,6 +37,7 @@
 #include <uvm/lvm.h>
 #include <uvm/uvm_api.h>
 #include <uvm/uvm_lib.h>
+#include <uvm/uvm_profile.h>
 
 using uvm::lua::api::global_uvm_chain_api;
 
@@ -806,9 +807,37 @@ void luaV_finishOp(lua_State *L) {
            luai_threadyield(L); }
 
 
+/*
+** fetch the next instruction and count it. the gas limit is exact, every instruction over it stops
+** the execution, and so does a stop notified or forced by whatever ran since the last instruction.
+** those and the hooks are handled apart from the instruction at 'vmchecks'
+*/
+#define vmfetch()  { \
+    i = *(ci->u.l.savedpc++); \
+    if (++*insts_executed_count > insts_limit || L->stop_to_run > 0 || L->force_stopping \
+        || (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT | UVM_MASKPROFILE))) \
+        goto vmchecks; \
+    ra = RA(i); }
+
+/*
+** with gcc and clang each instruction jumps to the next one's code through a table of label addresses,
+** instead of going back to one switch. define UVM_NO_JUMPTABLE to build the switch
+*/
+#if defined(__GNUC__) && !defined(UVM_NO_JUMPTABLE)
+#define UVM_USE_JUMPTABLE 1
+#else
+#define UVM_USE_JUMPTABLE 0
+#endif
+
+#if UVM_USE_JUMPTABLE
+#define vmdispatch(o)	goto *disptab[o];
+#define vmcase(l)	L_##l:
+#define vmbreak		{ vmfetch(); vmdispatch(GET_OPCODE(i)); }
+#else
 #define vmdispatch(o)	switch(o)
 #define vmcase(l)	case l:
 #define vmbreak		break
+#endif
 
 
 /*
@@ -845,10 +874,39 @@ if (!(cond)) {      \
   vmbreak;                                   \
      }                             \
 }
+static void vmhook(lua_State *L, LClosure *cl, Instruction i)
+{
+    if (L->hookmask & UVM_MASKPROFILE)
+        uvm::lua::lib::profile_instruction(L, cl->p, GET_OPCODE(i));
+    if (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT))
+        luaG_traceexec(L);
+}
+
 void luaV_execute(lua_State *L)
 {
     if (L->force_stopping)
         return;
+#if UVM_USE_JUMPTABLE
+    static_assert(UNUM_OPCODES == 55, "disptab lists the opcodes in OpCode order");
+    static const void *const disptab[1 << SIZE_OP] = {
+        &&L_UOP_MOVE, &&L_UOP_LOADK, &&L_UOP_LOADKX, &&L_UOP_LOADBOOL,
+        &&L_UOP_LOADNIL, &&L_UOP_GETUPVAL, &&L_UOP_GETTABUP, &&L_UOP_GETTABLE,
+        &&L_UOP_SETTABUP, &&L_UOP_SETUPVAL, &&L_UOP_SETTABLE, &&L_UOP_NEWTABLE,
+        &&L_UOP_SELF, &&L_UOP_ADD, &&L_UOP_SUB, &&L_UOP_MUL,
+        &&L_UOP_MOD, &&L_UOP_POW, &&L_UOP_DIV, &&L_UOP_IDIV,
+        &&L_UOP_BAND, &&L_UOP_BOR, &&L_UOP_BXOR, &&L_UOP_SHL,
+        &&L_UOP_SHR, &&L_UOP_UNM, &&L_UOP_BNOT, &&L_UOP_NOT,
+        &&L_UOP_LEN, &&L_UOP_CONCAT, &&L_UOP_JMP, &&L_UOP_EQ,
+        &&L_UOP_LT, &&L_UOP_LE, &&L_UOP_TEST, &&L_UOP_TESTSET,
+        &&L_UOP_CALL, &&L_UOP_TAILCALL, &&L_UOP_RETURN, &&L_UOP_FORLOOP,
+        &&L_UOP_FORPREP, &&L_UOP_TFORCALL, &&L_UOP_TFORLOOP, &&L_UOP_SETLIST,
+        &&L_UOP_CLOSURE, &&L_UOP_VARARG, &&L_UOP_EXTRAARG, &&L_UOP_PUSH,
+        &&L_UOP_POP, &&L_UOP_GETTOP, &&L_UOP_CMP, &&L_UOP_CMP_EQ,
+        &&L_UOP_CMP_NE, &&L_UOP_CMP_GT, &&L_UOP_CMP_LT, &&L_UOP_UNKNOWN,
+        &&L_UOP_UNKNOWN, &&L_UOP_UNKNOWN, &&L_UOP_UNKNOWN, &&L_UOP_UNKNOWN,
+        &&L_UOP_UNKNOWN, &&L_UOP_UNKNOWN, &&L_UOP_UNKNOWN, &&L_UOP_UNKNOWN,
+    };
+#endif
     CallInfo *ci = L->ci;
     LClosure *cl;
     TValue *k;
@@ -860,23 +918,12 @@ newframe:  /* reentry point when frame changes (call/return) */
     k = cl->p->k;  /* local reference to function's constant table */
     base = ci->u.l.base;  /* local copy of function's base */
 
-    int insts_limit = uvm::lua::lib::get_lua_state_value(L, INSTRUCTIONS_LIMIT_LUA_STATE_MAP_KEY).int_value;
-    int *stopped_pointer = uvm::lua::lib::get_lua_state_value(L, LUA_STATE_STOP_TO_RUN_IN_LVM_STATE_MAP_KEY).int_pointer_value;
-    if (nullptr == stopped_pointer)
+    int insts_limit = L->insts_limit > 0 ? L->insts_limit : INT_MAX;
+    int *insts_executed_count = &L->insts_executed_count;
+    if (!L->insts_counted)
     {
-        uvm::lua::lib::notify_lua_state_stop(L);
-        uvm::lua::lib::resume_lua_state_running(L);
-        stopped_pointer = uvm::lua::lib::get_lua_state_value(L, LUA_STATE_STOP_TO_RUN_IN_LVM_STATE_MAP_KEY).int_pointer_value;
-    }
-    int has_insts_limit = insts_limit > 0 ? 1 : 0;
-    int *insts_executed_count = uvm::lua::lib::get_lua_state_value(L, INSTRUCTIONS_EXECUTED_COUNT_LUA_STATE_MAP_KEY).int_pointer_value;
-    if (nullptr == insts_executed_count)
-    {
-        insts_executed_count = static_cast<int*>(lua_malloc(L, sizeof(int)));
+        L->insts_counted = true;
         *insts_executed_count = 0;
-        UvmStateValue lua_state_value_of_exected_count;
-        lua_state_value_of_exected_count.int_pointer_value = insts_executed_count;
-        uvm::lua::lib::set_lua_state_value(L, INSTRUCTIONS_EXECUTED_COUNT_LUA_STATE_MAP_KEY, lua_state_value_of_exected_count, LUA_STATE_VALUE_INT_POINTER);
     }
     if (*insts_executed_count < 0)
         *insts_executed_count = 0;
@@ -887,46 +934,19 @@ newframe:  /* reentry point when frame changes (call/return) */
 
 	int last_debug_line_in_file = -1;
 
+    // a frame only gets here with its savedpc set, from a call or a return
+    if (ci->u.l.savedpc == nullptr) {
+        global_uvm_chain_api->throw_exception(L, UVM_API_LVM_LIMIT_OVER_ERROR, "wrong bytecode instruction, can't find savedpc");
+        return;
+    }
+
     /* main loop of interpreter */
     for (;;) {
-        if (!ci || ci->u.l.savedpc == nullptr) {
-          global_uvm_chain_api->throw_exception(L, UVM_API_LVM_LIMIT_OVER_ERROR, "wrong bytecode instruction, can't find savedpc");
-          vmbreak;
-        }
-        Instruction i = *(ci->u.l.savedpc++);
-
-#ifdef DEBUG
-	printf("%d\n", GET_OPCODE(i));
-#endif // DEBUG
-
-        StkId ra;
-
-		*insts_executed_count += 1; // executed instructions count
-
-        // limit instructions count, and executed instructions
-        if (has_insts_limit && *insts_executed_count > insts_limit)
-        {
-            global_uvm_chain_api->throw_exception(L, UVM_API_LVM_LIMIT_OVER_ERROR, "over instructions limit");
-            vmbreak;
-        }
-        if (stopped_pointer && *stopped_pointer > 0)
-            vmbreak;
-        if (L->force_stopping)
-            vmbreak;
-        
-
-        // when over contract api limit, also vmbreak
-        if ((GET_OPCODE(i) == UOP_CALL || GET_OPCODE(i) == UOP_TAILCALL)
-            && global_uvm_chain_api->check_contract_api_instructions_over_limit(L))
-        {
-            global_uvm_chain_api->throw_exception(L, UVM_API_LVM_LIMIT_OVER_ERROR, "over instructions limit");
-            vmbreak;
-        }
-
-        if (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT))
-            Protect(luaG_traceexec(L));
+        Instruction i;
         /* WARNING: several calls may realloc the stack and invalidate 'ra' */
-        ra = RA(i);
+        StkId ra;
+        vmfetch();
+    vmexec:
         lua_assert(base == ci->u.l.base);
         lua_assert(base <= L->top && L->top < L->stack + L->stacksize);
 		
@@ -971,7 +991,7 @@ newframe:  /* reentry point when frame changes (call/return) */
                 lua_check_in_vm_error(upval_index < cl->nupvalues && upval_index >=0, "upvalue error");
                 if (nullptr == cl->upvals[upval_index])
                 {
-                    *stopped_pointer = 1;
+                    L->stop_to_run = 1;
                     vmbreak;
                 }
                 TValue *upval = cl->upvals[upval_index]->v;
@@ -1327,6 +1347,10 @@ newframe:  /* reentry point when frame changes (call/return) */
                 vmbreak;
             }
             vmcase(UOP_CALL) {
+                if (global_uvm_chain_api->check_contract_api_instructions_over_limit(L)) {
+                    global_uvm_chain_api->throw_exception(L, UVM_API_LVM_LIMIT_OVER_ERROR, "over instructions limit");
+                    return;
+                }
                 int b = GETARG_B(i);
                 int nresults = GETARG_C(i) - 1;
                 if (b != 0) L->top = ra + b;  /* else previous instruction set top */
@@ -1345,6 +1369,10 @@ newframe:  /* reentry point when frame changes (call/return) */
                 vmbreak;
             }
             vmcase(UOP_TAILCALL) {
+                if (global_uvm_chain_api->check_contract_api_instructions_over_limit(L)) {
+                    global_uvm_chain_api->throw_exception(L, UVM_API_LVM_LIMIT_OVER_ERROR, "over instructions limit");
+                    return;
+                }
                 int b = GETARG_B(i);
                 if (b != 0) L->top = ra + b;  /* else previous instruction set top */
                 lua_assert(GETARG_C(i) - 1 == LUA_MULTRET);
@@ -1629,7 +1657,21 @@ newframe:  /* reentry point when frame changes (call/return) */
 					)
 					vmbreak;
 			}
+#if UVM_USE_JUMPTABLE
+            L_UOP_UNKNOWN: vmbreak;
+#endif
         }
+        continue;
+    vmchecks:
+        if (*insts_executed_count > insts_limit) {
+            global_uvm_chain_api->throw_exception(L, UVM_API_LVM_LIMIT_OVER_ERROR, "over instructions limit");
+            return;
+        }
+        if (L->stop_to_run > 0 || L->force_stopping)
+            return;
+        Protect(vmhook(L, cl, i));
+        ra = RA(i);
+        goto vmexec;
     }
 }
 
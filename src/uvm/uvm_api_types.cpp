@@ -6,6 +6,7 @@ UvmModuleByteStream::UvmModuleByteStream()
 	is_bytes = false;
 	contract_level = CONTRACT_LEVEL_TEMP;
 	contract_state = CONTRACT_STATE_VALID;
+	checked = false;
 }
 
 UvmModuleByteStream::~UvmModuleByteStream()
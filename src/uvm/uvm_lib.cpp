@@ -30,7 +30,11 @@
 #include <uvm/lauxlib.h>
 #include <uvm/lualib.h>
 #include <uvm/lfunc.h>
+#include <uvm/lgc.h>
+#include <uvm/ldo.h>
+#include <uvm/ltable.h>
 #include <uvm/uvm_storage.h>
+#include <uvm/uvm_profile.h>
 
 namespace uvm
 {
@@ -92,13 +96,12 @@ namespace uvm
             static L_V1 create_value_map_for_lua_state(lua_State *L)
             {
                 LStatesMap *states_map = get_lua_states_value_hashmap();
+                std::lock_guard<std::mutex> lock(states_map_mutex);
                 auto it = states_map->find(L);
                 if (it == states_map->end())
                 {
-                    states_map_mutex.lock();
                     L_V1 map = std::make_shared<L_VM1>();
                     states_map->insert(std::make_pair(L, map));
-                    states_map_mutex.unlock();
                     return map;
                 }
                 else
@@ -965,16 +968,27 @@ namespace uvm
                 return uvm::lib::uvmlib_set_storage_impl(L, contract_id, key, "", false, 3);
             }
 
-			static int uvm_core_lib_pairs_by_keys_func_loader(lua_State *L)
-            {
-				lua_getglobal(L, "__real_pairs_by_keys_func");
-				bool exist = !lua_isnil(L, -1) && (lua_isfunction(L, -1) || lua_iscfunction(L, -1));
+			// the gas of pairs is what its lua version executed: loading it once in a lua state, sorting the keys,
+			// and each step of the iterator, the numeric keys' steps taking the shorter branch
+#define PAIRS_BY_KEYS_LOAD_INSTRUCTIONS 3
+#define PAIRS_BY_KEYS_INSTRUCTIONS 23
+#define PAIRS_BY_KEYS_NUMBER_KEY_INSTRUCTIONS 10
+#define PAIRS_BY_KEYS_STRING_KEY_INSTRUCTIONS 15
+#define PAIRS_BY_KEYS_NUMBER_STEP_INSTRUCTIONS 12
+#define PAIRS_BY_KEYS_STRING_STEP_INSTRUCTIONS 16
+#define LUA_TABLE_SORT_REGISTRY_KEY "__uvm_table_sort__"
+
+			// pairsByKeys' iterate order is number first(than string), short string first(than long string), little ASCII string first.
+			// the lua version still runs the tables whose order isn't only made of their keys and table.sort
+			static int uvm_core_lib_lua_pairs_by_keys(lua_State *L)
+			{
+				lua_getglobal(L, "__lua_pairs_by_keys_func");
+				bool exist = lua_isfunction(L, -1);
 				lua_pop(L, 1);
-				if (exist)
-					return 0; 
-				// pairsByKeys' iterate order is number first(than string), short string first(than long string), little ASCII string first
-				const char *code = R"END(
-function __real_pairs_by_keys_func(t)
+				if (!exist)
+				{
+					const char *code = R"END(
+function __lua_pairs_by_keys_func(t)
 	local hashes = {}  
 	local n = nil
 	local int_key_size = 0;
@@ -1003,7 +1017,95 @@ function __real_pairs_by_keys_func(t)
     end  
 end
 )END";
-				luaL_dostring(L, code);
+					// its loading was charged with the native version's
+					auto insts_executed_count = L->insts_executed_count;
+					luaL_dostring(L, code);
+					L->insts_executed_count = insts_executed_count;
+				}
+				lua_getglobal(L, "__lua_pairs_by_keys_func");
+				lua_pushvalue(L, 1);
+				lua_call(L, 1, 1);
+				return 1;
+			}
+
+			static int uvm_core_lib_pairs_by_keys_next(lua_State *L)
+			{
+				// upvalues: sorted keys, table, number of numeric keys, index of the last key
+				auto i = lua_tointeger(L, lua_upvalueindex(4)) + 1;
+				lua_pushinteger(L, i);
+				lua_replace(L, lua_upvalueindex(4));
+				increment_lvm_instructions_executed_count(L, i <= lua_tointeger(L, lua_upvalueindex(3))
+					? PAIRS_BY_KEYS_NUMBER_STEP_INSTRUCTIONS : PAIRS_BY_KEYS_STRING_STEP_INSTRUCTIONS);
+				lua_rawgeti(L, lua_upvalueindex(1), i);
+				lua_pushvalue(L, -1);
+				lua_gettable(L, lua_upvalueindex(2)); // may call __index like the lua version
+				return 2;
+			}
+
+			// the lua version reads them on each call, so a table with __pairs or a replaced table.sort or
+			// tostring of strings changes its result
+			static bool pairs_by_keys_is_native(lua_State *L, int nstr)
+			{
+				if (luaL_getmetafield(L, 1, "__pairs") != LUA_TNIL)
+				{
+					lua_pop(L, 1);
+					return false;
+				}
+				lua_getglobal(L, "table");
+				if (!lua_istable(L, -1))
+				{
+					lua_pop(L, 1);
+					return false;
+				}
+				lua_pushliteral(L, "sort");
+				lua_rawget(L, -2);
+				lua_getfield(L, LUA_REGISTRYINDEX, LUA_TABLE_SORT_REGISTRY_KEY);
+				bool native = lua_rawequal(L, -1, -2) != 0;
+				lua_pop(L, 3);
+				if (native && nstr > 0)
+				{
+					lua_pushliteral(L, "");
+					if (luaL_getmetafield(L, -1, "__tostring") != LUA_TNIL)
+					{
+						lua_pop(L, 1);
+						native = false;
+					}
+					lua_pop(L, 1);
+				}
+				return native;
+			}
+
+			static int uvm_core_lib_real_pairs_by_keys(lua_State *L)
+			{
+				lua_settop(L, 1);
+				int nnum = 0;
+				int n = lua_istable(L, 1) ? lua_sortedkeys(L, 1, &nnum) : -1;
+				if (n < 0)
+					return uvm_core_lib_lua_pairs_by_keys(L);
+				if (!pairs_by_keys_is_native(L, n - nnum))
+				{
+					lua_pop(L, 1);
+					return uvm_core_lib_lua_pairs_by_keys(L);
+				}
+				increment_lvm_instructions_executed_count(L, PAIRS_BY_KEYS_INSTRUCTIONS
+					+ nnum * PAIRS_BY_KEYS_NUMBER_KEY_INSTRUCTIONS + (n - nnum) * PAIRS_BY_KEYS_STRING_KEY_INSTRUCTIONS);
+				lua_pushvalue(L, 1);
+				lua_pushinteger(L, nnum);
+				lua_pushinteger(L, 0);
+				lua_pushcclosure(L, &uvm_core_lib_pairs_by_keys_next, 4);
+				return 1;
+			}
+
+			static int uvm_core_lib_pairs_by_keys_func_loader(lua_State *L)
+            {
+				lua_getglobal(L, "__real_pairs_by_keys_func");
+				bool exist = !lua_isnil(L, -1) && (lua_isfunction(L, -1) || lua_iscfunction(L, -1));
+				lua_pop(L, 1);
+				if (exist)
+					return 0; 
+				increment_lvm_instructions_executed_count(L, PAIRS_BY_KEYS_LOAD_INSTRUCTIONS);
+				lua_pushcfunction(L, &uvm_core_lib_real_pairs_by_keys);
+				lua_setglobal(L, "__real_pairs_by_keys_func");
 				return 0;
             }
 
@@ -1015,8 +1117,7 @@ end
 			*/
 			static int uvm_core_lib_pairs_by_keys(lua_State *L)
             {
-				lua_getglobal(L, "uvm_core_lib_pairs_by_keys_func_loader");
-				lua_call(L, 0, 0);
+				uvm_core_lib_pairs_by_keys_func_loader(L);
 				lua_getglobal(L, "__real_pairs_by_keys_func");
 				lua_pushvalue(L, 1);
 				lua_call(L, 1, 1);
@@ -1145,6 +1246,10 @@ end
 				*/
 				lua_getglobal(L, "pairs");
 				lua_setglobal(L, "__old_pairs");
+				lua_getglobal(L, "table");
+				lua_getfield(L, -1, "sort");
+				lua_setfield(L, LUA_REGISTRYINDEX, LUA_TABLE_SORT_REGISTRY_KEY);
+				lua_pop(L, 1);
 				lua_pushcfunction(L, &uvm_core_lib_pairs_by_keys);
 				lua_setglobal(L, "pairs");
 
@@ -1192,10 +1297,9 @@ end
                 return false;
             }
 
-            void close_lua_state(lua_State *L)
+            // free what the state values of L point to and forget them
+            static void release_lua_state_values(lua_State *L)
             {
-                luaL_commit_storage_changes(L);
-				uvm::lua::api::global_uvm_chain_api->release_objects_in_pool(L);
                 LStatesMap *states_map = get_lua_states_value_hashmap();
                 if (nullptr != states_map)
                 {
@@ -1223,10 +1327,9 @@ end
                         }
                     }
                     // close values in state values(some pointers need free), eg. storage infos, contract infos
-                    UvmStateValueNode storage_changelist_node = get_lua_state_value_node(L, LUA_STORAGE_CHANGELIST_KEY);
-                    if (storage_changelist_node.type == LUA_STATE_VALUE_POINTER && nullptr != storage_changelist_node.value.pointer_value)
+                    if (nullptr != L->storage_changelist)
                     {
-                        UvmStorageChangeList *list = (UvmStorageChangeList*)storage_changelist_node.value.pointer_value;
+                        UvmStorageChangeList *list = (UvmStorageChangeList*)L->storage_changelist;
                         for (auto it = list->begin(); it != list->end(); ++it)
                         {
                             UvmStorageValue before = it->before;
@@ -1241,7 +1344,8 @@ end
                             }
                         }
                         list->~UvmStorageChangeList();
-                        lua_free(L, list);
+                        free(list);
+                        L->storage_changelist = nullptr;
                     }
 
                     UvmStateValueNode storage_table_read_list_node = get_lua_state_value_node(L, LUA_STORAGE_READ_TABLES_KEY);
@@ -1249,40 +1353,329 @@ end
                     {
                         UvmStorageTableReadList *list = (UvmStorageTableReadList*)storage_table_read_list_node.value.pointer_value;
                         list->~UvmStorageTableReadList();
-                        lua_free(L, list);
+                        free(list);
                     }
 
-                    int *insts_executed_count = get_lua_state_value(L, INSTRUCTIONS_EXECUTED_COUNT_LUA_STATE_MAP_KEY).int_pointer_value;
-                    if (nullptr != insts_executed_count)
+                    L->insts_limit = 0;
+                    L->insts_counted = false;
+                    L->insts_executed_count = 0;
+                    L->stop_to_run = 0;
+                    L->exception_code = 0;
+                    L->exception_msg = nullptr;
+                    L->evaluator = nullptr;
+                    attach_profile(L, nullptr);
+                    delete get_using_contract_id_stack(L, false);
+                    
+                    std::lock_guard<std::mutex> lock(states_map_mutex);
+                    states_map->erase(L);
+                }
+            }
+
+            void close_lua_state(lua_State *L)
+            {
+                luaL_commit_storage_changes(L);
+				uvm::lua::api::global_uvm_chain_api->release_objects_in_pool(L);
+                release_lua_state_values(L);
+                lua_close(L);
+            }
+
+#define LUA_STATE_BASELINE_KEY "__uvm_state_baseline__"
+#define LUA_STATE_MODULE_CACHE_KEY "__uvm_module_cache__"
+
+            // copies[t] = shallow copy of t, metatables[t] = t's metatable, for every table reachable from index
+            static void save_table_baseline(lua_State *L, int copies, int metatables, int index)
+            {
+                index = lua_absindex(L, index);
+                luaL_checkstack(L, 6, "too deep tables in lua state baseline");
+                lua_pushvalue(L, index);
+                if (lua_rawget(L, copies) != LUA_TNIL)
+                {
+                    lua_pop(L, 1);
+                    return;
+                }
+                lua_pop(L, 1);
+                lua_createtable(L, 0, 0);
+                int copy = lua_gettop(L);
+                lua_pushvalue(L, index);
+                lua_pushvalue(L, copy);
+                lua_rawset(L, copies);
+                lua_pushnil(L);
+                while (lua_next(L, index) != 0)
+                {
+                    lua_pushvalue(L, -2);
+                    lua_pushvalue(L, -2);
+                    lua_rawset(L, copy);
+                    if (lua_istable(L, -1))
+                        save_table_baseline(L, copies, metatables, -1);
+                    if (lua_istable(L, -2))
+                        save_table_baseline(L, copies, metatables, -2);
+                    lua_pop(L, 1);
+                }
+                if (lua_getmetatable(L, index))
+                {
+                    lua_pushvalue(L, index);
+                    lua_pushvalue(L, -2);
+                    lua_rawset(L, metatables);
+                    save_table_baseline(L, copies, metatables, -1);
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 1);
+            }
+
+            void save_lua_state_baseline(lua_State *L)
+            {
+                lua_createtable(L, 2, 0);
+                lua_pushvalue(L, -1);
+                lua_setfield(L, LUA_REGISTRYINDEX, LUA_STATE_BASELINE_KEY);
+                int baseline = lua_gettop(L);
+                lua_createtable(L, 0, 0);
+                lua_pushvalue(L, -1);
+                lua_rawseti(L, baseline, 1);
+                lua_createtable(L, 0, 0);
+                lua_pushvalue(L, -1);
+                lua_rawseti(L, baseline, 2);
+                int copies = baseline + 1;
+                int metatables = baseline + 2;
+                // the baseline itself is not part of the baseline
+                lua_pushvalue(L, baseline);
+                lua_pushboolean(L, 1);
+                lua_rawset(L, copies);
+                save_table_baseline(L, copies, metatables, LUA_REGISTRYINDEX);
+                lua_pushstring(L, "");
+                if (lua_getmetatable(L, -1))
+                {
+                    save_table_baseline(L, copies, metatables, -1);
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 1);
+                lua_pushvalue(L, baseline);
+                lua_pushnil(L);
+                lua_rawset(L, copies);
+                lua_settop(L, baseline - 1);
+            }
+
+            bool reset_lua_state(lua_State *L)
+            {
+				uvm::lua::api::global_uvm_chain_api->release_objects_in_pool(L);
+                release_lua_state_values(L);
+                // only a state not inside any call can be reused
+                if (L->ci != &L->base_ci || L->status != LUA_OK)
+                    return false;
+                lua_settop(L, 0);
+                lua_reset_malloc(L);
+                memset(L->compile_error, 0x0, LUA_COMPILE_ERROR_MAX_LENGTH);
+                memset(L->runerror, 0x0, LUA_VM_EXCEPTION_STRNG_MAX_LENGTH);
+                L->in = stdin;
+                L->out = stdout;
+                L->err = stderr;
+                L->force_stopping = false;
+                L->exit_code = 0;
+                L->preprocessor = nullptr;
+                L->evalstacktop = L->evalstack;
+                lua_sethook(L, nullptr, 0, 0);
+
+                if (lua_getfield(L, LUA_REGISTRYINDEX, LUA_STATE_BASELINE_KEY) != LUA_TTABLE)
+                {
+                    lua_settop(L, 0);
+                    return false;
+                }
+                lua_gc(L, LUA_GCSTOP, 0);
+                lua_rawgeti(L, 1, 1);
+                lua_rawgeti(L, 1, 2);
+                int copies = 2;
+                int metatables = 3;
+                // loaded contract modules outlive the reset
+                lua_getfield(L, LUA_REGISTRYINDEX, LUA_STATE_MODULE_CACHE_KEY);
+                int module_cache = 4;
+                lua_pushnil(L);
+                while (lua_next(L, copies) != 0)
+                {
+                    int table = lua_gettop(L) - 1;
+                    int copy = table + 1;
+                    lua_pushnil(L);
+                    while (lua_next(L, table) != 0)
                     {
-                        lua_free(L, insts_executed_count);
+                        lua_pop(L, 1);
+                        lua_pushvalue(L, -1);
+                        lua_pushnil(L);
+                        lua_rawset(L, table);
                     }
-                    int *stopped_pointer = uvm::lua::lib::get_lua_state_value(L, LUA_STATE_STOP_TO_RUN_IN_LVM_STATE_MAP_KEY).int_pointer_value;
-                    if (nullptr != stopped_pointer)
+                    lua_pushnil(L);
+                    while (lua_next(L, copy) != 0)
                     {
-                        lua_free(L, stopped_pointer);
+                        lua_pushvalue(L, -2);
+                        lua_insert(L, -2);
+                        lua_rawset(L, table);
                     }
-                    
-                    states_map->erase(L);
+                    lua_pushvalue(L, table);
+                    lua_rawget(L, metatables);
+                    lua_setmetatable(L, table);
+                    lua_pop(L, 1);
                 }
+                lua_pushvalue(L, module_cache);
+                lua_setfield(L, LUA_REGISTRYINDEX, LUA_STATE_MODULE_CACHE_KEY);
+                lua_settop(L, 0);
+                lua_gc(L, LUA_GCRESTART, 0);
+                lua_gc(L, LUA_GCCOLLECT, 0);
+                return true;
+            }
 
-                lua_close(L);
+            static std::string contract_closure_cache_key(UvmModuleByteStreamP stream)
+            {
+                return stream->contract_id + ":" + stream->bytecode_digest;
+            }
+
+            bool push_cached_contract_closure(lua_State *L, UvmModuleByteStreamP stream)
+            {
+                if (!stream->checked || stream->bytecode_digest.empty())
+                    return false;
+                if (lua_getfield(L, LUA_REGISTRYINDEX, LUA_STATE_MODULE_CACHE_KEY) != LUA_TTABLE)
+                {
+                    lua_pop(L, 1);
+                    return false;
+                }
+                const auto &key = contract_closure_cache_key(stream);
+                lua_pushlstring(L, key.data(), key.size());
+                if (lua_rawget(L, -2) != LUA_TFUNCTION || !ttisLclosure(L->top - 1))
+                {
+                    lua_pop(L, 2);
+                    return false;
+                }
+                // the proto stays reachable from the cache
+                Proto *p = getproto(L->top - 1);
+                lua_pop(L, 2);
+                // same as lua_load does with a freshly undumped main function
+                LClosure *cl = luaF_newLclosure(L, p->sizeupvalues);
+                cl->p = p;
+                setclLvalue(L, L->top, cl);
+                luaD_inctop(L);
+                luaF_initupvals(L, cl);
+                if (cl->nupvalues >= 1)
+                {
+                    Table *reg = hvalue(&G(L)->l_registry);
+                    const TValue *gt = luaH_getint(reg, LUA_RIDX_GLOBALS);
+                    setobj(L, cl->upvals[0]->v, gt);
+                    luaC_upvalbarrier(L, cl->upvals[0]);
+                }
+                return true;
             }
 
+            void cache_contract_closure(lua_State *L, UvmModuleByteStreamP stream)
+            {
+                if (!stream->checked || stream->bytecode_digest.empty() || !ttisLclosure(L->top - 1))
+                    return;
+                lua_Integer count = 0;
+                if (lua_getfield(L, LUA_REGISTRYINDEX, LUA_STATE_MODULE_CACHE_KEY) == LUA_TTABLE)
+                {
+                    lua_rawgeti(L, -1, 0);
+                    count = lua_tointeger(L, -1);
+                    lua_pop(L, 1);
+                }
+                if (!lua_istable(L, -1) || count >= UVM_STATE_MODULE_CACHE_SIZE)
+                {
+                    // start over instead of tracking use in lua
+                    lua_pop(L, 1);
+                    lua_createtable(L, 0, 0);
+                    lua_pushvalue(L, -1);
+                    lua_setfield(L, LUA_REGISTRYINDEX, LUA_STATE_MODULE_CACHE_KEY);
+                    count = 0;
+                }
+                const auto &key = contract_closure_cache_key(stream);
+                lua_pushlstring(L, key.data(), key.size());
+                lua_pushvalue(L, -3);
+                lua_rawset(L, -3);
+                lua_pushinteger(L, count + 1);
+                lua_rawseti(L, -2, 0);
+                lua_pop(L, 1);
+            }
+
+
             /**
             * share some values in L
             */
             void close_all_lua_state_values()
             {
                 LStatesMap *states_map = get_lua_states_value_hashmap();
+                std::lock_guard<std::mutex> lock(states_map_mutex);
                 states_map->clear();
             }
             void close_lua_state_values(lua_State *L)
             {
                 LStatesMap *states_map = get_lua_states_value_hashmap();
+                std::lock_guard<std::mutex> lock(states_map_mutex);
                 states_map->erase(L);
             }
 
+            // state values with a lua_State field of their own
+            static bool get_lua_state_field_value(lua_State *L, const char *key, UvmStateValueNode *node)
+            {
+                if (strcmp(key, INSTRUCTIONS_LIMIT_LUA_STATE_MAP_KEY) == 0)
+                {
+                    node->type = LUA_STATE_VALUE_INT;
+                    node->value.int_value = L->insts_limit;
+                }
+                else if (strcmp(key, INSTRUCTIONS_EXECUTED_COUNT_LUA_STATE_MAP_KEY) == 0)
+                {
+                    if (L->insts_counted)
+                    {
+                        node->type = LUA_STATE_VALUE_INT_POINTER;
+                        node->value.int_pointer_value = &L->insts_executed_count;
+                    }
+                }
+                else if (strcmp(key, LUA_STATE_STOP_TO_RUN_IN_LVM_STATE_MAP_KEY) == 0)
+                {
+                    node->type = LUA_STATE_VALUE_INT_POINTER;
+                    node->value.int_pointer_value = &L->stop_to_run;
+                }
+                else if (strcmp(key, LUA_EXCEPTION_CODE_KEY) == 0)
+                {
+                    node->type = LUA_STATE_VALUE_INT;
+                    node->value.int_value = L->exception_code;
+                }
+                else if (strcmp(key, LUA_EXCEPTION_MSG_KEY) == 0)
+                {
+                    node->type = LUA_STATE_VALUE_STRING;
+                    node->value.string_value = L->exception_msg;
+                }
+                else if (strcmp(key, LUA_STORAGE_CHANGELIST_KEY) == 0)
+                {
+                    node->type = LUA_STATE_VALUE_POINTER;
+                    node->value.pointer_value = L->storage_changelist;
+                }
+                else if (strcmp(key, LUA_EVALUATOR_KEY) == 0)
+                {
+                    node->type = LUA_STATE_VALUE_POINTER;
+                    node->value.pointer_value = L->evaluator;
+                }
+                else
+                    return false;
+                return true;
+            }
+
+            static bool set_lua_state_field_value(lua_State *L, const char *key, UvmStateValue value)
+            {
+                if (strcmp(key, INSTRUCTIONS_LIMIT_LUA_STATE_MAP_KEY) == 0)
+                    L->insts_limit = value.int_value;
+                else if (strcmp(key, INSTRUCTIONS_EXECUTED_COUNT_LUA_STATE_MAP_KEY) == 0)
+                {
+                    L->insts_counted = nullptr != value.int_pointer_value;
+                    L->insts_executed_count = value.int_pointer_value ? *value.int_pointer_value : 0;
+                }
+                else if (strcmp(key, LUA_STATE_STOP_TO_RUN_IN_LVM_STATE_MAP_KEY) == 0)
+                    L->stop_to_run = value.int_pointer_value ? *value.int_pointer_value : 0;
+                else if (strcmp(key, LUA_EXCEPTION_CODE_KEY) == 0)
+                    L->exception_code = value.int_value;
+                else if (strcmp(key, LUA_EXCEPTION_MSG_KEY) == 0)
+                    L->exception_msg = value.string_value ? malloc_and_copy_string(L, value.string_value) : nullptr;
+                else if (strcmp(key, LUA_STORAGE_CHANGELIST_KEY) == 0)
+                    L->storage_changelist = value.pointer_value;
+                else if (strcmp(key, LUA_EVALUATOR_KEY) == 0)
+                    L->evaluator = value.pointer_value;
+                else
+                    return false;
+                return true;
+            }
+
             UvmStateValueNode get_lua_state_value_node(lua_State *L, const char *key)
             {
                 UvmStateValue nil_value = { 0 };
@@ -1293,6 +1686,8 @@ end
                 {
                     return nil_value_node;
                 }
+                if (get_lua_state_field_value(L, key, &nil_value_node))
+                    return nil_value_node;
 
                 LStatesMap *states_map = get_lua_states_value_hashmap();
                 L_V1 map = create_value_map_for_lua_state(L);
@@ -1310,26 +1705,24 @@ end
             }
             void set_lua_state_instructions_limit(lua_State *L, int limit)
             {
-                UvmStateValue value = { limit };
-                set_lua_state_value(L, INSTRUCTIONS_LIMIT_LUA_STATE_MAP_KEY, value, LUA_STATE_VALUE_INT);
+                L->insts_limit = limit;
             }
 
             int get_lua_state_instructions_limit(lua_State *L)
             {
-                return get_lua_state_value(L, INSTRUCTIONS_LIMIT_LUA_STATE_MAP_KEY).int_value;
+                return L->insts_limit;
             }
 
             int get_lua_state_instructions_executed_count(lua_State *L)
             {
-                int *insts_executed_count = get_lua_state_value(L, INSTRUCTIONS_EXECUTED_COUNT_LUA_STATE_MAP_KEY).int_pointer_value;
-                if (nullptr == insts_executed_count)
+                if (!L->insts_counted)
                 {
                     return 0;
                 }
-                if (*insts_executed_count < 0)
+                if (L->insts_executed_count < 0)
                     return 0;
                 else
-                    return *insts_executed_count;
+                    return L->insts_executed_count;
             }
 
             void enter_lua_sandbox(lua_State *L)
@@ -1356,19 +1749,7 @@ end
             */
             void notify_lua_state_stop(lua_State *L)
             {
-                int *pointer = get_lua_state_value(L, LUA_STATE_STOP_TO_RUN_IN_LVM_STATE_MAP_KEY).int_pointer_value;
-                if (nullptr == pointer)
-                {
-                    pointer = (int*)lua_malloc(L, sizeof(int));
-                    *pointer = 1;
-                    UvmStateValue value;
-                    value.int_pointer_value = pointer;
-                    set_lua_state_value(L, LUA_STATE_STOP_TO_RUN_IN_LVM_STATE_MAP_KEY, value, LUA_STATE_VALUE_INT_POINTER);
-                }
-                else
-                {
-                    *pointer = 1;
-                }
+                L->stop_to_run = 1;
             }
 
             /**
@@ -1376,10 +1757,7 @@ end
             */
             bool check_lua_state_notified_stop(lua_State *L)
             {
-                int *pointer = get_lua_state_value(L, LUA_STATE_STOP_TO_RUN_IN_LVM_STATE_MAP_KEY).int_pointer_value;
-                if (nullptr == pointer)
-                    return false;
-                return (*pointer) > 0;
+                return L->stop_to_run > 0;
             }
 
             /**
@@ -1387,11 +1765,7 @@ end
             */
             void resume_lua_state_running(lua_State *L)
             {
-                int *pointer = get_lua_state_value(L, LUA_STATE_STOP_TO_RUN_IN_LVM_STATE_MAP_KEY).int_pointer_value;
-                if (nullptr != pointer)
-                {
-                    *pointer = 0;
-                }
+                L->stop_to_run = 0;
             }
 
             void set_lua_state_value(lua_State *L, const char *key, UvmStateValue value, enum UvmStateValueType type)
@@ -1400,6 +1774,8 @@ end
                 {
                     return;
                 }
+                if (set_lua_state_field_value(L, key, value))
+                    return;
 
                 L_V1 map = create_value_map_for_lua_state(L);
                 UvmStateValueNode node_v;
@@ -1932,19 +2308,17 @@ end
 
 			void reset_lvm_instructions_executed_count(lua_State *L)
             {
-				int *insts_executed_count = get_lua_state_value(L, INSTRUCTIONS_EXECUTED_COUNT_LUA_STATE_MAP_KEY).int_pointer_value;
-				if (insts_executed_count)
+				if (L->insts_counted)
 				{
-					*insts_executed_count = 0;
+					L->insts_executed_count = 0;
 				}
             }
 
             void increment_lvm_instructions_executed_count(lua_State *L, int add_count)
             {
-              int *insts_executed_count = get_lua_state_value(L, INSTRUCTIONS_EXECUTED_COUNT_LUA_STATE_MAP_KEY).int_pointer_value;
-              if (insts_executed_count)
+              if (L->insts_counted)
               {
-                *insts_executed_count = *insts_executed_count + add_count;
+                L->insts_executed_count = L->insts_executed_count + add_count;
               }
             }
 
@@ -2074,4 +2448,4 @@ end
 
         }
     }
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -0,0 +1,58 @@
+#include <uvm/lprefix.h>
+
+#include <uvm/uvm_profile.h>
+#include <uvm/lobject.h>
+#include <uvm/ldebug.h>
+
+#include <numeric>
+
+namespace uvm
+{
+	namespace lua
+	{
+		namespace lib
+		{
+			uint64_t UvmProfile::instructions() const
+			{
+				return std::accumulate(opcode_counts, opcode_counts + UNUM_OPCODES, uint64_t(0));
+			}
+
+			void attach_profile(lua_State *L, UvmProfile *profile)
+			{
+				L->profile = profile;
+				if (profile)
+				{
+					// prototypes are only known to be alive while attached to the same state
+					profile->function_counters.clear();
+					L->hookmask |= UVM_MASKPROFILE;
+				}
+				else
+					L->hookmask &= ~UVM_MASKPROFILE;
+			}
+
+			void profile_instruction(lua_State *L, const Proto *p, int opcode)
+			{
+				auto profile = get_profile(L);
+				profile->opcode_counts[opcode]++;
+				auto found = profile->function_counters.find(p);
+				if (found == profile->function_counters.end())
+				{
+					std::string source = p->source ? getstr(p->source) : "?";
+					auto &counter = profile->function_instructions[source + ":" + std::to_string(p->linedefined)];
+					found = profile->function_counters.emplace(p, &counter).first;
+				}
+				(*found->second)++;
+			}
+
+			UvmProfileTime *profile_native_call(lua_State *L, CallInfo *ci)
+			{
+				lua_Debug ar;
+				ar.i_ci = ci;
+				const char *name = nullptr;
+				if (lua_getinfo(L, "n", &ar))
+					name = ar.name;
+				return &get_profile(L)->native_calls[name ? name : "?"];
+			}
+		}
+	}
+}
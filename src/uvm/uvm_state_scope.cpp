@@ -37,13 +37,203 @@ namespace uvm
     {
         namespace lib
         {
+            UvmStatePool::UvmStatePool(size_t max_size)
+                : _max_size(max_size), _hits(0), _misses(0) {}
+            UvmStatePool::~UvmStatePool() {
+                clear();
+            }
+
+            UvmStatePool &UvmStatePool::instance()
+            {
+                static UvmStatePool pool;
+                return pool;
+            }
+
+            void UvmStatePool::set_max_size(size_t max_size)
+            {
+                std::vector<lua_State*> closing;
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _max_size = max_size;
+                    while (_states.size() > _max_size)
+                    {
+                        closing.push_back(_states.back());
+                        _states.pop_back();
+                    }
+                }
+                for (auto L : closing)
+                    close_lua_state(L);
+            }
+
+            size_t UvmStatePool::max_size()
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                return _max_size;
+            }
+
+            size_t UvmStatePool::size()
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                return _states.size();
+            }
+
+            lua_State *UvmStatePool::acquire()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    if (!_states.empty())
+                    {
+                        auto L = _states.back();
+                        _states.pop_back();
+                        _hits++;
+                        return L;
+                    }
+                }
+                _misses++;
+                auto L = create_lua_state(true);
+                save_lua_state_baseline(L);
+                return L;
+            }
+
+            void UvmStatePool::release(lua_State *L)
+            {
+                if (max_size() == 0)
+                {
+                    close_lua_state(L);
+                    return;
+                }
+                luaL_commit_storage_changes(L);
+                // the state values are released even when L can't be reused
+                if (reset_lua_state(L))
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    if (_states.size() < _max_size)
+                    {
+                        _states.push_back(L);
+                        return;
+                    }
+                }
+                close_lua_state(L);
+            }
+
+            void UvmStatePool::clear()
+            {
+                std::vector<lua_State*> closing;
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    closing.swap(_states);
+                }
+                for (auto L : closing)
+                    close_lua_state(L);
+            }
+
+            UvmModuleCache::UvmModuleCache(size_t max_size)
+                : _max_size(max_size), _hits(0), _misses(0) {}
+
+            UvmModuleCache &UvmModuleCache::instance()
+            {
+                static UvmModuleCache cache;
+                return cache;
+            }
+
+            void UvmModuleCache::erase_entry(std::map<std::string, Entries::iterator>::iterator it)
+            {
+                _entries.erase(it->second);
+                _index.erase(it);
+            }
+
+            void UvmModuleCache::set_max_size(size_t max_size)
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _max_size = max_size;
+                while (_entries.size() > _max_size)
+                    erase_entry(_index.find(_entries.back()->contract_id));
+            }
+
+            size_t UvmModuleCache::max_size()
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                return _max_size;
+            }
+
+            size_t UvmModuleCache::size()
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                return _entries.size();
+            }
+
+            UvmModuleCache::StreamP UvmModuleCache::get(const std::string &contract_id, const std::string &bytecode_digest)
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                auto it = _index.find(contract_id);
+                if (it == _index.end())
+                {
+                    _misses++;
+                    return nullptr;
+                }
+                if ((*it->second)->bytecode_digest != bytecode_digest)
+                {
+                    // the contract was rolled back and created again with other bytecode
+                    erase_entry(it);
+                    _misses++;
+                    return nullptr;
+                }
+                _entries.splice(_entries.begin(), _entries, it->second);
+                _hits++;
+                return *it->second;
+            }
+
+            void UvmModuleCache::put(StreamP stream)
+            {
+                if (!stream || !stream->checked || stream->bytecode_digest.empty())
+                    return;
+                if (!stream->contract_name.empty())
+                {
+                    // names change with upgrades, so cached modules have none
+                    stream = std::make_shared<UvmModuleByteStream>(*stream);
+                    stream->contract_name = "";
+                }
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (_max_size == 0)
+                    return;
+                auto it = _index.find(stream->contract_id);
+                if (it != _index.end())
+                    erase_entry(it);
+                _entries.push_front(stream);
+                _index[stream->contract_id] = _entries.begin();
+                while (_entries.size() > _max_size)
+                    erase_entry(_index.find(_entries.back()->contract_id));
+            }
+
+            void UvmModuleCache::erase(const std::string &contract_id)
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                auto it = _index.find(contract_id);
+                if (it != _index.end())
+                    erase_entry(it);
+            }
+
+            void UvmModuleCache::clear()
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _index.clear();
+                _entries.clear();
+            }
+
             UvmStateScope::UvmStateScope(bool use_contract)
                 :_use_contract(use_contract) {
-                this->_L = create_lua_state(use_contract);
+                if (use_contract)
+                    this->_L = UvmStatePool::instance().acquire();
+                else
+                    this->_L = create_lua_state(use_contract);
             }
-            UvmStateScope::UvmStateScope(const UvmStateScope &other) : _L(other._L) {}
+            UvmStateScope::UvmStateScope(const UvmStateScope &other) : _L(other._L), _use_contract(other._use_contract) {}
             UvmStateScope::~UvmStateScope() {
-                if (nullptr != _L)
+                if (nullptr == _L)
+                    return;
+                if (_use_contract)
+                    UvmStatePool::instance().release(_L);
+                else
                     close_lua_state(_L);
             }
 